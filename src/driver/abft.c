@@ -27,16 +27,29 @@
 #include "abft.h"
 
 /**
- * Do nothing with NIC
+ * Store aBFT NIC parameters
  *
  * @v pdo		Physical device object
  * @v netcfginstanceid	Interface name within registry
- * @v opaque		iBFT NIC structure
+ * @v opaque		aBFT
  * @ret ntstatus	NT status
+ *
+ * AoE does not use TCP/IP, so only the adapter frame size is
+ * configured.
  */
-static NTSTATUS abft_dummy ( PDEVICE_OBJECT pdo,
-			     LPCWSTR netcfginstanceid,
-			     PVOID opaque ) {
+static NTSTATUS store_abft_parameters ( PDEVICE_OBJECT pdo,
+					LPCWSTR netcfginstanceid,
+					PVOID opaque ) {
+	PABFT_TABLE abft = opaque;
+	ULONG mtu;
+
+	/* Enable jumbo frames on adapter, if configured.  Treat as
+	 * non-fatal error, since the adapter may not support them.
+	 */
+	mtu = fetch_nic_mtu ( abft->mac );
+	if ( mtu )
+		store_nic_jumbo_packet ( pdo, mtu );
+
 	return STATUS_SUCCESS;
 }
 
@@ -47,6 +60,21 @@ static NTSTATUS abft_dummy ( PDEVICE_OBJECT pdo,
  */
 VOID parse_abft ( PACPI_DESCRIPTION_HEADER acpi ) {
 	PABFT_TABLE abft = ( PABFT_TABLE ) acpi;
+
+	/* Print compressed information on boot splash screen */
+	BootPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x target e%d.%d\n",
+		    abft->mac[0], abft->mac[1], abft->mac[2],
+		    abft->mac[3], abft->mac[4], abft->mac[5],
+		    abft->shelf, abft->slot );
+}
+
+/**
+ * Configure aBFT
+ *
+ * @v acpi		ACPI description header
+ */
+VOID configure_abft ( PACPI_DESCRIPTION_HEADER acpi ) {
+	PABFT_TABLE abft = ( PABFT_TABLE ) acpi;
 	NTSTATUS status;
 
 	/* Dump structure information */
@@ -55,15 +83,12 @@ VOID parse_abft ( PACPI_DESCRIPTION_HEADER acpi ) {
 		   abft->mac[0], abft->mac[1], abft->mac[2],
 		   abft->mac[3], abft->mac[4], abft->mac[5] );
 
-	/* Print compressed information on boot splash screen */
-	BootPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x target e%d.%d\n",
-		    abft->mac[0], abft->mac[1], abft->mac[2],
-		    abft->mac[3], abft->mac[4], abft->mac[5],
-		    abft->shelf, abft->slot );
-
 	/* Check for existence of NIC */
-	status = find_nic ( abft->mac, abft_dummy, NULL );
-	if ( NT_SUCCESS ( status ) ) {
+	status = find_nic ( abft->mac, NIC_PCI_NONE, store_abft_parameters,
+			    abft, sizeof ( *abft ) );
+	if ( status == STATUS_PENDING ) {
+		DbgPrint ( "Waiting for aBFT NIC\n" );
+	} else if ( NT_SUCCESS ( status ) ) {
 		DbgPrint ( "Successfully identified aBFT NIC\n" );
 	} else {
 		DbgPrint ( "Could not identify aBFT NIC\n" );
@@ -54,5 +54,6 @@ typedef struct _ABFT_TABLE {
 #pragma pack()
 
 extern VOID parse_abft ( PACPI_DESCRIPTION_HEADER acpi );
+extern VOID configure_abft ( PACPI_DESCRIPTION_HEADER acpi );
 
 #endif /* _ABFT_H */
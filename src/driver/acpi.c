@@ -105,3 +105,17 @@ NTSTATUS find_acpi_table ( PCHAR signature,
  err_mmmapiospace:
 	return status;
 }
+
+/**
+ * Fix up ACPI table checksum
+ *
+ * @v table		ACPI table
+ *
+ * This must be called after modifying a copy of a table.
+ */
+VOID fix_acpi_checksum ( PACPI_DESCRIPTION_HEADER table ) {
+
+	table->checksum = ( ( UCHAR ) ( table->checksum -
+					byte_sum ( ( ( PUCHAR ) table ),
+						   table->length ) ) );
+}
@@ -38,5 +38,6 @@ typedef struct _ACPI_DESCRIPTION_HEADER {
 
 extern NTSTATUS find_acpi_table ( PCHAR signature,
 				  PACPI_DESCRIPTION_HEADER *table_copy );
+extern VOID fix_acpi_checksum ( PACPI_DESCRIPTION_HEADER table );
 
 #endif /* _ACPI_H */
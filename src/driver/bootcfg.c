@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <ntddk.h>
+#define NTSTRSAFE_LIB
+#include <ntstrsafe.h>
+#include "sanbootconf.h"
+#include "registry.h"
+#include "bootcfg.h"
+
+/** Boot configuration record for this boot */
+BOOTCFG_RECORD boot_config = {
+	BOOTCFG_VERSION, sizeof ( BOOTCFG_RECORD ),
+};
+
+/** Boot configuration record has been saved */
+static BOOLEAN bootcfg_saved;
+
+/** Boot configuration record lock
+ *
+ * This serialises updates made after NIC arrival against saving the
+ * record.
+ */
+static KEVENT bootcfg_lock;
+
+/**
+ * Initialise boot configuration record
+ *
+ */
+VOID bootcfg_init ( VOID ) {
+	KeInitializeEvent ( &bootcfg_lock, SynchronizationEvent, TRUE );
+}
+
+/**
+ * Add NIC to boot configuration record
+ *
+ * @ret nic		Boot configuration NIC, or NULL
+ */
+PBOOTCFG_NIC bootcfg_add_nic ( VOID ) {
+
+	if ( boot_config.num_nics >= BOOTCFG_MAX_NICS ) {
+		DbgPrint ( "Too many NICs for boot configuration record\n" );
+		return NULL;
+	}
+	return &boot_config.nics[ boot_config.num_nics++ ];
+}
+
+/**
+ * Add target to boot configuration record
+ *
+ * @ret target		Boot configuration target, or NULL
+ */
+PBOOTCFG_TARGET bootcfg_add_target ( VOID ) {
+
+	if ( boot_config.num_targets >= BOOTCFG_MAX_TARGETS ) {
+		DbgPrint ( "Too many targets for boot configuration record\n" );
+		return NULL;
+	}
+	return &boot_config.targets[ boot_config.num_targets++ ];
+}
+
+/**
+ * Store boot configuration record
+ *
+ */
+static VOID bootcfg_store ( VOID ) {
+	HANDLE reg_key;
+	NTSTATUS status;
+
+	/* Open Parameters key */
+	status = reg_open_parameters ( &reg_key, REG_SITE_BOOTCFG );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not open Parameters key: %x\n", status );
+		goto err_reg_open;
+	}
+
+	/* Store record */
+	status = reg_store_binary ( reg_key, BOOTCFG_VALUE_NAME, &boot_config,
+				    sizeof ( boot_config ) );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store_binary;
+
+ err_reg_store_binary:
+	reg_close ( reg_key );
+ err_reg_open:
+	return;
+}
+
+/**
+ * Record interface chosen for boot configuration NIC
+ *
+ * @v index		iBFT NIC index
+ * @v netcfginstanceid	Interface name within registry
+ *
+ * A NIC may be configured only after it arrives, which may be after
+ * the record has been saved.  In this case, the record is saved again.
+ */
+VOID bootcfg_set_nic_interface ( UCHAR index, LPCWSTR netcfginstanceid ) {
+	PBOOTCFG_NIC nic;
+	ULONG i;
+
+	KeWaitForSingleObject ( &bootcfg_lock, Executive, KernelMode,
+				FALSE, NULL );
+	for ( i = 0 ; i < boot_config.num_nics ; i++ ) {
+		nic = &boot_config.nics[i];
+		if ( nic->index != index )
+			continue;
+		RtlStringCbCopyW ( nic->netcfginstanceid,
+				   sizeof ( nic->netcfginstanceid ),
+				   netcfginstanceid );
+		nic->state = BOOTCFG_NIC_CONFIGURED;
+		if ( bootcfg_saved )
+			bootcfg_store();
+		break;
+	}
+	KeSetEvent ( &bootcfg_lock, IO_NO_INCREMENT, FALSE );
+}
+
+/**
+ * Save boot configuration record
+ *
+ */
+VOID bootcfg_save ( VOID ) {
+
+	KeWaitForSingleObject ( &bootcfg_lock, Executive, KernelMode,
+				FALSE, NULL );
+	DbgPrint ( "Boot configuration: %ld NIC(s), %ld target(s), system "
+		   "disk %sfound\n", boot_config.num_nics,
+		   boot_config.num_targets,
+		   ( boot_config.disk.found ? "" : "not " ) );
+	/* Any interface recorded after this point will trigger a
+	 * further store.
+	 */
+	bootcfg_saved = TRUE;
+	bootcfg_store();
+	KeSetEvent ( &bootcfg_lock, IO_NO_INCREMENT, FALSE );
+}
@@ -0,0 +1,167 @@
+#ifndef _BOOTCFG_H
+#define _BOOTCFG_H
+
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * Boot configuration record
+ *
+ * The boot configuration as decoded from the boot firmware tables,
+ * together with the NIC interfaces and system disk that were chosen
+ * for it, is stored as the REG_BINARY value "BootConfiguration" under
+ * the driver's Parameters key.  This allows post-boot consumers to
+ * retrieve the complete configuration with a single registry query.
+ */
+
+/** Boot configuration registry value name */
+#define BOOTCFG_VALUE_NAME L"BootConfiguration"
+
+/** Boot configuration format version */
+#define BOOTCFG_VERSION 1
+
+/** Maximum number of NICs */
+#define BOOTCFG_MAX_NICS 2
+
+/** Maximum number of targets */
+#define BOOTCFG_MAX_TARGETS 2
+
+/** Maximum length of an iSCSI name (including NUL) */
+#define BOOTCFG_NAME_LEN 224
+
+/** Maximum length of a NetCfgInstanceId (including NUL) */
+#define BOOTCFG_GUID_LEN 40
+
+/** Maximum length of a system disk device name (including NUL) */
+#define BOOTCFG_DISK_NAME_LEN 128
+
+/** A boot configuration NIC */
+#pragma pack(1)
+typedef struct _BOOTCFG_NIC {
+	/** iBFT NIC index */
+	UCHAR index;
+	/** iBFT NIC flags */
+	UCHAR flags;
+	/** Configuration state
+	 *
+	 * This is a BOOTCFG_NIC_XXX constant.
+	 */
+	UCHAR state;
+	/** Subnet mask prefix length */
+	UCHAR subnet_mask_prefix;
+	/** MAC address */
+	UCHAR mac[6];
+	/** VLAN tag */
+	USHORT vlan;
+	/** PCI bus:dev.fn */
+	ULONG pci_bus_dev_func;
+	/** IPv4 address */
+	ULONG ip_address;
+	/** IPv4 default gateway */
+	ULONG gateway;
+	/** IPv4 DNS servers */
+	ULONG dns[2];
+	/** NetCfgInstanceId of chosen interface, if known */
+	WCHAR netcfginstanceid[BOOTCFG_GUID_LEN];
+} BOOTCFG_NIC, *PBOOTCFG_NIC;
+#pragma pack()
+
+/** NIC has not yet been configured */
+#define BOOTCFG_NIC_UNCONFIGURED 0
+
+/** NIC has been configured */
+#define BOOTCFG_NIC_CONFIGURED 1
+
+/** A boot configuration target */
+#pragma pack(1)
+typedef struct _BOOTCFG_TARGET {
+	/** iBFT target index */
+	UCHAR index;
+	/** iBFT target flags */
+	UCHAR flags;
+	/** Associated iBFT NIC index */
+	UCHAR nic_association;
+	/** CHAP type */
+	UCHAR chap_type;
+	/** IPv4 address */
+	ULONG ip_address;
+	/** TCP port */
+	USHORT port;
+	/** Reserved */
+	USHORT reserved;
+	/** Boot LUN */
+	UCHAR boot_lun[8];
+	/** Target name */
+	CHAR name[BOOTCFG_NAME_LEN];
+} BOOTCFG_TARGET, *PBOOTCFG_TARGET;
+#pragma pack()
+
+/** A boot configuration system disk */
+#pragma pack(1)
+typedef struct _BOOTCFG_DISK {
+	/** System disk was found */
+	ULONG found;
+	/** Partition style (PARTITION_STYLE) */
+	ULONG partition_style;
+	/** MBR disk signature */
+	ULONG mbr_signature;
+	/** GPT disk identifier */
+	GUID gpt_disk_id;
+	/** Disk device interface name */
+	WCHAR name[BOOTCFG_DISK_NAME_LEN];
+} BOOTCFG_DISK, *PBOOTCFG_DISK;
+#pragma pack()
+
+/** A boot configuration record */
+#pragma pack(1)
+typedef struct _BOOTCFG_RECORD {
+	/** Format version */
+	ULONG version;
+	/** Length of record */
+	ULONG length;
+	/** Boot firmware tables found
+	 *
+	 * This is a bitmask of HISTORY_TABLE_XXX values.
+	 */
+	ULONG tables;
+	/** Number of NICs */
+	ULONG num_nics;
+	/** Number of targets */
+	ULONG num_targets;
+	/** Initiator name */
+	CHAR initiator_name[BOOTCFG_NAME_LEN];
+	/** NICs */
+	BOOTCFG_NIC nics[BOOTCFG_MAX_NICS];
+	/** Targets */
+	BOOTCFG_TARGET targets[BOOTCFG_MAX_TARGETS];
+	/** System disk */
+	BOOTCFG_DISK disk;
+} BOOTCFG_RECORD, *PBOOTCFG_RECORD;
+#pragma pack()
+
+extern BOOTCFG_RECORD boot_config;
+
+extern VOID bootcfg_init ( VOID );
+extern PBOOTCFG_NIC bootcfg_add_nic ( VOID );
+extern PBOOTCFG_TARGET bootcfg_add_target ( VOID );
+extern VOID bootcfg_set_nic_interface ( UCHAR index,
+					LPCWSTR netcfginstanceid );
+extern VOID bootcfg_save ( VOID );
+
+#endif /* _BOOTCFG_H */
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * Device interface state tracking
+ *
+ * Opening an inactive device interface requires it to be enabled
+ * first.  Every call to IoSetDeviceInterfaceState() generates PnP
+ * notifications to every other listener on the system, so rather
+ * than enabling and disabling an interface each time we look at it,
+ * we enable each interface at most once and disable all of the
+ * interfaces that we enabled in a single batch once we are finished
+ * probing.
+ */
+
+#include <ntddk.h>
+#include "sanbootconf.h"
+#include "devintf.h"
+
+/** A tracked device interface */
+typedef struct _DEVINTF {
+	/** List of tracked device interfaces */
+	LIST_ENTRY list;
+	/** Interface was enabled by us, and must be disabled */
+	BOOLEAN must_disable;
+	/** Symbolic link name */
+	UNICODE_STRING name;
+	/** Symbolic link name buffer */
+	WCHAR buf[1];
+} DEVINTF, *PDEVINTF;
+
+/** List of tracked device interfaces */
+static LIST_ENTRY devintfs = { &devintfs, &devintfs };
+
+/** Lock protecting list of tracked device interfaces
+ *
+ * This is a synchronisation event rather than a fast mutex, since
+ * IoSetDeviceInterfaceState() must be called at PASSIVE_LEVEL.
+ */
+static KEVENT devintfs_lock;
+
+/** Number of interface state changes actually made */
+ULONG devintf_toggles;
+
+/** Number of interface state changes avoided */
+ULONG devintf_toggles_avoided;
+
+/**
+ * Initialise device interface tracking
+ *
+ */
+VOID devintf_init ( VOID ) {
+	KeInitializeEvent ( &devintfs_lock, SynchronizationEvent, TRUE );
+}
+
+/**
+ * Find tracked device interface
+ *
+ * @v name		Symbolic link name
+ * @ret devintf		Tracked device interface, or NULL
+ */
+static PDEVINTF devintf_find ( PUNICODE_STRING name ) {
+	PLIST_ENTRY entry;
+	PDEVINTF devintf;
+
+	for ( entry = devintfs.Flink ; entry != &devintfs ;
+	      entry = entry->Flink ) {
+		devintf = CONTAINING_RECORD ( entry, DEVINTF, list );
+		if ( RtlEqualUnicodeString ( &devintf->name, name, TRUE ) )
+			return devintf;
+	}
+	return NULL;
+}
+
+/**
+ * Enable device interface for the remainder of the probing phase
+ *
+ * @v name		Symbolic link name
+ * @ret ntstatus	NT status
+ */
+NTSTATUS devintf_enable ( PUNICODE_STRING name ) {
+	PDEVINTF devintf;
+	ULONG len;
+	NTSTATUS status;
+
+	KeWaitForSingleObject ( &devintfs_lock, Executive, KernelMode,
+				FALSE, NULL );
+
+	/* Do nothing if we have already seen this interface.  Under
+	 * the enable-probe-disable scheme, an interface that we had
+	 * to enable would have been toggled twice more.
+	 */
+	devintf = devintf_find ( name );
+	if ( devintf ) {
+		if ( devintf->must_disable )
+			devintf_toggles_avoided += 2;
+		status = STATUS_SUCCESS;
+		goto done;
+	}
+
+	/* Allocate tracking record */
+	len = ( sizeof ( *devintf ) + name->Length );
+	devintf = ExAllocatePoolWithTag ( NonPagedPool, len,
+					  SANBOOTCONF_POOL_TAG );
+	if ( ! devintf ) {
+		DbgPrint ( "Could not allocate interface record for "
+			   "\"%wZ\"\n", name );
+		status = STATUS_NO_MEMORY;
+		goto done;
+	}
+	RtlZeroMemory ( devintf, len );
+	devintf->name.Buffer = devintf->buf;
+	devintf->name.MaximumLength = ( ( USHORT ) ( name->Length +
+						     sizeof ( WCHAR ) ) );
+	RtlCopyUnicodeString ( &devintf->name, name );
+
+	/* Enable interface if not already done */
+	status = IoSetDeviceInterfaceState ( name, TRUE );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not enable interface \"%wZ\": %x\n",
+			   name, status );
+		ExFreePool ( devintf );
+		goto done;
+	}
+	/* If interface is already enabled, IoSetDeviceInterfaceState
+	 * will return STATUS_OBJECT_NAME_EXISTS, which counts as a
+	 * success status.
+	 */
+	if ( status != STATUS_OBJECT_NAME_EXISTS ) {
+		devintf->must_disable = TRUE;
+		devintf_toggles++;
+	}
+
+	/* Record interface */
+	InsertTailList ( &devintfs, &devintf->list );
+	status = STATUS_SUCCESS;
+
+ done:
+	KeSetEvent ( &devintfs_lock, IO_NO_INCREMENT, FALSE );
+	return status;
+}
+
+/**
+ * Restore state of all device interfaces enabled during probing
+ *
+ */
+VOID devintf_restore ( VOID ) {
+	PLIST_ENTRY entry;
+	PDEVINTF devintf;
+
+	KeWaitForSingleObject ( &devintfs_lock, Executive, KernelMode,
+				FALSE, NULL );
+
+	/* Disable any interfaces that we enabled */
+	while ( ! IsListEmpty ( &devintfs ) ) {
+		entry = RemoveHeadList ( &devintfs );
+		devintf = CONTAINING_RECORD ( entry, DEVINTF, list );
+		if ( devintf->must_disable ) {
+			IoSetDeviceInterfaceState ( &devintf->name, FALSE );
+			devintf_toggles++;
+		}
+		ExFreePool ( devintf );
+	}
+
+	KeSetEvent ( &devintfs_lock, IO_NO_INCREMENT, FALSE );
+
+	DbgPrint ( "Made %ld interface state change(s), avoided %ld\n",
+		   devintf_toggles, devintf_toggles_avoided );
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <ntddk.h>
+#include "sanbootconf.h"
+#include "registry.h"
+#include "history.h"
+
+/** Boot history record for this boot */
+HISTORY_RECORD boot_history;
+
+/** Boot history record has been saved */
+static BOOLEAN history_saved;
+
+/** Boot history ring count immediately after this boot's record */
+static ULONG history_count;
+
+/** Boot history lock */
+static KEVENT history_lock;
+
+/**
+ * Initialise boot history
+ *
+ */
+VOID history_init ( VOID ) {
+	KeInitializeEvent ( &history_lock, SynchronizationEvent, TRUE );
+}
+
+/**
+ * Get current time
+ *
+ * @ret now		Current time, in milliseconds
+ */
+ULONGLONG history_now ( VOID ) {
+	return ( KeQueryInterruptTime() / 10000 );
+}
+
+/**
+ * Fetch existing boot history ring
+ *
+ * @v reg_key		Parameters key
+ * @v ring		Boot history ring to fill in
+ *
+ * If the existing ring is missing or unusable, an empty ring is
+ * created.
+ */
+static VOID history_fetch ( HANDLE reg_key, PHISTORY_RING ring ) {
+	PKEY_VALUE_PARTIAL_INFORMATION kvi;
+	PHISTORY_RING old;
+	NTSTATUS status;
+
+	/* Start with an empty ring */
+	RtlZeroMemory ( ring, sizeof ( *ring ) );
+	ring->version = HISTORY_VERSION;
+	ring->record_len = sizeof ( ring->records[0] );
+	ring->max_records = HISTORY_MAX_RECORDS;
+
+	/* Fetch existing ring, if any */
+	status = reg_fetch_kvi ( reg_key, HISTORY_VALUE_NAME, &kvi );
+	if ( ! NT_SUCCESS ( status ) )
+		return;
+
+	/* Use existing ring only if it matches our format exactly */
+	old = ( ( PHISTORY_RING ) kvi->Data );
+	if ( ( kvi->Type == REG_BINARY ) &&
+	     ( kvi->DataLength == sizeof ( *ring ) ) &&
+	     ( old->version == ring->version ) &&
+	     ( old->record_len == ring->record_len ) &&
+	     ( old->max_records == ring->max_records ) ) {
+		RtlCopyMemory ( ring, old, sizeof ( *ring ) );
+	} else {
+		DbgPrint ( "Discarding incompatible boot history\n" );
+	}
+
+	ExFreePool ( kvi );
+}
+
+/**
+ * Store this boot's record in the boot history ring
+ *
+ * The record is appended to the ring when first stored, and updated
+ * in place thereafter.  The caller must hold the boot history lock.
+ */
+static VOID history_store ( VOID ) {
+	PHISTORY_RECORD record = &boot_history;
+	PHISTORY_RING ring;
+	HANDLE reg_key;
+	NTSTATUS status;
+
+	DbgPrint ( "Boot history: tables %#x failures %#x configure %ldms "
+		   "NICs %ldms (%ld found, %ld missing) disk %ldms (%ld "
+		   "attempt(s), %ld probe(s)) NIC cache %ld hit(s) %ld "
+		   "miss(es) saved %ldms registry writes %ld (%ld skipped)\n",
+		   record->tables,
+		   record->failures, record->configure_time,
+		   record->nic_time, record->nics_found,
+		   record->nics_missing, record->disk_time,
+		   record->disk_attempts, record->disk_probes,
+		   record->nic_cache_hits, record->nic_cache_misses,
+		   record->nic_cache_saved, record->reg_writes,
+		   record->reg_writes_skipped );
+
+	/* Allocate ring */
+	ring = ExAllocatePoolWithTag ( NonPagedPool, sizeof ( *ring ),
+				       SANBOOTCONF_POOL_TAG );
+	if ( ! ring ) {
+		DbgPrint ( "Could not allocate boot history\n" );
+		goto err_exallocatepoolwithtag;
+	}
+
+	/* Open Parameters key */
+	status = reg_open_parameters ( &reg_key, REG_SITE_HISTORY );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not open Parameters key: %x\n", status );
+		goto err_reg_open;
+	}
+
+	/* Append record to ring, or update record if already saved */
+	history_fetch ( reg_key, ring );
+	if ( ! ( history_saved && ( ring->count == history_count ) ) )
+		ring->count++;
+	RtlCopyMemory ( &ring->records[ ( ring->count - 1 ) %
+					ring->max_records ],
+			record, sizeof ( *record ) );
+	history_count = ring->count;
+	history_saved = TRUE;
+
+	/* Store ring */
+	status = reg_store_binary ( reg_key, HISTORY_VALUE_NAME, ring,
+				    sizeof ( *ring ) );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store_binary;
+
+ err_reg_store_binary:
+	reg_close ( reg_key );
+ err_reg_open:
+	ExFreePool ( ring );
+ err_exallocatepoolwithtag:
+	return;
+}
+
+/**
+ * Append this boot's record to the boot history ring
+ *
+ */
+VOID history_save ( VOID ) {
+
+	KeWaitForSingleObject ( &history_lock, Executive, KernelMode,
+				FALSE, NULL );
+	history_store();
+	KeSetEvent ( &history_lock, IO_NO_INCREMENT, FALSE );
+}
+
+/**
+ * Update this boot's record, if already saved
+ *
+ * This is used to record events, such as the arrival of a pending
+ * NIC, that may occur after the record has been saved.
+ */
+VOID history_update ( VOID ) {
+
+	KeWaitForSingleObject ( &history_lock, Executive, KernelMode,
+				FALSE, NULL );
+	if ( history_saved )
+		history_store();
+	KeSetEvent ( &history_lock, IO_NO_INCREMENT, FALSE );
+}
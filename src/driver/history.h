@@ -0,0 +1,125 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * Boot latency history
+ *
+ * A fixed-size record is appended for each boot to a bounded ring
+ * stored as the REG_BINARY value "BootHistory" under the driver's
+ * Parameters key.  The ring consists of a HISTORY_RING header
+ * followed by up to HISTORY_MAX_RECORDS records.  The most recent
+ * record is at index ( ( count - 1 ) % max_records ).
+ */
+
+/** Boot history registry value name */
+#define HISTORY_VALUE_NAME L"BootHistory"
+
+/** Boot history format version */
+#define HISTORY_VERSION 3
+
+/** Maximum number of boot history records */
+#define HISTORY_MAX_RECORDS 32
+
+/** A boot history record */
+#pragma pack(1)
+typedef struct _HISTORY_RECORD {
+	/** System time at which driver was loaded */
+	LARGE_INTEGER boot_time;
+	/** Boot firmware tables found
+	 *
+	 * This is a bitmask of HISTORY_TABLE_XXX values.
+	 */
+	ULONG tables;
+	/** Failures encountered
+	 *
+	 * This is a bitmask of HISTORY_FAIL_XXX values.
+	 */
+	ULONG failures;
+	/** Time taken by deferred table configuration, in milliseconds */
+	ULONG configure_time;
+	/** Time taken to find NICs, in milliseconds */
+	ULONG nic_time;
+	/** Number of NICs found */
+	ULONG nics_found;
+	/** Number of NICs not found */
+	ULONG nics_missing;
+	/** Time taken to find system disk, in milliseconds */
+	ULONG disk_time;
+	/** Number of system disk checks made */
+	ULONG disk_attempts;
+	/** Number of disks probed */
+	ULONG disk_probes;
+	/** Number of NICs found via binding cache */
+	ULONG nic_cache_hits;
+	/** Number of NICs not found via binding cache */
+	ULONG nic_cache_misses;
+	/** Estimated time saved by binding cache, in milliseconds */
+	ULONG nic_cache_saved;
+	/** Number of registry writes performed */
+	ULONG reg_writes;
+	/** Number of registry writes skipped as unchanged */
+	ULONG reg_writes_skipped;
+} HISTORY_RECORD, *PHISTORY_RECORD;
+#pragma pack()
+
+/** iBFT was found */
+#define HISTORY_TABLE_IBFT 0x01
+
+/** aBFT was found */
+#define HISTORY_TABLE_ABFT 0x02
+
+/** sBFT was found */
+#define HISTORY_TABLE_SBFT 0x04
+
+/** System disk was not found */
+#define HISTORY_FAIL_DISK 0x01
+
+/** A boot firmware table NIC was not found */
+#define HISTORY_FAIL_NIC 0x02
+
+/** A boot firmware table NIC could not be configured */
+#define HISTORY_FAIL_NIC_CONFIG 0x04
+
+/** Boot history ring */
+#pragma pack(1)
+typedef struct _HISTORY_RING {
+	/** Format version */
+	ULONG version;
+	/** Length of each record */
+	USHORT record_len;
+	/** Maximum number of records */
+	USHORT max_records;
+	/** Total number of records ever written */
+	ULONG count;
+	/** Records */
+	HISTORY_RECORD records[HISTORY_MAX_RECORDS];
+} HISTORY_RING, *PHISTORY_RING;
+#pragma pack()
+
+extern HISTORY_RECORD boot_history;
+
+extern VOID history_init ( VOID );
+extern ULONGLONG history_now ( VOID );
+extern VOID history_save ( VOID );
+extern VOID history_update ( VOID );
+
+#endif /* _HISTORY_H */
@@ -26,8 +26,64 @@
 #include "boottext.h"
 #include "registry.h"
 #include "nic.h"
+#include "bootcfg.h"
 #include "ibft.h"
 
+/** Provision MPIO when the iBFT describes multiple paths to a target */
+BOOLEAN ibft_multipath_enabled = FALSE;
+
+/** Number of TCP segments to receive before sending an ACK */
+ULONG ibft_tcp_ack_frequency = IBFT_PARAM_UNSET;
+
+/** iSCSI maximum transfer length, in bytes */
+ULONG ibft_iscsi_max_transfer_length = IBFT_PARAM_UNSET;
+
+/** iSCSI first burst length, in bytes */
+ULONG ibft_iscsi_first_burst_length = IBFT_PARAM_UNSET;
+
+/** iSCSI maximum burst length, in bytes */
+ULONG ibft_iscsi_max_burst_length = IBFT_PARAM_UNSET;
+
+/** iSCSI maximum receive data segment length, in bytes */
+ULONG ibft_iscsi_max_recv_data_segment_length = IBFT_PARAM_UNSET;
+
+/** iSCSI link down time, in seconds */
+ULONG ibft_iscsi_link_down_time = IBFT_PARAM_UNSET;
+
+/** iSCSI maximum request hold time, in seconds */
+ULONG ibft_iscsi_max_request_hold_time = IBFT_PARAM_UNSET;
+
+/** Disk I/O timeout, in seconds */
+ULONG ibft_disk_timeout = IBFT_PARAM_UNSET;
+
+/** A tuning value to be written to a registry key */
+typedef struct _IBFT_REG_PARAM {
+	/** Registry value name */
+	LPCWSTR name;
+	/** Configured value, or IBFT_PARAM_UNSET */
+	PULONG value;
+} IBFT_REG_PARAM, *PIBFT_REG_PARAM;
+
+/** TCP tuning values for the boot interface
+ *
+ * Only values that TCP/IP reads from the per-interface key are
+ * included.
+ */
+static const IBFT_REG_PARAM ibft_tcp_params[] = {
+	{ L"TcpAckFrequency", &ibft_tcp_ack_frequency },
+};
+
+/** Tuning values for the Microsoft iSCSI initiator */
+static const IBFT_REG_PARAM ibft_iscsiprt_params[] = {
+	{ L"MaxTransferLength", &ibft_iscsi_max_transfer_length },
+	{ L"FirstBurstLength", &ibft_iscsi_first_burst_length },
+	{ L"MaxBurstLength", &ibft_iscsi_max_burst_length },
+	{ L"MaxRecvDataSegmentLength",
+	  &ibft_iscsi_max_recv_data_segment_length },
+	{ L"LinkDownTime", &ibft_iscsi_link_down_time },
+	{ L"MaxRequestHoldTime", &ibft_iscsi_max_request_hold_time },
+};
+
 /**
  * Convert IPv4 address to string
  *
@@ -63,6 +119,8 @@ static BOOLEAN ibft_string_exists ( PIBFT_STRING string ) {
  * @v ibft		iBFT
  * @v string		iBFT string
  * @ret string		Standard C string
+ *
+ * The string must lie within a structure validated by index_ibft().
  */
 static LPSTR ibft_string ( PIBFT_TABLE ibft, PIBFT_STRING string ) {
 	if ( string->offset ) {
@@ -119,13 +177,13 @@ static void ibft_set_ipaddr ( PIBFT_IPADDR ipaddr, ULONG in ) {
 }
 
 /**
- * Parse iBFT initiator structure
+ * Dump iBFT initiator structure
  *
  * @v ibft		iBFT
  * @v initiator		Initiator structure
  */
-static VOID parse_ibft_initiator ( PIBFT_TABLE ibft,
-				   PIBFT_INITIATOR initiator ) {
+static VOID dump_ibft_initiator ( PIBFT_TABLE ibft,
+				  PIBFT_INITIATOR initiator ) {
 	PIBFT_HEADER header = &initiator->header;
 
 	/* Dump structure information */
@@ -143,6 +201,20 @@ static VOID parse_ibft_initiator ( PIBFT_TABLE ibft,
 	DbgPrint ( ", %s\n", ibft_ipaddr ( &initiator->radius[1] ) );
 	DbgPrint ( "  Name = %s\n",
 		   ibft_string ( ibft, &initiator->initiator_name ) );
+}
+
+/**
+ * Parse iBFT initiator structure
+ *
+ * @v ibft		iBFT
+ * @v initiator		Initiator structure
+ */
+static VOID parse_ibft_initiator ( PIBFT_TABLE ibft,
+				   PIBFT_INITIATOR initiator ) {
+	PIBFT_HEADER header = &initiator->header;
+
+	if ( ! ( header->flags & IBFT_FL_INITIATOR_BLOCK_VALID ) )
+		return;
 
 	/* Print compressed information on boot splash screen */
 	BootPrint ( "%s\n", ibft_string ( ibft, &initiator->initiator_name ) );
@@ -197,6 +269,49 @@ static NTSTATUS store_ipv4_parameter_multi_sz ( HANDLE reg_key,
 	return reg_store_multi_sz ( reg_key, value_name, value, NULL );
 }
 
+/**
+ * Store configured tuning values in registry
+ *
+ * @v reg_key		Registry key
+ * @v params		Tuning values
+ * @v count		Number of tuning values
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS store_reg_params ( HANDLE reg_key,
+				   const IBFT_REG_PARAM *params,
+				   ULONG count ) {
+	ULONG i;
+	NTSTATUS status;
+
+	for ( i = 0 ; i < count ; i++ ) {
+		if ( *params[i].value == IBFT_PARAM_UNSET )
+			continue;
+		status = reg_store_dword ( reg_key, params[i].name,
+					   *params[i].value );
+		if ( ! NT_SUCCESS ( status ) )
+			return status;
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Check for configured tuning values
+ *
+ * @v params		Tuning values
+ * @v count		Number of tuning values
+ * @ret configured	At least one value is configured
+ */
+static BOOLEAN reg_params_configured ( const IBFT_REG_PARAM *params,
+				       ULONG count ) {
+	ULONG i;
+
+	for ( i = 0 ; i < count ; i++ ) {
+		if ( *params[i].value != IBFT_PARAM_UNSET )
+			return TRUE;
+	}
+	return FALSE;
+}
+
 /**
  * Store TCP/IP parameters in registry
  *
@@ -208,18 +323,19 @@ static NTSTATUS store_ipv4_parameter_multi_sz ( HANDLE reg_key,
 static NTSTATUS store_tcpip_parameters ( PDEVICE_OBJECT pdo,
 					 LPCWSTR netcfginstanceid,
 					 PVOID opaque ) {
-	LPCWSTR key_name_prefix = ( L"\\Registry\\Machine\\SYSTEM\\"
-				    L"CurrentControlSet\\Services\\"
-				    L"Tcpip\\Parameters\\Interfaces" );
 	PIBFT_NIC nic = opaque;
+	REG_BATCH batch;
 	HANDLE reg_key;
 	ULONG subnet_mask;
+	ULONG mtu;
 	NTSTATUS status;
 
-	/* Open key */
-	status = reg_open ( &reg_key, key_name_prefix, netcfginstanceid, NULL );
+	/* Open key.  All values are committed together. */
+	status = reg_batch_begin_tcpip_interface ( &batch, netcfginstanceid,
+						  REG_SITE_TCPIP_PARAMETERS );
 	if ( ! NT_SUCCESS ( status ) )
-		goto err_reg_open;
+		goto err_reg_batch_begin;
+	reg_key = batch.reg_key;
 
 	/* Store IP address */
 	status = store_ipv4_parameter_multi_sz ( reg_key, L"IPAddress",
@@ -251,7 +367,177 @@ static NTSTATUS store_tcpip_parameters ( PDEVICE_OBJECT pdo,
 	if ( ! NT_SUCCESS ( status ) )
 		goto err_reg_store;
 
+	/* Store TCP tuning values, if configured */
+	status = store_reg_params ( reg_key, ibft_tcp_params,
+				    ARRAYSIZE ( ibft_tcp_params ) );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store;
+
+	/* Store MTU, if configured */
+	mtu = fetch_nic_mtu ( nic->mac_address );
+	if ( mtu ) {
+		status = reg_store_dword ( reg_key, L"MTU", mtu );
+		if ( ! NT_SUCCESS ( status ) )
+			goto err_reg_store;
+	}
+
+	/* Commit values */
+	status = reg_batch_commit ( &batch );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_batch_commit;
+
+	/* Record chosen interface */
+	bootcfg_set_nic_interface ( nic->header.index, netcfginstanceid );
+
+	/* Enable jumbo frames on adapter, if configured.  Treat as
+	 * non-fatal error, since the adapter may not support them.
+	 */
+	if ( mtu )
+		store_nic_jumbo_packet ( pdo, mtu );
+
+	return STATUS_SUCCESS;
+
  err_reg_store:
+	reg_batch_abort ( &batch );
+ err_reg_batch_commit:
+ err_reg_batch_begin:
+	return status;
+}
+
+/**
+ * Open Microsoft iSCSI initiator instance key
+ *
+ * @v reg_key		Registry key to fill in
+ * @ret ntstatus	NT status
+ *
+ * The initiator is the SCSI adapter class instance with a matching
+ * device ID of "root\iscsiprt".
+ */
+static NTSTATUS reg_open_iscsiprt ( PHANDLE reg_key ) {
+	WCHAR name[16];
+	HANDLE class_key;
+	LPWSTR device_id;
+	BOOLEAN found;
+	ULONG i;
+	NTSTATUS status;
+
+	/* Open SCSI adapter class key */
+	status = reg_open ( &class_key, REG_SITE_ISCSIPRT_PARAMETERS,
+			    L"\\Registry\\Machine\\SYSTEM\\"
+			    L"CurrentControlSet\\Control\\Class\\"
+			    L"{4D36E97B-E325-11CE-BFC1-08002BE10318}", NULL );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_open;
+
+	/* Find initiator instance */
+	for ( i = 0 ; ; i++ ) {
+		status = reg_enum_subkey ( class_key, i, name,
+					   sizeof ( name ) );
+		if ( status == STATUS_BUFFER_OVERFLOW )
+			continue;
+		if ( ! NT_SUCCESS ( status ) )
+			goto err_reg_enum_subkey;
+		status = reg_open_relative ( reg_key, class_key, name );
+		if ( ! NT_SUCCESS ( status ) )
+			continue;
+		status = reg_fetch_sz ( *reg_key, L"MatchingDeviceId",
+					&device_id );
+		if ( NT_SUCCESS ( status ) ) {
+			found = ( _wcsicmp ( device_id,
+					     IBFT_ISCSIPRT_DEVICE_ID ) == 0 );
+			ExFreePool ( device_id );
+			if ( found ) {
+				DbgPrint ( "Found iSCSI initiator instance "
+					   "%S\n", name );
+				break;
+			}
+		}
+		reg_close ( *reg_key );
+	}
+
+ err_reg_enum_subkey:
+	reg_close ( class_key );
+ err_reg_open:
+	return status;
+}
+
+/**
+ * Store Microsoft iSCSI initiator parameters in registry
+ *
+ * @ret ntstatus	NT status
+ *
+ * When booting from iSCSI, the initiator has already started and
+ * logged in to the boot target by the time the iBFT is parsed, and
+ * reads its Parameters key only when it starts.  The stored values
+ * therefore take effect from the next boot.
+ */
+static NTSTATUS store_iscsiprt_parameters ( VOID ) {
+	HANDLE instance_key;
+	HANDLE reg_key;
+	NTSTATUS status;
+
+	/* Do nothing unless a profile is configured */
+	if ( ! reg_params_configured ( ibft_iscsiprt_params,
+				       ARRAYSIZE ( ibft_iscsiprt_params ) ) )
+		return STATUS_SUCCESS;
+
+	/* Open initiator Parameters key */
+	status = reg_open_iscsiprt ( &instance_key );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not find iSCSI initiator instance: %x\n",
+			   status );
+		goto err_reg_open_iscsiprt;
+	}
+	status = reg_open_relative ( &reg_key, instance_key, L"Parameters" );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_open_relative;
+
+	/* Store values */
+	status = store_reg_params ( reg_key, ibft_iscsiprt_params,
+				    ARRAYSIZE ( ibft_iscsiprt_params ) );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_store_reg_params;
+	BootPrint ( "iSCSI initiator parameters are pending until next "
+		    "boot\n" );
+
+ err_store_reg_params:
+	reg_close ( reg_key );
+ err_reg_open_relative:
+	reg_close ( instance_key );
+ err_reg_open_iscsiprt:
+	return status;
+}
+
+/**
+ * Store disk timeout in registry
+ *
+ * @ret ntstatus	NT status
+ *
+ * As with the initiator parameters, the disk class driver has already
+ * started, and so the timeout takes effect from the next boot.
+ */
+static NTSTATUS store_disk_timeout ( VOID ) {
+	HANDLE reg_key;
+	NTSTATUS status;
+
+	/* Do nothing unless a timeout is configured */
+	if ( ibft_disk_timeout == IBFT_PARAM_UNSET )
+		return STATUS_SUCCESS;
+
+	/* Store value */
+	status = reg_open ( &reg_key, REG_SITE_ISCSIPRT_PARAMETERS,
+			    L"\\Registry\\Machine\\SYSTEM\\"
+			    L"CurrentControlSet\\Services\\disk", NULL );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_open;
+	status = reg_store_dword ( reg_key, L"TimeOutValue",
+				   ibft_disk_timeout );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store_dword;
+	BootPrint ( "Disk timeout %lds is pending until next boot\n",
+		    ibft_disk_timeout );
+
+ err_reg_store_dword:
 	reg_close ( reg_key );
  err_reg_open:
 	return status;
@@ -266,6 +552,71 @@ static NTSTATUS store_tcpip_parameters ( PDEVICE_OBJECT pdo,
 static VOID parse_ibft_nic ( PIBFT_TABLE ibft, PIBFT_NIC nic ) {
 	PIBFT_HEADER header = &nic->header;
 	ULONG subnet_mask;
+
+	if ( ! ( header->flags & IBFT_FL_NIC_BLOCK_VALID ) )
+		return;
+
+	/* Print compressed information on boot splash screen */
+	subnet_mask = ibft_subnet_mask ( nic->subnet_mask_prefix );
+	BootPrint ( "%02x:%02x:%02x:%02x:%02x:%02x %s/",
+		    nic->mac_address[0], nic->mac_address[1],
+		    nic->mac_address[2], nic->mac_address[3],
+		    nic->mac_address[4], nic->mac_address[5],
+		    ibft_ipaddr ( &nic->ip_address ) );
+	BootPrint ( "%s", inet_ntoa ( subnet_mask ) );
+	BootPrint ( " gw %s\n", ibft_ipaddr ( &nic->gateway ) );
+}
+
+/**
+ * Record iBFT initiator in boot configuration record
+ *
+ * @v ibft		iBFT
+ * @v initiator		Initiator structure
+ */
+static VOID record_ibft_initiator ( PIBFT_TABLE ibft,
+				    PIBFT_INITIATOR initiator ) {
+
+	if ( ! ( initiator->header.flags & IBFT_FL_INITIATOR_BLOCK_VALID ) )
+		return;
+	RtlStringCbCopyA ( boot_config.initiator_name,
+			   sizeof ( boot_config.initiator_name ),
+			   ibft_string ( ibft, &initiator->initiator_name ) );
+}
+
+/**
+ * Record iBFT NIC in boot configuration record
+ *
+ * @v nic		NIC structure
+ */
+static VOID record_ibft_nic ( PIBFT_NIC nic ) {
+	PBOOTCFG_NIC rec;
+
+	if ( ! ( nic->header.flags & IBFT_FL_NIC_BLOCK_VALID ) )
+		return;
+	rec = bootcfg_add_nic();
+	if ( ! rec )
+		return;
+	rec->index = nic->header.index;
+	rec->flags = nic->header.flags;
+	rec->subnet_mask_prefix = nic->subnet_mask_prefix;
+	RtlCopyMemory ( rec->mac, nic->mac_address, sizeof ( rec->mac ) );
+	rec->vlan = nic->vlan;
+	rec->pci_bus_dev_func = nic->pci_bus_dev_func;
+	rec->ip_address = nic->ip_address.in;
+	rec->gateway = nic->gateway.in;
+	rec->dns[0] = nic->dns[0].in;
+	rec->dns[1] = nic->dns[1].in;
+}
+
+/**
+ * Configure iBFT NIC
+ *
+ * @v ibft		iBFT
+ * @v nic		NIC structure
+ */
+static VOID configure_ibft_nic ( PIBFT_TABLE ibft, PIBFT_NIC nic ) {
+	PIBFT_HEADER header = &nic->header;
+	ULONG subnet_mask;
 	NTSTATUS status;
 
 	/* Dump structure information */
@@ -298,18 +649,13 @@ static VOID parse_ibft_nic ( PIBFT_TABLE ibft, PIBFT_NIC nic ) {
 		   ( ( nic->pci_bus_dev_func >> 0 ) & 0x07 ) );
 	DbgPrint ( "  Hostname = %s\n", ibft_string ( ibft, &nic->hostname ) );
 
-	/* Print compressed information on boot splash screen */
-	BootPrint ( "%02x:%02x:%02x:%02x:%02x:%02x %s/",
-		    nic->mac_address[0], nic->mac_address[1],
-		    nic->mac_address[2], nic->mac_address[3],
-		    nic->mac_address[4], nic->mac_address[5],
-		    ibft_ipaddr ( &nic->ip_address ) );
-	BootPrint ( "%s", inet_ntoa ( subnet_mask ) );
-	BootPrint ( " gw %s\n", ibft_ipaddr ( &nic->gateway ) );
-
 	/* Try to configure NIC */
-	status = find_nic ( nic->mac_address, store_tcpip_parameters, nic );
-	if ( NT_SUCCESS ( status ) ) {
+	status = find_nic ( nic->mac_address, nic->pci_bus_dev_func,
+			    store_tcpip_parameters, nic, sizeof ( *nic ) );
+	if ( status == STATUS_PENDING ) {
+		DbgPrint ( "Deferred configuration of iBFT NIC %d\n",
+			   header->index );
+	} else if ( NT_SUCCESS ( status ) ) {
 		DbgPrint ( "Successfully configured iBFT NIC %d\n",
 			   header->index );
 	} else {
@@ -319,12 +665,12 @@ static VOID parse_ibft_nic ( PIBFT_TABLE ibft, PIBFT_NIC nic ) {
 }
 
 /**
- * Parse iBFT target structure
+ * Dump iBFT target structure
  *
  * @v ibft		iBFT
  * @v target		Target structure
  */
-static VOID parse_ibft_target ( PIBFT_TABLE ibft, PIBFT_TARGET target ) {
+static VOID dump_ibft_target ( PIBFT_TABLE ibft, PIBFT_TARGET target ) {
 	PIBFT_HEADER header = &target->header;
 
 	/* Dump structure information */
@@ -366,6 +712,45 @@ static VOID parse_ibft_target ( PIBFT_TABLE ibft, PIBFT_TARGET target ) {
 	DbgPrint ( "  Reverse CHAP secret = %s\n",
 		   ( ibft_string_exists ( &target->reverse_chap_secret ) ?
 		     "<omitted>" : "" ) );
+}
+
+/**
+ * Record iBFT target in boot configuration record
+ *
+ * @v ibft		iBFT
+ * @v target		Target structure
+ */
+static VOID record_ibft_target ( PIBFT_TABLE ibft, PIBFT_TARGET target ) {
+	PBOOTCFG_TARGET rec;
+
+	if ( ! ( target->header.flags & IBFT_FL_TARGET_BLOCK_VALID ) )
+		return;
+	rec = bootcfg_add_target();
+	if ( ! rec )
+		return;
+	rec->index = target->header.index;
+	rec->flags = target->header.flags;
+	rec->nic_association = target->nic_association;
+	rec->chap_type = target->chap_type;
+	rec->ip_address = target->ip_address.in;
+	rec->port = target->socket;
+	RtlCopyMemory ( rec->boot_lun, target->boot_lun,
+			sizeof ( rec->boot_lun ) );
+	RtlStringCbCopyA ( rec->name, sizeof ( rec->name ),
+			   ibft_string ( ibft, &target->target_name ) );
+}
+
+/**
+ * Parse iBFT target structure
+ *
+ * @v ibft		iBFT
+ * @v target		Target structure
+ */
+static VOID parse_ibft_target ( PIBFT_TABLE ibft, PIBFT_TARGET target ) {
+	PIBFT_HEADER header = &target->header;
+
+	if ( ! ( header->flags & IBFT_FL_TARGET_BLOCK_VALID ) )
+		return;
 
 	/* Print compressed information on boot splash screen */
 	BootPrint ( "%s %s\n", ibft_ipaddr ( &target->ip_address ),
@@ -373,24 +758,404 @@ static VOID parse_ibft_target ( PIBFT_TABLE ibft, PIBFT_TARGET target ) {
 }
 
 /**
- * Iterate over entries in the iBFT
+ * Find iBFT NIC used by target
+ *
+ * @v index		iBFT index
+ * @v target		Target structure
+ * @ret nic		NIC structure, or NULL
+ */
+static PIBFT_NIC ibft_target_nic ( PIBFT_INDEX index, PIBFT_TARGET target ) {
+	PIBFT_NIC nic;
+	ULONG i;
+
+	for ( i = 0 ; i < index->num_nics ; i++ ) {
+		nic = index->nics[i];
+		if ( ( nic->header.index == target->nic_association ) &&
+		     ( nic->header.flags & IBFT_FL_NIC_BLOCK_VALID ) )
+			return nic;
+	}
+	return NULL;
+}
+
+/**
+ * Check whether iBFT NIC is used to reach a boot target
+ *
+ * @v index		iBFT index
+ * @v nic		NIC structure
+ * @ret is_boot		NIC is a boot NIC
+ *
+ * Some firmware marks neither the boot NIC nor the boot target as
+ * boot selected.  If nothing in the iBFT is boot selected, then the
+ * NICs used by all valid targets are treated as boot NICs.
+ */
+static BOOLEAN ibft_boot_nic ( PIBFT_INDEX index, PIBFT_NIC nic ) {
+	PIBFT_TARGET target;
+	BOOLEAN selected = FALSE;
+	BOOLEAN attached = FALSE;
+	ULONG i;
+
+	if ( nic->header.flags & IBFT_FL_NIC_FIRMWARE_BOOT_SELECTED )
+		return TRUE;
+	for ( i = 0 ; i < index->num_nics ; i++ ) {
+		if ( index->nics[i]->header.flags &
+		     IBFT_FL_NIC_FIRMWARE_BOOT_SELECTED )
+			selected = TRUE;
+	}
+	for ( i = 0 ; i < index->num_targets ; i++ ) {
+		target = index->targets[i];
+		if ( target->header.flags &
+		     IBFT_FL_TARGET_FIRMWARE_BOOT_SELECTED ) {
+			if ( ibft_target_nic ( index, target ) == nic )
+				return TRUE;
+			selected = TRUE;
+		} else if ( ( target->header.flags &
+			      IBFT_FL_TARGET_BLOCK_VALID ) &&
+			    ( ibft_target_nic ( index, target ) == nic ) ) {
+			attached = TRUE;
+		}
+	}
+	return ( ( BOOLEAN ) ( attached && ! selected ) );
+}
+
+/**
+ * Check for multiple paths to an iBFT target
+ *
+ * @v index		iBFT index
+ * @ret multipath	Some target is reachable via more than one NIC
+ *
+ * Two valid targets with the same name, each associated with a
+ * different valid NIC, are treated as two paths to the same target.
+ */
+static BOOLEAN ibft_multipath ( PIBFT_INDEX index ) {
+	PIBFT_TABLE ibft = index->ibft;
+	PIBFT_TARGET target;
+	PIBFT_TARGET other;
+	PIBFT_NIC nic;
+	PIBFT_NIC other_nic;
+	ULONG i;
+	ULONG j;
+
+	for ( i = 0 ; i < index->num_targets ; i++ ) {
+		target = index->targets[i];
+		if ( ! ( ( target->header.flags &
+			   IBFT_FL_TARGET_BLOCK_VALID ) &&
+			 ibft_string_exists ( &target->target_name ) ) )
+			continue;
+		nic = ibft_target_nic ( index, target );
+		if ( ! nic )
+			continue;
+		for ( j = ( i + 1 ) ; j < index->num_targets ; j++ ) {
+			other = index->targets[j];
+			if ( ! ( other->header.flags &
+				 IBFT_FL_TARGET_BLOCK_VALID ) )
+				continue;
+			other_nic = ibft_target_nic ( index, other );
+			if ( ! ( other_nic && ( other_nic != nic ) ) )
+				continue;
+			if ( _stricmp ( ibft_string ( ibft,
+						      &target->target_name ),
+					ibft_string ( ibft,
+						      &other->target_name ) ) )
+				continue;
+			DbgPrint ( "iBFT targets %d and %d reach %s via NICs "
+				   "%d and %d\n", target->header.index,
+				   other->header.index,
+				   ibft_string ( ibft, &target->target_name ),
+				   nic->header.index, other_nic->header.index );
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * Check validity of iBFT string
+ *
+ * @v ibft		iBFT
+ * @v string		iBFT string
+ * @ret valid		String is absent, or lies within the table
+ */
+static BOOLEAN ibft_string_valid ( PIBFT_TABLE ibft, PIBFT_STRING string ) {
+	ULONG end;
+
+	if ( ! string->offset )
+		return TRUE;
+	end = ( ( ( ULONG ) string->offset ) + string->length );
+	if ( end >= ibft->acpi.length )
+		return FALSE;
+	return ( ( BOOLEAN ) ( ( ( PCHAR ) ibft )[end] == '\0' ) );
+}
+
+/**
+ * Check that iBFT structure lies within the table
  *
- * @v entry		Structure
- * @v TYPE		Type of structure
  * @v ibft		iBFT
- * @v offset		Loop counter
+ * @v header		Structure header
+ * @v len		Length of structure type
+ * @ret valid		Structure lies within the table
+ */
+static BOOLEAN ibft_structure_valid ( PIBFT_TABLE ibft, PIBFT_HEADER header,
+				      ULONG len ) {
+	ULONG offset = ( ( ULONG ) ( ( ( PUCHAR ) header ) -
+				     ( ( PUCHAR ) ibft ) ) );
+
+	if ( header->length > len )
+		len = header->length;
+	return ( ( BOOLEAN ) ( ( offset + len ) <= ibft->acpi.length ) );
+}
+
+/**
+ * Add iBFT structure to index
+ *
+ * @v index		iBFT index
+ * @v offset		Offset to structure
+ *
+ * Structures that do not lie entirely within the table, or that
+ * contain strings that do not lie within the table, are ignored.
+ */
+static VOID index_ibft_structure ( PIBFT_INDEX index, USHORT offset ) {
+	PIBFT_TABLE ibft = index->ibft;
+	PIBFT_HEADER header;
+	PIBFT_INITIATOR initiator;
+	PIBFT_NIC nic;
+	PIBFT_TARGET target;
+
+	/* Locate structure header */
+	if ( ! offset )
+		return;
+	if ( ( ( ( ULONG ) offset ) + sizeof ( *header ) ) >
+	     ibft->acpi.length ) {
+		DbgPrint ( "iBFT structure at %#x overruns table\n", offset );
+		return;
+	}
+	header = ( ( PIBFT_HEADER ) ( ( ( PUCHAR ) ibft ) + offset ) );
+
+	/* Validate and record structure */
+	switch ( header->structure_id ) {
+	case IBFT_STRUCTURE_ID_INITIATOR:
+		initiator = ( ( PIBFT_INITIATOR ) header );
+		if ( ! ( ibft_structure_valid ( ibft, header,
+						sizeof ( *initiator ) ) &&
+			 ibft_string_valid ( ibft,
+					     &initiator->initiator_name ) ) )
+			goto err_invalid;
+		if ( index->initiator ) {
+			DbgPrint ( "Ignoring extra iBFT initiator at %#x\n",
+				   offset );
+			return;
+		}
+		index->initiator = initiator;
+		break;
+	case IBFT_STRUCTURE_ID_NIC:
+		nic = ( ( PIBFT_NIC ) header );
+		if ( ! ( ibft_structure_valid ( ibft, header,
+						sizeof ( *nic ) ) &&
+			 ibft_string_valid ( ibft, &nic->hostname ) ) )
+			goto err_invalid;
+		if ( index->num_nics >= IBFT_MAX_NICS ) {
+			DbgPrint ( "Ignoring extra iBFT NIC at %#x\n", offset );
+			return;
+		}
+		index->nics[ index->num_nics++ ] = nic;
+		break;
+	case IBFT_STRUCTURE_ID_TARGET:
+		target = ( ( PIBFT_TARGET ) header );
+		if ( ! ( ibft_structure_valid ( ibft, header,
+						sizeof ( *target ) ) &&
+			 ibft_string_valid ( ibft, &target->target_name ) &&
+			 ibft_string_valid ( ibft, &target->chap_name ) &&
+			 ibft_string_valid ( ibft, &target->chap_secret ) &&
+			 ibft_string_valid ( ibft,
+					     &target->reverse_chap_name ) &&
+			 ibft_string_valid ( ibft,
+					     &target->reverse_chap_secret ) ) )
+			goto err_invalid;
+		if ( index->num_targets >= IBFT_MAX_TARGETS ) {
+			DbgPrint ( "Ignoring extra iBFT target at %#x\n",
+				   offset );
+			return;
+		}
+		index->targets[ index->num_targets++ ] = target;
+		break;
+	default:
+		/* Ignore unknown structures */
+		break;
+	}
+	return;
+
+ err_invalid:
+	DbgPrint ( "Ignoring invalid iBFT structure %d at %#x\n",
+		   header->structure_id, offset );
+}
+
+/**
+ * Build validated index of iBFT structures
+ *
+ * @v acpi		ACPI description header
+ * @v index		iBFT index to fill in
+ * @ret ntstatus	NT status
+ *
+ * This is the only function that follows offsets within the iBFT.
+ * All other functions may access the indexed structures and their
+ * strings without further bounds checks.
+ */
+static NTSTATUS index_ibft ( PACPI_DESCRIPTION_HEADER acpi,
+			     PIBFT_INDEX index ) {
+	PIBFT_TABLE ibft = ( PIBFT_TABLE ) acpi;
+	PIBFT_CONTROL control = &ibft->control;
+	PUSHORT offset;
+	PUCHAR end;
+
+	RtlZeroMemory ( index, sizeof ( *index ) );
+	index->ibft = ibft;
+
+	/* Validate control structure */
+	if ( acpi->length < sizeof ( *ibft ) ) {
+		DbgPrint ( "iBFT is too short (%d bytes)\n", acpi->length );
+		return STATUS_INVALID_PARAMETER;
+	}
+	end = ( ( ( PUCHAR ) control ) + control->header.length );
+	if ( end > ( ( ( PUCHAR ) ibft ) + acpi->length ) ) {
+		DbgPrint ( "iBFT control structure overruns table\n" );
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* Index all structures referenced by the control structure */
+	for ( offset = &control->extensions ;
+	      ( ( PUCHAR ) ( offset + 1 ) ) <= end ; offset++ ) {
+		index_ibft_structure ( index, *offset );
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Disable non-boot iBFT targets if only a single login is requested
+ *
+ * @v index		iBFT index
+ *
+ * If the control structure requests a login only to the boot target,
+ * and some target is marked as boot selected, then all other targets
+ * are marked as invalid so that they are not logged in to.  Nothing
+ * is changed if no target is boot selected, or if MPIO is being
+ * provisioned for multiple paths to the target.
+ */
+static VOID ibft_single_login ( PIBFT_INDEX index ) {
+	PIBFT_TABLE ibft = index->ibft;
+	PIBFT_HEADER header;
+	BOOLEAN selected = FALSE;
+	ULONG i;
+
+	/* Check for single login request */
+	if ( ! ( ibft->control.header.flags &
+		 IBFT_FL_CONTROL_SINGLE_LOGIN_ONLY ) )
+		return;
+	for ( i = 0 ; i < index->num_targets ; i++ ) {
+		header = &index->targets[i]->header;
+		if ( ( header->flags & IBFT_FL_TARGET_BLOCK_VALID ) &&
+		     ( header->flags & IBFT_FL_TARGET_FIRMWARE_BOOT_SELECTED ) )
+			selected = TRUE;
+	}
+	if ( ! selected ) {
+		DbgPrint ( "iBFT requests single login but selects no boot "
+			   "target\n" );
+		return;
+	}
+	if ( ibft_multipath_enabled && ibft_multipath ( index ) ) {
+		DbgPrint ( "Ignoring iBFT single login request for MPIO\n" );
+		return;
+	}
+
+	/* Disable all other targets */
+	for ( i = 0 ; i < index->num_targets ; i++ ) {
+		header = &index->targets[i]->header;
+		if ( ! ( header->flags & IBFT_FL_TARGET_BLOCK_VALID ) )
+			continue;
+		if ( header->flags & IBFT_FL_TARGET_FIRMWARE_BOOT_SELECTED )
+			continue;
+		DbgPrint ( "Disabling non-boot iBFT target %d\n",
+			   header->index );
+		header->flags = ( ( UCHAR ) ( header->flags &
+					      ~IBFT_FL_TARGET_BLOCK_VALID ) );
+	}
+}
+
+/**
+ * Store MPIO parameters in registry
+ *
+ * @ret ntstatus	NT status
+ *
+ * This allows the Microsoft DSM to claim disks presented by the
+ * Microsoft iSCSI initiator, so that sessions to the same target via
+ * different NICs appear as paths to a single disk.  It has no effect
+ * unless the Multipath I/O feature is installed.
+ */
+static NTSTATUS store_mpio_parameters ( VOID ) {
+	HANDLE reg_key;
+	NTSTATUS status;
+
+	/* Add iSCSI devices to MPIO supported device list */
+	status = reg_open ( &reg_key, REG_SITE_MPIO_PARAMETERS,
+			    L"\\Registry\\Machine\\SYSTEM\\"
+			    L"CurrentControlSet\\Control\\MPDEV", NULL );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not open MPDEV key (MPIO not installed?): "
+			   "%x\n", status );
+		goto err_reg_open_mpdev;
+	}
+	status = reg_add_multi_sz ( reg_key, L"MPIOSupportedDeviceList",
+				    IBFT_MPIO_DEVICE_ID );
+	reg_close ( reg_key );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_add_mpdev;
+
+	/* Add iSCSI devices to Microsoft DSM supported device list */
+	status = reg_open ( &reg_key, REG_SITE_MPIO_PARAMETERS,
+			    L"\\Registry\\Machine\\SYSTEM\\"
+			    L"CurrentControlSet\\Services\\msdsm\\"
+			    L"Parameters", NULL );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not open msdsm Parameters key: %x\n",
+			   status );
+		goto err_reg_open_msdsm;
+	}
+	status = reg_add_multi_sz ( reg_key, L"DsmSupportedDeviceList",
+				    IBFT_MPIO_DEVICE_ID );
+	reg_close ( reg_key );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_add_msdsm;
+
+	return STATUS_SUCCESS;
+
+ err_reg_add_msdsm:
+ err_reg_open_msdsm:
+ err_reg_add_mpdev:
+ err_reg_open_mpdev:
+	return status;
+}
+
+/**
+ * Configure MPIO for iBFT
+ *
+ * @v index		iBFT index
  */
-#define for_each_ibft_entry( entry, TYPE, ibft, offset )		      \
-	for ( offset = &ibft->control.extensions,			      \
-	      entry = ( ( PIBFT_ ## TYPE ) ( ( ( PUCHAR ) ibft ) + *offset ));\
-	      ( ( PUCHAR ) offset ) < ( ( ( PUCHAR ) &ibft->control ) +	      \
-					ibft->control.header.length ) ;	      \
-	      offset++,							      \
-	      entry = ( ( PIBFT_ ## TYPE ) ( ( ( PUCHAR ) ibft ) + *offset )))\
-		if ( ( *offset == 0 ) ||				      \
-		     ( entry->header.structure_id !=			      \
-		       IBFT_STRUCTURE_ID_ ## TYPE ) ) continue;		      \
-		else
+static VOID configure_ibft_multipath ( PIBFT_INDEX index ) {
+	NTSTATUS status;
+
+	if ( ! ibft_multipath ( index ) )
+		return;
+	if ( ! ibft_multipath_enabled ) {
+		DbgPrint ( "Not configuring MPIO: Multipath is disabled\n" );
+		return;
+	}
+	status = store_mpio_parameters();
+	if ( NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Successfully configured MPIO for iBFT\n" );
+	} else {
+		DbgPrint ( "Could not configure MPIO for iBFT: %x\n",
+			   status );
+	}
+}
 
 /**
  * Parse iBFT
@@ -399,24 +1164,45 @@ static VOID parse_ibft_target ( PIBFT_TABLE ibft, PIBFT_TARGET target ) {
  */
 VOID parse_ibft ( PACPI_DESCRIPTION_HEADER acpi ) {
 	PIBFT_TABLE ibft = ( PIBFT_TABLE ) acpi;
-	PUSHORT initiator_offset;
-	PIBFT_INITIATOR initiator;
-	PUSHORT nic_offset;
+	IBFT_INDEX index;
 	PIBFT_NIC nic;
-	PUSHORT target_offset;
 	PIBFT_TARGET target;
 	ULONG gateway;
 	ULONG network;
 	ULONG netmask;
 	ULONG attached_targets;
+	ULONG i;
+	ULONG j;
+	NTSTATUS status;
+
+	/* Validate iBFT */
+	status = index_ibft ( acpi, &index );
+	if ( ! NT_SUCCESS ( status ) )
+		return;
+
+	/* Apply iSCSI initiator profile.  The initiator has already
+	 * read its parameters by the time the iBFT is parsed, so the
+	 * profile takes effect from the next boot.
+	 */
+	store_iscsiprt_parameters();
+	store_disk_timeout();
+
+	/* Configure MPIO, if applicable.  This is done immediately
+	 * rather than in configure_ibft(), since MPIO and the Microsoft
+	 * DSM read their supported device lists only when they start.
+	 */
+	configure_ibft_multipath ( &index );
+
+	/* Log in only to the boot target, if so requested */
+	ibft_single_login ( &index );
 
-	/* Scan through all iBFT entries */
-	for_each_ibft_entry ( initiator, INITIATOR, ibft, initiator_offset )
-		parse_ibft_initiator ( ibft, initiator );
-	for_each_ibft_entry ( nic, NIC, ibft, nic_offset )
-		parse_ibft_nic ( ibft, nic );
-	for_each_ibft_entry ( target, TARGET, ibft, target_offset )
-		parse_ibft_target ( ibft, target );
+	/* Print all iBFT entries */
+	if ( index.initiator )
+		parse_ibft_initiator ( ibft, index.initiator );
+	for ( i = 0 ; i < index.num_nics ; i++ )
+		parse_ibft_nic ( ibft, index.nics[i] );
+	for ( i = 0 ; i < index.num_targets ; i++ )
+		parse_ibft_target ( ibft, index.targets[i] );
 
 	/* If a gateway is specified in the iBFT, the Microsoft iSCSI
 	 * initiator will create a static route to the iSCSI target
@@ -443,18 +1229,23 @@ VOID parse_ibft ( PACPI_DESCRIPTION_HEADER acpi ) {
 	 *       preventing the creation of the undesirable routes.
 	 *
 	 * Note that none of this affects the normal TCP/IP stack
-	 * configuration, which has already been carried out; this
-	 * affects only the dedicated routes created by the Microsoft
-	 * iSCSI initiator.
+	 * configuration, which is carried out by configure_ibft()
+	 * using an unmodified copy of the iBFT; this affects only the
+	 * dedicated routes created by the Microsoft iSCSI initiator.
 	 */
-	for_each_ibft_entry ( nic, NIC, ibft, nic_offset ) {
+	for ( i = 0 ; i < index.num_nics ; i++ ) {
+		nic = index.nics[i];
 		gateway = nic->gateway.in;
 		if ( ! gateway )
 			continue;
 		netmask = ibft_subnet_mask ( nic->subnet_mask_prefix );
 		network = ( nic->ip_address.in & netmask );
 		attached_targets = 0;
-		for_each_ibft_entry ( target, TARGET, ibft, target_offset ) {
+		for ( j = 0 ; j < index.num_targets ; j++ ) {
+			target = index.targets[j];
+			if ( ! ( target->header.flags &
+				 IBFT_FL_TARGET_BLOCK_VALID ) )
+				continue;
 			if ( ( target->ip_address.in & netmask ) != network )
 				continue;
 			gateway = ( ( attached_targets == 0 ) ?
@@ -471,4 +1262,75 @@ VOID parse_ibft ( PACPI_DESCRIPTION_HEADER acpi ) {
 			DbgPrint ( " to %s\n", ibft_ipaddr ( &nic->gateway ) );
 		}
 	}
+
+	/* Fix up checksum of modified table */
+	fix_acpi_checksum ( acpi );
+}
+
+/**
+ * Configure iBFT boot NICs
+ *
+ * @v acpi		ACPI description header
+ *
+ * The NICs used to reach the boot targets are configured before the
+ * wait for the system disk begins, so that their TCP/IP parameters
+ * are in place before the TCP/IP stack binds to them.  Everything
+ * else is left to configure_ibft().
+ */
+VOID configure_ibft_boot ( PACPI_DESCRIPTION_HEADER acpi ) {
+	PIBFT_TABLE ibft = ( PIBFT_TABLE ) acpi;
+	IBFT_INDEX index;
+	ULONG i;
+	NTSTATUS status;
+
+	/* Validate iBFT */
+	status = index_ibft ( acpi, &index );
+	if ( ! NT_SUCCESS ( status ) )
+		return;
+
+	/* Configure boot NICs */
+	for ( i = 0 ; i < index.num_nics ; i++ ) {
+		if ( ! ibft_boot_nic ( &index, index.nics[i] ) )
+			continue;
+		record_ibft_nic ( index.nics[i] );
+		configure_ibft_nic ( ibft, index.nics[i] );
+	}
+}
+
+/**
+ * Configure iBFT
+ *
+ * @v acpi		ACPI description header
+ *
+ * This may be run concurrently with the wait for the system disk,
+ * and so must be given a copy of the iBFT that is not modified by
+ * parse_ibft().
+ */
+VOID configure_ibft ( PACPI_DESCRIPTION_HEADER acpi ) {
+	PIBFT_TABLE ibft = ( PIBFT_TABLE ) acpi;
+	IBFT_INDEX index;
+	ULONG i;
+	NTSTATUS status;
+
+	/* Validate iBFT */
+	status = index_ibft ( acpi, &index );
+	if ( ! NT_SUCCESS ( status ) )
+		return;
+
+	/* Configure all iBFT entries */
+	if ( index.initiator ) {
+		dump_ibft_initiator ( ibft, index.initiator );
+		record_ibft_initiator ( ibft, index.initiator );
+	}
+	for ( i = 0 ; i < index.num_nics ; i++ ) {
+		/* Boot NICs are handled by configure_ibft_boot() */
+		if ( ibft_boot_nic ( &index, index.nics[i] ) )
+			continue;
+		record_ibft_nic ( index.nics[i] );
+		configure_ibft_nic ( ibft, index.nics[i] );
+	}
+	for ( i = 0 ; i < index.num_targets ; i++ ) {
+		record_ibft_target ( ibft, index.targets[i] );
+		dump_ibft_target ( ibft, index.targets[i] );
+	}
 }
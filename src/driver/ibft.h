@@ -266,6 +266,54 @@ typedef struct _IBFT_TABLE {
 } IBFT_TABLE, *PIBFT_TABLE;
 #pragma pack()
 
+/** Maximum number of iBFT NIC structures indexed */
+#define IBFT_MAX_NICS 4
+
+/** Maximum number of iBFT Target structures indexed */
+#define IBFT_MAX_TARGETS 4
+
+/**
+ * Validated index of iBFT structures
+ *
+ * Every structure referenced by the index lies entirely within the
+ * table, as does every non-empty string within each structure.
+ */
+typedef struct _IBFT_INDEX {
+	/** iBFT */
+	PIBFT_TABLE ibft;
+	/** Initiator structure, or NULL */
+	PIBFT_INITIATOR initiator;
+	/** Number of NIC structures */
+	ULONG num_nics;
+	/** NIC structures, in order of appearance */
+	PIBFT_NIC nics[IBFT_MAX_NICS];
+	/** Number of Target structures */
+	ULONG num_targets;
+	/** Target structures, in order of appearance */
+	PIBFT_TARGET targets[IBFT_MAX_TARGETS];
+} IBFT_INDEX, *PIBFT_INDEX;
+
+/** MPIO device identifier for the Microsoft iSCSI initiator */
+#define IBFT_MPIO_DEVICE_ID L"MSFT2005iSCSIBusType_0x9"
+
+/** Tuning parameter is not configured */
+#define IBFT_PARAM_UNSET MAXULONG
+
+/** Matching device ID of the Microsoft iSCSI initiator */
+#define IBFT_ISCSIPRT_DEVICE_ID L"root\\iscsiprt"
+
+extern BOOLEAN ibft_multipath_enabled;
+extern ULONG ibft_tcp_ack_frequency;
+extern ULONG ibft_iscsi_max_transfer_length;
+extern ULONG ibft_iscsi_first_burst_length;
+extern ULONG ibft_iscsi_max_burst_length;
+extern ULONG ibft_iscsi_max_recv_data_segment_length;
+extern ULONG ibft_iscsi_link_down_time;
+extern ULONG ibft_iscsi_max_request_hold_time;
+extern ULONG ibft_disk_timeout;
+
 extern VOID parse_ibft ( PACPI_DESCRIPTION_HEADER acpi );
+extern VOID configure_ibft_boot ( PACPI_DESCRIPTION_HEADER acpi );
+extern VOID configure_ibft ( PACPI_DESCRIPTION_HEADER acpi );
 
 #endif /* _IBFT_H */
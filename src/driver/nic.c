@@ -26,65 +26,318 @@
 #include <ndis.h>
 #include <ndisguid.h>
 #include <ntddndis.h>
+#include <wdmguid.h>
 #include "sanbootconf.h"
 #include "boottext.h"
 #include "registry.h"
+#include "devintf.h"
+#include "history.h"
 #include "nic.h"
 
+/** Length of a NIC MAC address */
+#define NIC_MAC_LEN 6
+
+/** Number of NIC inventory hash buckets */
+#define NIC_HASH_SIZE 32
+
+/** Maximum number of concurrent MAC address queries */
+#define NIC_MAX_IN_FLIGHT 8
+
+/** NIC binding cache value name format
+ *
+ * Each cached binding is a REG_MULTI_SZ value under the driver's
+ * Parameters key, containing the NDIS interface name, the
+ * NetCfgInstanceId and the primary hardware ID.
+ */
+#define NIC_CACHE_VALUE_FMT L"NicBinding_%02x%02x%02x%02x%02x%02x"
+
+/** Length of NIC binding cache value name (including NUL) */
+#define NIC_CACHE_VALUE_LEN 24
+
+/** NIC binding cache uncached lookup time value name */
+#define NIC_CACHE_TIME_VALUE L"NicLookupTime"
+
+/** Per-NIC MTU registry value name format */
+#define NIC_MTU_VALUE_FMT L"Mtu_%02x%02x%02x%02x%02x%02x"
+
+/** Length of per-NIC MTU registry value name */
+#define NIC_MTU_VALUE_LEN 17
+
+/** Length of Ethernet link-layer header, as included in *JumboPacket */
+#define NIC_ETH_HLEN 14
+
+/** A NIC inventory entry
+ *
+ * Every attached NDIS interface has an inventory entry.  Only entries
+ * whose MAC address has been successfully queried are present in the
+ * hash buckets.
+ */
+typedef struct _NIC_ENTRY {
+	/** List of all inventory entries */
+	LIST_ENTRY list;
+	/** Next entry in hash bucket */
+	struct _NIC_ENTRY *next;
+	/** Enumeration order within inventory */
+	ULONG order;
+	/** Inventory key (packed MAC address) */
+	ULONGLONG key;
+	/** MAC address */
+	UCHAR mac[NIC_MAC_LEN];
+	/** PCI bus:dev.fn, or NIC_PCI_NONE */
+	ULONG pci_bus_dev_func;
+	/** MAC address has been queried */
+	BOOLEAN resolved;
+	/** NDIS device object (until snapshot taken) */
+	PDEVICE_OBJECT device;
+	/** NDIS file object (until snapshot taken) */
+	PFILE_OBJECT file;
+	/** MAC address query completion event */
+	KEVENT event;
+	/** MAC address query I/O status */
+	IO_STATUS_BLOCK io_status;
+	/** Status returned when MAC address query was started */
+	NTSTATUS mac_status;
+	/** Status of PDO and NetCfgInstanceId lookup */
+	NTSTATUS status;
+	/** Physical device object, if known */
+	PDEVICE_OBJECT pdo;
+	/** NetCfgInstanceId, if known */
+	LPWSTR netcfginstanceid;
+	/** NDIS device name */
+	UNICODE_STRING name;
+	/** NDIS device name buffer */
+	WCHAR buf[1];
+} NIC_ENTRY, *PNIC_ENTRY;
+
+/** NIC inventory */
+static struct {
+	/** List of all inventory entries */
+	LIST_ENTRY nics;
+	/** Hash buckets of resolved entries, indexed by MAC address */
+	PNIC_ENTRY hash[NIC_HASH_SIZE];
+	/** Number of inventory entries */
+	ULONG count;
+	/** Number of MAC address queries issued */
+	ULONG queries;
+	/** Inventory has been built */
+	BOOLEAN built;
+} nic_inventory = {
+	{ &nic_inventory.nics, &nic_inventory.nics },
+};
+
+/** A pending NIC request */
+typedef struct _NIC_PENDING {
+	/** List of pending requests */
+	LIST_ENTRY list;
+	/** MAC address */
+	UCHAR mac[NIC_MAC_LEN];
+	/** Processing function */
+	NTSTATUS ( *process ) ( PDEVICE_OBJECT pdo, LPWSTR netcfginstanceid,
+				PVOID opaque );
+	/** Argument to processing function
+	 *
+	 * This points to a copy of the caller's argument, held
+	 * immediately following this structure.
+	 */
+	PVOID opaque;
+} NIC_PENDING, *PNIC_PENDING;
+
+/** A NIC interface arrival */
+typedef struct _NIC_ARRIVAL {
+	/** Work item */
+	PIO_WORKITEM item;
+	/** NDIS device name */
+	UNICODE_STRING name;
+	/** NDIS device name buffer */
+	WCHAR buf[1];
+} NIC_ARRIVAL, *PNIC_ARRIVAL;
+
+/** Pending NIC requests */
+static struct {
+	/** List of pending requests */
+	LIST_ENTRY requests;
+	/** Arrival notification handle, if registered */
+	PVOID notification;
+	/** Deadline timer */
+	KTIMER timer;
+	/** Deadline DPC */
+	KDPC dpc;
+	/** Deadline expiry work item */
+	PIO_WORKITEM expire;
+	/** Registration generation
+	 *
+	 * Incremented each time we start listening for arrivals, and
+	 * used to tag the deadline expiry work item so that a stale
+	 * expiry cannot fail requests made after re-registering.
+	 */
+	ULONG generation;
+} nic_pending = {
+	{ &nic_pending.requests, &nic_pending.requests },
+};
+
+/** NIC capability snapshots */
+static NIC_CAPS_TABLE nic_caps = {
+	NIC_CAPS_VERSION, sizeof ( NIC_CAPS ), NIC_MAX_CAPS, 0,
+};
+
+/** Lock protecting pending NIC requests and NIC processing */
+static KEVENT nic_lock;
+
+/** Driver object */
+static PDRIVER_OBJECT nic_driver;
+
+/** Time to wait for a missing NIC to arrive, in milliseconds */
+ULONG nic_arrival_timeout = NIC_ARRIVAL_TIMEOUT;
+
+/** MTU to configure for all NICs, or zero to leave unchanged */
+ULONG nic_mtu = 0;
+
+/* Forward declarations */
+static IO_COMPLETION_ROUTINE fetch_oid_complete;
+static IO_WORKITEM_ROUTINE expire_pending_nics;
+static IO_WORKITEM_ROUTINE try_arrived_nic;
+static KDEFERRED_ROUTINE pending_nics_deadline;
+static DRIVER_NOTIFICATION_CALLBACK_ROUTINE nic_arrival;
+
 /**
- * Fetch NIC MAC address
+ * Complete NIC OID query
  *
- * @v name		NDIS device name
  * @v device		NDIS device object
- * @v file		NDIS file object
- * @v mac		MAC address buffer
- * @v mac_len		MAC address buffer length
+ * @v irp		IRP
+ * @v context		In-flight query window
  * @ret ntstatus	NT status
  */
-static NTSTATUS fetch_mac ( PUNICODE_STRING name, PDEVICE_OBJECT device,
-			    PFILE_OBJECT file, PUCHAR mac, ULONG mac_len ) {
-	KEVENT event;
-	ULONG in_buf;
-	IO_STATUS_BLOCK io_status;
+static NTSTATUS fetch_oid_complete ( PDEVICE_OBJECT device, PIRP irp,
+				     PVOID context ) {
+	PKSEMAPHORE window = context;
+
+	/* Allow another query to start */
+	KeReleaseSemaphore ( window, IO_NO_INCREMENT, 1, FALSE );
+
+	( VOID ) device;
+	( VOID ) irp;
+	return STATUS_CONTINUE_COMPLETION;
+}
+
+/**
+ * Start NIC OID query
+ *
+ * @v nic		Inventory entry
+ * @v oid		Object identifier
+ * @v buf		Buffer to fill in
+ * @v len		Length of buffer
+ * @v window		In-flight query window
+ * @ret ntstatus	NT status
+ *
+ * The caller must already have acquired a slot in the in-flight query
+ * window.  The slot will be released when the query completes, or
+ * immediately if the query cannot be issued.  Only one query may be
+ * in progress for each inventory entry.
+ */
+static NTSTATUS start_fetch_oid ( PNIC_ENTRY nic, ULONG oid, PVOID buf,
+				  ULONG len, PKSEMAPHORE window ) {
 	PIRP irp;
 	PIO_STACK_LOCATION io_stack;
-	ULONG i;
-	NTSTATUS status;
 
-	/* Construct IRP to query MAC address */
-	KeInitializeEvent ( &event, NotificationEvent, FALSE );
-	in_buf = OID_802_3_CURRENT_ADDRESS;
+	/* Construct IRP to query OID */
+	KeInitializeEvent ( &nic->event, NotificationEvent, FALSE );
 	irp = IoBuildDeviceIoControlRequest ( IOCTL_NDIS_QUERY_GLOBAL_STATS,
-					      device, &in_buf,
-					      sizeof ( in_buf ), mac, mac_len,
-					      FALSE, &event, &io_status );
+					      nic->device, &oid,
+					      sizeof ( oid ), buf, len, FALSE,
+					      &nic->event, &nic->io_status );
 	if ( ! irp ) {
-		DbgPrint ( "Could not build IRP to retrieve MAC for \"%wZ\"\n",
-			   name );
+		DbgPrint ( "Could not build IRP to query OID %08lx for "
+			   "\"%wZ\"\n", oid, &nic->name );
+		KeReleaseSemaphore ( window, IO_NO_INCREMENT, 1, FALSE );
 		return STATUS_UNSUCCESSFUL;
 	}
 	io_stack = IoGetNextIrpStackLocation( irp );
-	io_stack->FileObject = file;
+	io_stack->FileObject = nic->file;
+	IoSetCompletionRoutine ( irp, fetch_oid_complete, window,
+				 TRUE, TRUE, TRUE );
 
 	/* Issue IRP */
-	status = IoCallDriver ( device, irp );
+	return IoCallDriver ( nic->device, irp );
+}
+
+/**
+ * Finish NIC OID query
+ *
+ * @v nic		Inventory entry
+ * @v status		Status returned when query was started
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS finish_fetch_oid ( PNIC_ENTRY nic, NTSTATUS status ) {
+
+	/* Wait for query to complete */
 	if ( status == STATUS_PENDING ) {
-		status = KeWaitForSingleObject ( &event, Executive, KernelMode,
-						 FALSE, NULL );
+		status = KeWaitForSingleObject ( &nic->event, Executive,
+						 KernelMode, FALSE, NULL );
+		if ( NT_SUCCESS ( status ) )
+			status = nic->io_status.Status;
 	}
-	if ( NT_SUCCESS ( status ) )
-		status = io_status.Status;
+	return status;
+}
+
+/**
+ * Query NIC OID synchronously
+ *
+ * @v nic		Inventory entry
+ * @v oid		Object identifier
+ * @v buf		Buffer to fill in
+ * @v len		Length of buffer
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS fetch_oid ( PNIC_ENTRY nic, ULONG oid, PVOID buf,
+			    ULONG len ) {
+	KSEMAPHORE window;
+	NTSTATUS status;
+
+	KeInitializeSemaphore ( &window, 1, 1 );
+	KeWaitForSingleObject ( &window, Executive, KernelMode, FALSE, NULL );
+	status = start_fetch_oid ( nic, oid, buf, len, &window );
+	return finish_fetch_oid ( nic, status );
+}
+
+/**
+ * Start fetching NIC MAC address
+ *
+ * @v nic		Inventory entry
+ * @v window		In-flight query window
+ * @ret ntstatus	NT status
+ *
+ * The caller must already have acquired a slot in the in-flight query
+ * window.
+ */
+static NTSTATUS start_fetch_mac ( PNIC_ENTRY nic, PKSEMAPHORE window ) {
+
+	return start_fetch_oid ( nic, OID_802_3_CURRENT_ADDRESS, nic->mac,
+				 sizeof ( nic->mac ), window );
+}
+
+/**
+ * Finish fetching NIC MAC address
+ *
+ * @v nic		Inventory entry
+ * @v status		Status returned when query was started
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS finish_fetch_mac ( PNIC_ENTRY nic, NTSTATUS status ) {
+	PUCHAR mac = nic->mac;
+
+	/* Wait for query to complete */
+	status = finish_fetch_oid ( nic, status );
 	if ( ! NT_SUCCESS ( status ) ) {
 		DbgPrint ( "IRP failed to retrieve MAC for \"%wZ\": %x\n",
-			   name, status );
+			   &nic->name, status );
 		return status;
 	}
 
 	/* Dump MAC address */
-	DbgPrint ( "Found NIC with MAC address" );
-	for ( i = 0 ; i < mac_len ; i++ )
-		DbgPrint ( "%c%02x", ( i ? ':' : ' ' ), mac[i] );
-	DbgPrint ( " at \"%wZ\"\n", name );
+	DbgPrint ( "Found NIC with MAC address "
+		   "%02x:%02x:%02x:%02x:%02x:%02x at \"%wZ\"\n",
+		   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+		   &nic->name );
 
 	return STATUS_SUCCESS;
 }
@@ -143,6 +396,42 @@ static NTSTATUS fetch_pdo ( PUNICODE_STRING name, PDEVICE_OBJECT device,
 	return STATUS_SUCCESS;
 }
 
+/**
+ * Fetch NIC PCI location
+ *
+ * @v pdo		Physical device object
+ * @ret pci_bus_dev_func PCI bus:dev.fn, or NIC_PCI_NONE
+ */
+static ULONG fetch_pci ( PDEVICE_OBJECT pdo ) {
+	GUID bus_type;
+	ULONG bus;
+	ULONG address;
+	ULONG len;
+	NTSTATUS status;
+
+	/* Check that this is a PCI device */
+	status = IoGetDeviceProperty ( pdo, DevicePropertyBusTypeGuid,
+				       sizeof ( bus_type ), &bus_type, &len );
+	if ( ( ! NT_SUCCESS ( status ) ) ||
+	     ( ! IsEqualGUID ( &bus_type, &GUID_BUS_TYPE_PCI ) ) )
+		return NIC_PCI_NONE;
+
+	/* Get bus number and device address */
+	status = IoGetDeviceProperty ( pdo, DevicePropertyBusNumber,
+				       sizeof ( bus ), &bus, &len );
+	if ( ! NT_SUCCESS ( status ) )
+		return NIC_PCI_NONE;
+	status = IoGetDeviceProperty ( pdo, DevicePropertyAddress,
+				       sizeof ( address ), &address, &len );
+	if ( ! NT_SUCCESS ( status ) )
+		return NIC_PCI_NONE;
+
+	/* Device address is ( ( device << 16 ) | function ) for PCI */
+	return ( ( ( bus & 0xff ) << 8 ) |
+		 ( ( ( address >> 16 ) & 0x1f ) << 3 ) |
+		 ( ( address >> 0 ) & 0x07 ) );
+}
+
 /**
  * Fetch NetCfgInstanceId registry value
  *
@@ -165,6 +454,7 @@ static NTSTATUS fetch_netcfginstanceid ( PDEVICE_OBJECT pdo,
 			   "%x\n", pdo, status );
 		goto err_ioopendeviceregistrykey;
 	}
+	reg_track_key ( reg_key, REG_SITE_FETCH_NETCFGINSTANCEID );
 
 	/* Read NetCfgInstanceId value */
 	status = reg_fetch_sz ( reg_key, L"NetCfgInstanceId",
@@ -173,116 +463,264 @@ static NTSTATUS fetch_netcfginstanceid ( PDEVICE_OBJECT pdo,
 		goto err_reg_fetch_wstr;
 
  err_reg_fetch_wstr:
+	reg_untrack_key ( reg_key );
 	ZwClose ( reg_key );
  err_ioopendeviceregistrykey:
 	return status;
 }
 
 /**
- * Try processing NIC
+ * Fetch hardware ID
  *
- * @v mac		MAC address
- * @v name		NDIS device name
- * @v process		Processing function
- * @v opaque		Argument to processing function
- * @ret found		NIC found
+ * @v pdo		Physical device object
+ * @v hardware_id	Primary hardware ID to allocate and fill in
  * @ret ntstatus	NT status
+ *
+ * The caller must eventually free the allocated value.
  */
-static NTSTATUS try_nic ( PUCHAR mac, PUNICODE_STRING name, 
-			  NTSTATUS ( *process ) ( PDEVICE_OBJECT pdo,
-						  LPWSTR netcfginstanceid,
-						  PVOID opaque ),
-			  PVOID opaque,
-			  PBOOLEAN found ) {
-	BOOLEAN must_disable;
-	PFILE_OBJECT file;
-	PDEVICE_OBJECT device;
-	UCHAR this_mac[6];
-	PDEVICE_OBJECT pdo;
-	LPWSTR netcfginstanceid;
+static NTSTATUS fetch_hardware_id ( PDEVICE_OBJECT pdo,
+				    LPWSTR *hardware_id ) {
+	ULONG len;
 	NTSTATUS status;
 
-	/* Mark as not yet found */
-	*found = FALSE;
-
-	/* Enable interface if not already done */
-	status = IoSetDeviceInterfaceState ( name, TRUE );
-	must_disable = ( NT_SUCCESS ( status ) ? TRUE : FALSE );
+	/* Determine length of hardware ID list */
+	len = 0;
+	status = IoGetDeviceProperty ( pdo, DevicePropertyHardwareID, 0,
+				       NULL, &len );
+	if ( status != STATUS_BUFFER_TOO_SMALL ) {
+		DbgPrint ( "Could not get hardware ID length for PDO %p: "
+			   "%x\n", pdo, status );
+		return ( NT_SUCCESS ( status ) ? STATUS_UNSUCCESSFUL : status );
+	}
 
-	/* Get device and file object pointers */
-	status = IoGetDeviceObjectPointer ( name, FILE_ALL_ACCESS, &file,
-					    &device );
+	/* Allocate and fetch hardware ID list.  The first entry in
+	 * the list is the most specific hardware ID.
+	 */
+	*hardware_id = ExAllocatePoolWithTag ( NonPagedPool,
+					       ( len + sizeof ( WCHAR ) ),
+					       SANBOOTCONF_POOL_TAG );
+	if ( ! *hardware_id ) {
+		DbgPrint ( "Could not allocate hardware ID for PDO %p\n",
+			   pdo );
+		return STATUS_NO_MEMORY;
+	}
+	RtlZeroMemory ( *hardware_id, ( len + sizeof ( WCHAR ) ) );
+	status = IoGetDeviceProperty ( pdo, DevicePropertyHardwareID, len,
+				       *hardware_id, &len );
 	if ( ! NT_SUCCESS ( status ) ) {
-		/* Not an error, apparently; IoGetDeviceInterfaces()
-		 * seems to return a whole load of interfaces that
-		 * aren't attached to any objects.
-		 */
-		goto err_iogetdeviceobjectpointer;
+		DbgPrint ( "Could not get hardware ID for PDO %p: %x\n",
+			   pdo, status );
+		ExFreePool ( *hardware_id );
+		return status;
 	}
 
-	/* See if NIC matches */
-	status = fetch_mac ( name, device, file, this_mac,
-			     sizeof ( this_mac ) );
-	if ( ! NT_SUCCESS ( status ) )
-		goto err_fetch_mac;
-	if ( memcmp ( mac, this_mac, sizeof ( this_mac ) ) != 0 )
-		goto err_compare_mac;
-	DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x is interface \"%wZ\"\n",
-		   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], name );
-	*found = TRUE;
+	return STATUS_SUCCESS;
+}
 
-	/* Get matching PDO */
-	status = fetch_pdo ( name, device, &pdo );
-	if ( ! NT_SUCCESS ( status ) )
-		goto err_fetch_pdo;
-	DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x is PDO %p\n",
-		   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], pdo );
+/**
+ * Pack MAC address into inventory key
+ *
+ * @v mac		MAC address
+ * @ret key		Inventory key
+ */
+static ULONGLONG nic_key ( PUCHAR mac ) {
+	ULONGLONG key = 0;
+	ULONG i;
+
+	for ( i = 0 ; i < NIC_MAC_LEN ; i++ )
+		key = ( ( key << 8 ) | mac[i] );
+	return key;
+}
+
+/**
+ * Calculate inventory hash bucket
+ *
+ * @v key		Inventory key
+ * @ret bucket		Hash bucket
+ */
+static ULONG nic_bucket ( ULONGLONG key ) {
+	return ( ( ULONG ) ( key ^ ( key >> 16 ) ^ ( key >> 32 ) ) %
+		 NIC_HASH_SIZE );
+}
+
+/**
+ * Allocate NIC inventory entry
+ *
+ * @v name		NDIS device name
+ * @v device		NDIS device object
+ * @v file		NDIS file object
+ * @ret nic		Inventory entry, or NULL
+ *
+ * The inventory entry takes ownership of the file object reference.
+ */
+static PNIC_ENTRY alloc_nic ( PUNICODE_STRING name, PDEVICE_OBJECT device,
+			      PFILE_OBJECT file ) {
+	PNIC_ENTRY nic;
+	ULONG len;
+
+	/* Allocate inventory entry */
+	len = ( sizeof ( *nic ) + name->Length );
+	nic = ExAllocatePoolWithTag ( NonPagedPool, len,
+				      SANBOOTCONF_POOL_TAG );
+	if ( ! nic ) {
+		DbgPrint ( "Could not allocate inventory entry for \"%wZ\"\n",
+			   name );
+		ObDereferenceObject ( file );
+		return NULL;
+	}
+	RtlZeroMemory ( nic, len );
+	nic->name.Buffer = nic->buf;
+	nic->name.MaximumLength = ( ( USHORT ) ( name->Length +
+						 sizeof ( WCHAR ) ) );
+	RtlCopyUnicodeString ( &nic->name, name );
+	nic->device = device;
+	nic->file = file;
+	nic->pci_bus_dev_func = NIC_PCI_NONE;
+
+	/* Get PDO and PCI location.  These do not involve the
+	 * miniport, and so are cheap to obtain for every NIC.
+	 * Failures are recorded in the inventory entry and reported
+	 * if the NIC is used.
+	 */
+	nic->status = fetch_pdo ( name, device, &nic->pdo );
+	if ( NT_SUCCESS ( nic->status ) )
+		nic->pci_bus_dev_func = fetch_pci ( nic->pdo );
+
+	return nic;
+}
+
+/**
+ * Free NIC inventory entry
+ *
+ * @v nic		Inventory entry
+ */
+static VOID free_nic ( PNIC_ENTRY nic ) {
+
+	if ( nic->file )
+		ObDereferenceObject ( nic->file );
+	if ( nic->netcfginstanceid )
+		ExFreePool ( nic->netcfginstanceid );
+	if ( nic->pdo )
+		ObDereferenceObject ( nic->pdo );
+	ExFreePool ( nic );
+}
+
+/**
+ * Create NIC inventory entry
+ *
+ * @v name		NDIS device name
+ * @v device		NDIS device object
+ * @v file		NDIS file object
+ * @ret ntstatus	NT status
+ *
+ * The inventory entry takes ownership of the file object reference.
+ */
+static NTSTATUS create_nic ( PUNICODE_STRING name, PDEVICE_OBJECT device,
+			     PFILE_OBJECT file ) {
+	PNIC_ENTRY nic;
+
+	/* Allocate inventory entry */
+	nic = alloc_nic ( name, device, file );
+	if ( ! nic )
+		return STATUS_NO_MEMORY;
+
+	/* Add to inventory */
+	nic->order = nic_inventory.count++;
+	InsertTailList ( &nic_inventory.nics, &nic->list );
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Complete resolved NIC inventory entry
+ *
+ * @v nic		Inventory entry with MAC address
+ */
+static VOID complete_nic ( PNIC_ENTRY nic ) {
 
 	/* Get NetCfgInstanceId */
-	status = fetch_netcfginstanceid ( pdo, &netcfginstanceid );
-	if ( ! NT_SUCCESS ( status ) )
-		goto err_fetch_netcfginstanceid;
-	DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x is NetCfgInstanceId "
-		   "\"%S\"\n",  mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
-		   netcfginstanceid );
+	nic->key = nic_key ( nic->mac );
+	if ( NT_SUCCESS ( nic->status ) ) {
+		nic->status = fetch_netcfginstanceid ( nic->pdo,
+						       &nic->netcfginstanceid );
+	}
+}
+
+/**
+ * Add resolved NIC to inventory index
+ *
+ * @v nic		Inventory entry with MAC address
+ */
+static VOID index_nic ( PNIC_ENTRY nic ) {
+	PNIC_ENTRY *link;
+
+	/* Complete inventory entry */
+	complete_nic ( nic );
+
+	/* Add to index, keeping each bucket in enumeration order.
+	 * NICs may be resolved in any order, but if more than one
+	 * interface shares a MAC address, the first one enumerated
+	 * takes precedence.
+	 */
+	link = &nic_inventory.hash[ nic_bucket ( nic->key ) ];
+	while ( *link && ( (*link)->order < nic->order ) )
+		link = &(*link)->next;
+	nic->next = *link;
+	*link = nic;
+}
+
+/**
+ * Resolve single NIC inventory entry
+ *
+ * @v nic		Inventory entry
+ * @ret ntstatus	NT status
+ *
+ * The MAC address is queried synchronously, and the inventory entry
+ * is then completed.  The entry is not added to the inventory index.
+ */
+static NTSTATUS resolve_nic ( PNIC_ENTRY nic ) {
+	KSEMAPHORE window;
+	NTSTATUS status;
 
-	/* Store registry values */
-	status = process ( pdo, netcfginstanceid, opaque );
+	KeInitializeSemaphore ( &window, 1, 1 );
+	KeWaitForSingleObject ( &window, Executive, KernelMode, FALSE, NULL );
+	status = start_fetch_mac ( nic, &window );
+	status = finish_fetch_mac ( nic, status );
 	if ( ! NT_SUCCESS ( status ) )
-		goto err_process;
+		return status;
+	complete_nic ( nic );
+	return STATUS_SUCCESS;
+}
 
- err_process:
-	ExFreePool ( netcfginstanceid );
- err_fetch_netcfginstanceid:
- err_fetch_pdo:
- err_compare_mac:
- err_fetch_mac:
-	/* Drop object reference */
-	ObDereferenceObject ( file );
- err_iogetdeviceobjectpointer:
-	/* Disable interface if we had to enable it */
-	if ( must_disable )
-		IoSetDeviceInterfaceState ( name, FALSE );
-	return status;
+/**
+ * Release NDIS objects held by NIC inventory entry
+ *
+ * @v nic		Inventory entry
+ */
+static VOID release_nic ( PNIC_ENTRY nic ) {
+
+	if ( nic->file ) {
+		ObDereferenceObject ( nic->file );
+		nic->file = NULL;
+		nic->device = NULL;
+	}
 }
 
 /**
- * Try processing NIC
+ * Build NIC inventory
  *
- * @v mac		MAC address
- * @v process		Processing function
- * @v opaque		Argument to processing function
  * @ret ntstatus	NT status
+ *
+ * The inventory is built once, and then used for all NIC lookups
+ * until it is freed.  MAC addresses are not queried at this stage;
+ * see resolve_nics().
  */
-NTSTATUS find_nic ( PUCHAR mac,
-		    NTSTATUS ( *process ) ( PDEVICE_OBJECT pdo,
-					    LPWSTR netcfginstanceid,
-					    PVOID opaque ),
-		    PVOID opaque ) {
+static NTSTATUS build_nic_inventory ( VOID ) {
 	PWSTR symlinks;
 	PWSTR symlink;
 	UNICODE_STRING u_symlink;
-	BOOLEAN found;
+	PFILE_OBJECT file;
+	PDEVICE_OBJECT device;
 	NTSTATUS status;
 
 	/* Get list of all objects providing GUID_NDIS_LAN_CLASS interface */
@@ -294,21 +732,1215 @@ NTSTATUS find_nic ( PUCHAR mac,
 		return status;
 	}
 
-	/* Look for a matching NIC */
+	/* Record each attached NIC */
 	for ( symlink = symlinks ;
 	      RtlInitUnicodeString ( &u_symlink, symlink ) , *symlink ;
 	      symlink += ( ( u_symlink.Length / sizeof ( *symlink ) ) + 1 ) ) {
-		status = try_nic ( mac, &u_symlink, process, opaque, &found );
-		if ( found )
-			goto done;
+
+		/* Enable interface if not already done */
+		devintf_enable ( &u_symlink );
+
+		/* Get device and file object pointers */
+		status = IoGetDeviceObjectPointer ( &u_symlink,
+						    FILE_ALL_ACCESS, &file,
+						    &device );
+		if ( ! NT_SUCCESS ( status ) ) {
+			/* Not an error, apparently;
+			 * IoGetDeviceInterfaces() seems to return a
+			 * whole load of interfaces that aren't
+			 * attached to any objects.
+			 */
+			continue;
+		}
+
+		/* Create inventory entry */
+		create_nic ( &u_symlink, device, file );
 	}
-	status = STATUS_NO_SUCH_FILE;
-	BootPrint ( "ERROR: %02x:%02x:%02x:%02x:%02x:%02x not found\n",
-		    mac[0], mac[1], mac[2], mac[3], mac[4], mac[5] );
+	nic_inventory.built = TRUE;
+	DbgPrint ( "Found %ld NIC(s)\n", nic_inventory.count );
 
- done:
 	/* Free object list */
 	ExFreePool ( symlinks );
 
-	return status;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Resolve MAC addresses of NICs in inventory
+ *
+ * @v pci_bus_dev_func	PCI bus:dev.fn to resolve, or NIC_PCI_NONE for all
+ *
+ * MAC address queries are issued to all selected NICs concurrently
+ * (subject to a bounded in-flight window), so that the total time
+ * taken depends upon the slowest NIC rather than the sum of all NICs.
+ */
+static VOID resolve_nics ( ULONG pci_bus_dev_func ) {
+	KSEMAPHORE window;
+	PLIST_ENTRY entry;
+	PNIC_ENTRY nic;
+	NTSTATUS status;
+
+	/* Start MAC address queries for each selected NIC */
+	KeInitializeSemaphore ( &window, NIC_MAX_IN_FLIGHT,
+				NIC_MAX_IN_FLIGHT );
+	for ( entry = nic_inventory.nics.Flink ;
+	      entry != &nic_inventory.nics ; entry = entry->Flink ) {
+		nic = CONTAINING_RECORD ( entry, NIC_ENTRY, list );
+		if ( ( nic->resolved ) || ( ! nic->file ) )
+			continue;
+		if ( ( pci_bus_dev_func != NIC_PCI_NONE ) &&
+		     ( pci_bus_dev_func != nic->pci_bus_dev_func ) )
+			continue;
+		KeWaitForSingleObject ( &window, Executive, KernelMode,
+					FALSE, NULL );
+		nic->mac_status = start_fetch_mac ( nic, &window );
+		nic_inventory.queries++;
+	}
+
+	/* Collect MAC address query results */
+	for ( entry = nic_inventory.nics.Flink ;
+	      entry != &nic_inventory.nics ; entry = entry->Flink ) {
+		nic = CONTAINING_RECORD ( entry, NIC_ENTRY, list );
+		if ( ( nic->resolved ) || ( ! nic->file ) )
+			continue;
+		if ( ( pci_bus_dev_func != NIC_PCI_NONE ) &&
+		     ( pci_bus_dev_func != nic->pci_bus_dev_func ) )
+			continue;
+		status = finish_fetch_mac ( nic, nic->mac_status );
+		if ( NT_SUCCESS ( status ) ) {
+			/* Keep interface open for capability snapshot */
+			index_nic ( nic );
+		} else {
+			release_nic ( nic );
+		}
+		nic->resolved = TRUE;
+	}
+}
+
+/**
+ * Free NIC inventory
+ *
+ */
+VOID free_nic_inventory ( VOID ) {
+	PLIST_ENTRY entry;
+	PNIC_ENTRY nic;
+
+	while ( ! IsListEmpty ( &nic_inventory.nics ) ) {
+		entry = RemoveHeadList ( &nic_inventory.nics );
+		nic = CONTAINING_RECORD ( entry, NIC_ENTRY, list );
+		free_nic ( nic );
+	}
+	RtlZeroMemory ( nic_inventory.hash, sizeof ( nic_inventory.hash ) );
+	DbgPrint ( "Issued %ld MAC address quer%s\n", nic_inventory.queries,
+		   ( ( nic_inventory.queries == 1 ) ? "y" : "ies" ) );
+	nic_inventory.count = 0;
+	nic_inventory.queries = 0;
+	nic_inventory.built = FALSE;
+}
+
+/**
+ * Look up NIC in inventory
+ *
+ * @v mac		MAC address
+ * @ret nic		Inventory entry, or NULL
+ */
+static PNIC_ENTRY lookup_nic ( PUCHAR mac ) {
+	ULONGLONG key = nic_key ( mac );
+	PNIC_ENTRY nic;
+
+	for ( nic = nic_inventory.hash[ nic_bucket ( key ) ] ; nic ;
+	      nic = nic->next ) {
+		if ( nic->key == key )
+			return nic;
+	}
+	return NULL;
+}
+
+/**
+ * Construct NIC binding cache value name
+ *
+ * @v mac		MAC address
+ * @v value_name	Value name buffer to fill in
+ * @v len		Length of value name buffer
+ */
+static VOID nic_cache_value_name ( PUCHAR mac, LPWSTR value_name,
+				   SIZE_T len ) {
+
+	RtlStringCbPrintfW ( value_name, len, NIC_CACHE_VALUE_FMT,
+			     mac[0], mac[1], mac[2], mac[3], mac[4], mac[5] );
+}
+
+/**
+ * Look up NIC in binding cache
+ *
+ * @v mac		MAC address
+ * @ret nic		Validated inventory entry, or NULL
+ *
+ * A cached binding is used only if the cached interface still exists,
+ * still reports the same MAC address, and still has the same
+ * NetCfgInstanceId and hardware ID.  The returned entry is not part
+ * of the inventory, and must be freed by the caller.
+ */
+static PNIC_ENTRY lookup_cached_nic ( PUCHAR mac ) {
+	WCHAR value_name[NIC_CACHE_VALUE_LEN];
+	UNICODE_STRING name;
+	HANDLE reg_key;
+	LPWSTR *values;
+	LPWSTR hardware_id;
+	PFILE_OBJECT file;
+	PDEVICE_OBJECT device;
+	PNIC_ENTRY nic;
+	NTSTATUS status;
+
+	/* Fetch cached binding */
+	status = reg_open_parameters ( &reg_key, REG_SITE_NIC_CACHE );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_open;
+	nic_cache_value_name ( mac, value_name, sizeof ( value_name ) );
+	status = reg_fetch_multi_sz ( reg_key, value_name, &values );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_fetch_multi_sz;
+	if ( ! ( values[0] && values[1] && values[2] ) ) {
+		DbgPrint ( "Ignoring malformed %S\n", value_name );
+		goto err_malformed;
+	}
+
+	/* Open cached interface, enabling it if not already done */
+	RtlInitUnicodeString ( &name, values[0] );
+	devintf_enable ( &name );
+	status = IoGetDeviceObjectPointer ( &name, FILE_ALL_ACCESS,
+					    &file, &device );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Cached interface \"%wZ\" is gone: %x\n",
+			   &name, status );
+		goto err_iogetdeviceobjectpointer;
+	}
+	nic = alloc_nic ( &name, device, file );
+	if ( ! nic )
+		goto err_alloc_nic;
+
+	/* Validate cached binding */
+	status = resolve_nic ( nic );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_resolve_nic;
+	if ( memcmp ( nic->mac, mac, sizeof ( nic->mac ) ) != 0 ) {
+		DbgPrint ( "Cached interface \"%wZ\" has changed MAC\n",
+			   &name );
+		goto err_mac;
+	}
+	if ( ! NT_SUCCESS ( nic->status ) )
+		goto err_status;
+	if ( _wcsicmp ( nic->netcfginstanceid, values[1] ) != 0 ) {
+		DbgPrint ( "Cached interface \"%wZ\" has changed "
+			   "NetCfgInstanceId\n", &name );
+		goto err_netcfginstanceid;
+	}
+	status = fetch_hardware_id ( nic->pdo, &hardware_id );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_fetch_hardware_id;
+	if ( _wcsicmp ( hardware_id, values[2] ) != 0 ) {
+		DbgPrint ( "Cached interface \"%wZ\" has changed hardware "
+			   "ID\n", &name );
+		goto err_hardware_id;
+	}
+
+	/* Cached binding is valid */
+	ExFreePool ( hardware_id );
+	ExFreePool ( values );
+	reg_close ( reg_key );
+	return nic;
+
+ err_hardware_id:
+	ExFreePool ( hardware_id );
+ err_fetch_hardware_id:
+ err_netcfginstanceid:
+ err_status:
+ err_mac:
+ err_resolve_nic:
+	free_nic ( nic );
+ err_alloc_nic:
+ err_iogetdeviceobjectpointer:
+ err_malformed:
+	ExFreePool ( values );
+ err_reg_fetch_multi_sz:
+	reg_close ( reg_key );
+ err_reg_open:
+	return NULL;
+}
+
+/**
+ * Record NIC in binding cache
+ *
+ * @v nic		Inventory entry
+ * @v lookup_time	Time taken to find NIC without cache, in ms
+ */
+static VOID store_cached_nic ( PNIC_ENTRY nic, ULONG lookup_time ) {
+	WCHAR value_name[NIC_CACHE_VALUE_LEN];
+	HANDLE reg_key;
+	LPWSTR hardware_id;
+	NTSTATUS status;
+
+	/* Fetch hardware ID */
+	status = fetch_hardware_id ( nic->pdo, &hardware_id );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_fetch_hardware_id;
+
+	/* Store cached binding */
+	status = reg_open_parameters ( &reg_key, REG_SITE_NIC_CACHE );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_open;
+	nic_cache_value_name ( nic->mac, value_name, sizeof ( value_name ) );
+	status = reg_store_multi_sz ( reg_key, value_name, nic->name.Buffer,
+				      nic->netcfginstanceid, hardware_id,
+				      NULL );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store_multi_sz;
+
+	/* Record uncached lookup time, for estimating time saved */
+	reg_store_dword ( reg_key, NIC_CACHE_TIME_VALUE, lookup_time );
+
+ err_reg_store_multi_sz:
+	reg_close ( reg_key );
+ err_reg_open:
+	ExFreePool ( hardware_id );
+ err_fetch_hardware_id:
+	return;
+}
+
+/**
+ * Estimate time saved by NIC binding cache
+ *
+ * @v elapsed		Time taken to find NIC using cache, in ms
+ * @ret saved		Estimated time saved, in milliseconds
+ */
+static ULONG nic_cache_saved ( ULONG elapsed ) {
+	HANDLE reg_key;
+	ULONG lookup_time;
+	NTSTATUS status;
+
+	status = reg_open_parameters ( &reg_key, REG_SITE_NIC_CACHE );
+	if ( ! NT_SUCCESS ( status ) )
+		return 0;
+	status = reg_fetch_dword ( reg_key, NIC_CACHE_TIME_VALUE,
+				   &lookup_time );
+	reg_close ( reg_key );
+	if ( ! NT_SUCCESS ( status ) )
+		return 0;
+	return ( ( lookup_time > elapsed ) ? ( lookup_time - elapsed ) : 0 );
+}
+
+/**
+ * Query NIC capability
+ *
+ * @v nic		Inventory entry
+ * @v caps		Capability snapshot
+ * @v flag		Capability flag
+ * @v oid		Object identifier
+ * @v buf		Buffer to fill in
+ * @v len		Length of buffer
+ */
+static VOID fetch_nic_cap ( PNIC_ENTRY nic, PNIC_CAPS caps, ULONG flag,
+			    ULONG oid, PVOID buf, ULONG len ) {
+	NTSTATUS status;
+
+	status = fetch_oid ( nic, oid, buf, len );
+	if ( NT_SUCCESS ( status ) ) {
+		caps->valid |= flag;
+	} else {
+		DbgPrint ( "Could not query OID %08lx for \"%wZ\": %x\n",
+			   oid, &nic->name, status );
+	}
+}
+
+/**
+ * Store NIC capability snapshots
+ *
+ * The caller must hold the NIC lock.
+ */
+static VOID store_nic_caps ( VOID ) {
+	HANDLE reg_key;
+	NTSTATUS status;
+
+	status = reg_open_parameters ( &reg_key, REG_SITE_NIC_CAPS );
+	if ( ! NT_SUCCESS ( status ) )
+		return;
+	reg_store_binary ( reg_key, NIC_CAPS_VALUE_NAME, &nic_caps,
+			   sizeof ( nic_caps ) );
+	reg_close ( reg_key );
+}
+
+/**
+ * Take NIC capability snapshot
+ *
+ * @v nic		Inventory entry
+ *
+ * The NDIS file object is reused if still held, otherwise the
+ * interface is reopened.  The file object is released once the
+ * snapshot has been taken.
+ */
+static VOID snapshot_nic ( PNIC_ENTRY nic ) {
+	NIC_CAPS caps;
+#if NDIS_SUPPORT_NDIS6
+	NDIS_OFFLOAD offload;
+	NDIS_RECEIVE_SCALE_CAPABILITIES rss;
+#endif
+	PUCHAR mac = nic->mac;
+	NTSTATUS status;
+
+	/* Reopen interface, if necessary */
+	if ( ! nic->file ) {
+		status = IoGetDeviceObjectPointer ( &nic->name,
+						    FILE_ALL_ACCESS,
+						    &nic->file,
+						    &nic->device );
+		if ( ! NT_SUCCESS ( status ) ) {
+			DbgPrint ( "Could not reopen \"%wZ\" for capability "
+				   "snapshot: %x\n", &nic->name, status );
+			nic->file = NULL;
+			nic->device = NULL;
+			return;
+		}
+	}
+
+	/* Query capabilities */
+	RtlZeroMemory ( &caps, sizeof ( caps ) );
+	RtlCopyMemory ( caps.mac, nic->mac, sizeof ( caps.mac ) );
+	fetch_nic_cap ( nic, &caps, NIC_CAPS_LINK_SPEED, OID_GEN_LINK_SPEED,
+			&caps.link_speed, sizeof ( caps.link_speed ) );
+	fetch_nic_cap ( nic, &caps, NIC_CAPS_MEDIA_CONNECT,
+			OID_GEN_MEDIA_CONNECT_STATUS, &caps.media_connect,
+			sizeof ( caps.media_connect ) );
+	fetch_nic_cap ( nic, &caps, NIC_CAPS_MAX_FRAME_SIZE,
+			OID_GEN_MAXIMUM_FRAME_SIZE, &caps.max_frame_size,
+			sizeof ( caps.max_frame_size ) );
+	fetch_nic_cap ( nic, &caps, NIC_CAPS_PACKET_FILTER,
+			OID_GEN_CURRENT_PACKET_FILTER, &caps.packet_filter,
+			sizeof ( caps.packet_filter ) );
+#if NDIS_SUPPORT_NDIS6
+	RtlZeroMemory ( &offload, sizeof ( offload ) );
+	fetch_nic_cap ( nic, &caps, NIC_CAPS_OFFLOAD,
+			OID_TCP_OFFLOAD_CURRENT_CONFIG, &offload,
+			sizeof ( offload ) );
+	if ( offload.Checksum.IPv4Transmit.TcpChecksum )
+		caps.offload |= NIC_CAPS_OFFLOAD_IPV4_TX_CSUM;
+	if ( offload.Checksum.IPv4Receive.TcpChecksum )
+		caps.offload |= NIC_CAPS_OFFLOAD_IPV4_RX_CSUM;
+	if ( offload.Checksum.IPv6Transmit.TcpChecksum )
+		caps.offload |= NIC_CAPS_OFFLOAD_IPV6_TX_CSUM;
+	if ( offload.Checksum.IPv6Receive.TcpChecksum )
+		caps.offload |= NIC_CAPS_OFFLOAD_IPV6_RX_CSUM;
+	if ( offload.LsoV2.IPv4.MaxOffLoadSize )
+		caps.offload |= NIC_CAPS_OFFLOAD_IPV4_LSO;
+	if ( offload.LsoV2.IPv6.MaxOffLoadSize )
+		caps.offload |= NIC_CAPS_OFFLOAD_IPV6_LSO;
+	caps.lso_max_size = offload.LsoV2.IPv4.MaxOffLoadSize;
+	RtlZeroMemory ( &rss, sizeof ( rss ) );
+	fetch_nic_cap ( nic, &caps, NIC_CAPS_RSS,
+			OID_GEN_RECEIVE_SCALE_CAPABILITIES, &rss,
+			sizeof ( rss ) );
+	caps.rss_flags = rss.CapabilitiesFlags;
+	caps.rss_queues = rss.NumberOfReceiveQueues;
+#endif
+	caps.mtu = fetch_nic_mtu ( mac );
+
+	/* Release interface */
+	release_nic ( nic );
+
+	DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x link %ld Mbps (%s) "
+		   "frame %ld filter %#lx offload %#lx RSS %ld queue(s)\n",
+		   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+		   ( caps.link_speed / 10000 ),
+		   ( ( caps.media_connect == NdisMediaStateConnected ) ?
+		     "up" : "down" ), caps.max_frame_size, caps.packet_filter,
+		   caps.offload, caps.rss_queues );
+	if ( ( caps.valid & NIC_CAPS_MAX_FRAME_SIZE ) &&
+	     ( caps.max_frame_size < caps.mtu ) ) {
+		DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x frame %ld is "
+			   "below configured MTU %ld until restarted\n",
+			   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+			   caps.max_frame_size, caps.mtu );
+	}
+
+	/* Record snapshot */
+	KeWaitForSingleObject ( &nic_lock, Executive, KernelMode,
+				FALSE, NULL );
+	if ( nic_caps.count < NIC_MAX_CAPS ) {
+		RtlCopyMemory ( &nic_caps.caps[nic_caps.count++], &caps,
+				sizeof ( caps ) );
+		store_nic_caps();
+	} else {
+		DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x snapshot not "
+			   "recorded: table holds only %d NICs\n", mac[0],
+			   mac[1], mac[2], mac[3], mac[4], mac[5],
+			   NIC_MAX_CAPS );
+	}
+	KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+}
+
+/**
+ * Fetch configured NIC MTU
+ *
+ * @v mac		MAC address
+ * @ret mtu		Configured MTU, or zero to leave unchanged
+ *
+ * A per-NIC "Mtu_xxxxxxxxxxxx" value under the Parameters key takes
+ * precedence over the global Mtu parameter.
+ */
+ULONG fetch_nic_mtu ( PUCHAR mac ) {
+	WCHAR value_name[NIC_MTU_VALUE_LEN];
+	HANDLE reg_key;
+	ULONG mtu;
+	NTSTATUS status;
+
+	status = reg_open_parameters ( &reg_key, REG_SITE_NIC_MTU );
+	if ( ! NT_SUCCESS ( status ) )
+		return nic_mtu;
+	RtlStringCbPrintfW ( value_name, sizeof ( value_name ),
+			     NIC_MTU_VALUE_FMT, mac[0], mac[1], mac[2],
+			     mac[3], mac[4], mac[5] );
+	status = reg_fetch_dword ( reg_key, value_name, &mtu );
+	reg_close ( reg_key );
+	if ( ! NT_SUCCESS ( status ) )
+		return nic_mtu;
+	if ( mtu > NIC_MTU_MAX ) {
+		DbgPrint ( "Ignoring out-of-range %S %ld\n", value_name, mtu );
+		return nic_mtu;
+	}
+	return mtu;
+}
+
+/**
+ * Fetch numeric advanced property parameter
+ *
+ * @v param_key		Advanced property parameter key
+ * @v value_name	Registry value name
+ * @v value		Value to fill in
+ * @ret ntstatus	NT status
+ *
+ * Advanced property parameters such as "min" and "max" are stored as
+ * decimal strings.
+ */
+static NTSTATUS fetch_ndi_param ( HANDLE param_key, LPCWSTR value_name,
+				  PULONG value ) {
+	UNICODE_STRING u_value;
+	LPWSTR buf;
+	NTSTATUS status;
+
+	status = reg_fetch_sz ( param_key, value_name, &buf );
+	if ( ! NT_SUCCESS ( status ) )
+		return status;
+	RtlInitUnicodeString ( &u_value, buf );
+	status = RtlUnicodeStringToInteger ( &u_value, 10, value );
+	ExFreePool ( buf );
+	return status;
+}
+
+/**
+ * Check jumbo frame size against adapter's supported values
+ *
+ * @v param_key		*JumboPacket advanced property parameter key
+ * @v frame_size	Requested frame size
+ * @ret frame_size	Supported frame size, or zero if unsupported
+ *
+ * An "enum" property must list the requested size exactly.  An "int"
+ * property is clamped to its "min" and "max" and rounded down to a
+ * multiple of its "step".
+ */
+static ULONG check_jumbo_packet ( HANDLE param_key, ULONG frame_size ) {
+	WCHAR value_name[12];
+	HANDLE enum_key;
+	LPWSTR type;
+	LPWSTR desc;
+	ULONG min;
+	ULONG max;
+	ULONG step;
+	BOOLEAN is_enum;
+	NTSTATUS status;
+
+	/* Determine property type */
+	status = reg_fetch_sz ( param_key, L"type", &type );
+	if ( ! NT_SUCCESS ( status ) )
+		return 0;
+	is_enum = ( _wcsicmp ( type, L"enum" ) == 0 );
+	ExFreePool ( type );
+
+	/* Enumerated sizes must match exactly */
+	if ( is_enum ) {
+		status = reg_open_relative ( &enum_key, param_key, L"enum" );
+		if ( ! NT_SUCCESS ( status ) )
+			return 0;
+		RtlStringCbPrintfW ( value_name, sizeof ( value_name ),
+				     L"%ld", frame_size );
+		status = reg_fetch_sz ( enum_key, value_name, &desc );
+		reg_close ( enum_key );
+		if ( ! NT_SUCCESS ( status ) )
+			return 0;
+		ExFreePool ( desc );
+		return frame_size;
+	}
+
+	/* Clamp integer sizes to supported range */
+	if ( NT_SUCCESS ( fetch_ndi_param ( param_key, L"max", &max ) ) &&
+	     ( frame_size > max ) ) {
+		frame_size = max;
+	}
+	if ( ! NT_SUCCESS ( fetch_ndi_param ( param_key, L"min", &min ) ) )
+		min = 0;
+	if ( frame_size < min )
+		return 0;
+	if ( NT_SUCCESS ( fetch_ndi_param ( param_key, L"step", &step ) ) &&
+	     ( step > 1 ) ) {
+		frame_size -= ( ( frame_size - min ) % step );
+	}
+	return frame_size;
+}
+
+/**
+ * Store NIC jumbo frame size
+ *
+ * @v pdo		Physical device object
+ * @v mtu		MTU
+ * @ret ntstatus	NT status
+ *
+ * The standardised *JumboPacket advanced property is set only if the
+ * adapter's driver supports it, and only to a frame size that the
+ * driver advertises as valid.  The miniport reads the property when
+ * it initialises, so the new frame size may not take effect until the
+ * adapter is next restarted.
+ */
+NTSTATUS store_nic_jumbo_packet ( PDEVICE_OBJECT pdo, ULONG mtu ) {
+	WCHAR value[12];
+	HANDLE reg_key;
+	HANDLE param_key;
+	ULONG frame_size;
+	NTSTATUS status;
+
+	/* Open driver registry key */
+	status = IoOpenDeviceRegistryKey ( pdo, PLUGPLAY_REGKEY_DRIVER,
+					   KEY_ALL_ACCESS, &reg_key );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not open driver registry key for PDO %p: "
+			   "%x\n", pdo, status );
+		goto err_ioopendeviceregistrykey;
+	}
+	reg_track_key ( reg_key, REG_SITE_NIC_MTU );
+
+	/* Check that driver supports *JumboPacket */
+	status = reg_open_relative ( &param_key, reg_key,
+				     L"Ndi\\Params\\*JumboPacket" );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "PDO %p does not support jumbo frames\n", pdo );
+		goto err_reg_open_relative;
+	}
+	frame_size = check_jumbo_packet ( param_key, ( mtu + NIC_ETH_HLEN ) );
+	reg_close ( param_key );
+	if ( ! frame_size ) {
+		DbgPrint ( "PDO %p does not support MTU %ld\n", pdo, mtu );
+		status = STATUS_NOT_SUPPORTED;
+		goto err_check_jumbo_packet;
+	}
+	if ( frame_size != ( mtu + NIC_ETH_HLEN ) ) {
+		DbgPrint ( "PDO %p MTU %ld clamped to %ld\n", pdo, mtu,
+			   ( frame_size - NIC_ETH_HLEN ) );
+	}
+
+	/* Store frame size */
+	RtlStringCbPrintfW ( value, sizeof ( value ), L"%ld", frame_size );
+	status = reg_store_sz ( reg_key, L"*JumboPacket", value );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store_sz;
+	DbgPrint ( "PDO %p *JumboPacket is %S\n", pdo, value );
+
+ err_reg_store_sz:
+ err_check_jumbo_packet:
+ err_reg_open_relative:
+	reg_untrack_key ( reg_key );
+	ZwClose ( reg_key );
+ err_ioopendeviceregistrykey:
+	return status;
+}
+
+/**
+ * Fetch NIC capability snapshots
+ *
+ * @v buf		Buffer to fill in
+ * @v len		Length of buffer
+ * @v copied		Length of data copied to fill in
+ * @ret ntstatus	NT status
+ */
+NTSTATUS fetch_nic_caps ( PVOID buf, ULONG len, PULONG copied ) {
+
+	DbgPrint ( "NIC capabilities requested\n" );
+
+	KeWaitForSingleObject ( &nic_lock, Executive, KernelMode,
+				FALSE, NULL );
+	if ( len > sizeof ( nic_caps ) )
+		len = sizeof ( nic_caps );
+	RtlCopyMemory ( buf, &nic_caps, len );
+	*copied = len;
+	KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Process matched NIC
+ *
+ * @v nic		Inventory entry
+ * @v process		Processing function
+ * @v opaque		Argument to processing function
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS process_nic ( PNIC_ENTRY nic,
+			      NTSTATUS ( *process ) ( PDEVICE_OBJECT pdo,
+						      LPWSTR netcfginstanceid,
+						      PVOID opaque ),
+			      PVOID opaque ) {
+	PUCHAR mac = nic->mac;
+	NTSTATUS status;
+
+	DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x is interface \"%wZ\"\n",
+		   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+		   &nic->name );
+	status = nic->status;
+	if ( ! NT_SUCCESS ( status ) )
+		return status;
+	DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x is PDO %p\n",
+		   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], nic->pdo );
+	DbgPrint ( "NIC %02x:%02x:%02x:%02x:%02x:%02x is NetCfgInstanceId "
+		   "\"%S\"\n",  mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+		   nic->netcfginstanceid );
+
+	/* Record NIC capabilities */
+	snapshot_nic ( nic );
+
+	/* Store registry values.  Processing functions may be called
+	 * from both the configuration thread and from arrival work
+	 * items, so calls are serialised.
+	 */
+	KeWaitForSingleObject ( &nic_lock, Executive, KernelMode,
+				FALSE, NULL );
+	status = process ( nic->pdo, nic->netcfginstanceid, opaque );
+	KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+
+	return status;
+}
+
+/**
+ * Handle expiry of pending NIC requests
+ *
+ * @v device		Device object
+ * @v context		Registration generation
+ */
+static VOID expire_pending_nics ( PDEVICE_OBJECT device, PVOID context ) {
+	ULONG generation = ( ( ULONG ) ( ULONG_PTR ) context );
+	PNIC_PENDING pending;
+	PLIST_ENTRY entry;
+	PUCHAR mac;
+
+	KeWaitForSingleObject ( &nic_lock, Executive, KernelMode,
+				FALSE, NULL );
+
+	/* Ignore expiry of an earlier registration */
+	if ( generation != nic_pending.generation ) {
+		DbgPrint ( "Ignoring stale NIC arrival deadline\n" );
+		KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+		return;
+	}
+
+	/* Fail all outstanding requests */
+	while ( ! IsListEmpty ( &nic_pending.requests ) ) {
+		entry = RemoveHeadList ( &nic_pending.requests );
+		pending = CONTAINING_RECORD ( entry, NIC_PENDING, list );
+		mac = pending->mac;
+		BootPrint ( "ERROR: %02x:%02x:%02x:%02x:%02x:%02x did not "
+			    "appear\n", mac[0], mac[1], mac[2], mac[3], mac[4],
+			    mac[5] );
+		InterlockedIncrement ( ( PLONG ) &boot_history.nics_missing );
+		InterlockedOr ( ( PLONG ) &boot_history.failures,
+				HISTORY_FAIL_NIC );
+		ExFreePool ( pending );
+	}
+
+	/* Stop listening for arrivals */
+	if ( nic_pending.notification ) {
+		IoUnregisterPlugPlayNotification ( nic_pending.notification );
+		nic_pending.notification = NULL;
+	}
+
+	KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+
+	/* Record boot history, which may already have been saved */
+	history_update();
+
+	( VOID ) device;
+}
+
+/**
+ * Handle pending NIC request deadline
+ *
+ * @v dpc		DPC
+ * @v context		Context
+ * @v arg1		Unused
+ * @v arg2		Unused
+ */
+static VOID pending_nics_deadline ( PKDPC dpc, PVOID context,
+				    PVOID arg1, PVOID arg2 ) {
+
+	/* Defer to a work item, since we are at DISPATCH_LEVEL */
+	IoQueueWorkItem ( nic_pending.expire, expire_pending_nics,
+			  DelayedWorkQueue,
+			  ( ( PVOID ) ( ULONG_PTR ) nic_pending.generation ) );
+
+	( VOID ) dpc;
+	( VOID ) context;
+	( VOID ) arg1;
+	( VOID ) arg2;
+}
+
+/**
+ * Try arrived NIC against pending requests
+ *
+ * @v device		Device object
+ * @v context		NIC arrival
+ */
+static VOID try_arrived_nic ( PDEVICE_OBJECT device, PVOID context ) {
+	PNIC_ARRIVAL arrival = context;
+	PFILE_OBJECT file;
+	PDEVICE_OBJECT nic_device;
+	PNIC_ENTRY nic;
+	PNIC_PENDING pending;
+	PLIST_ENTRY entry;
+	ULONGLONG started;
+	ULONG lookup_time;
+	NTSTATUS status;
+
+	started = history_now();
+
+	/* Get device and file object pointers */
+	status = IoGetDeviceObjectPointer ( &arrival->name, FILE_ALL_ACCESS,
+					    &file, &nic_device );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_iogetdeviceobjectpointer;
+
+	/* Query MAC address */
+	nic = alloc_nic ( &arrival->name, nic_device, file );
+	if ( ! nic )
+		goto err_alloc_nic;
+	status = resolve_nic ( nic );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_resolve_nic;
+
+	/* Look for a matching pending request */
+	KeWaitForSingleObject ( &nic_lock, Executive, KernelMode,
+				FALSE, NULL );
+	pending = NULL;
+	for ( entry = nic_pending.requests.Flink ;
+	      entry != &nic_pending.requests ; entry = entry->Flink ) {
+		pending = CONTAINING_RECORD ( entry, NIC_PENDING, list );
+		if ( memcmp ( pending->mac, nic->mac,
+			      sizeof ( nic->mac ) ) == 0 ) {
+			RemoveEntryList ( &pending->list );
+			break;
+		}
+		pending = NULL;
+	}
+	KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+	if ( ! pending )
+		goto err_no_pending;
+
+	/* Process NIC */
+	DbgPrint ( "Pending NIC %02x:%02x:%02x:%02x:%02x:%02x arrived\n",
+		   nic->mac[0], nic->mac[1], nic->mac[2], nic->mac[3],
+		   nic->mac[4], nic->mac[5] );
+	lookup_time = ( ( ULONG ) ( history_now() - started ) );
+	status = process_nic ( nic, pending->process, pending->opaque );
+	InterlockedIncrement ( ( PLONG ) &boot_history.nics_found );
+	if ( NT_SUCCESS ( status ) ) {
+		/* Record binding for next boot */
+		store_cached_nic ( nic, lookup_time );
+	} else {
+		BootPrint ( "ERROR: could not configure arrived NIC: %x\n",
+			    status );
+		InterlockedOr ( ( PLONG ) &boot_history.failures,
+				HISTORY_FAIL_NIC_CONFIG );
+	}
+	ExFreePool ( pending );
+
+	/* Stop listening once no requests remain */
+	KeWaitForSingleObject ( &nic_lock, Executive, KernelMode,
+				FALSE, NULL );
+	if ( IsListEmpty ( &nic_pending.requests ) &&
+	     nic_pending.notification ) {
+		KeCancelTimer ( &nic_pending.timer );
+		IoUnregisterPlugPlayNotification ( nic_pending.notification );
+		nic_pending.notification = NULL;
+	}
+	KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+
+	/* Record boot history, which may already have been saved */
+	history_update();
+
+ err_no_pending:
+ err_resolve_nic:
+	free_nic ( nic );
+ err_alloc_nic:
+ err_iogetdeviceobjectpointer:
+	IoFreeWorkItem ( arrival->item );
+	ExFreePool ( arrival );
+	( VOID ) device;
+}
+
+/**
+ * Queue arrived NIC to be tried against pending requests
+ *
+ * @v name		NDIS device name
+ */
+static VOID queue_arrived_nic ( PUNICODE_STRING name ) {
+	PNIC_ARRIVAL arrival;
+	ULONG len;
+
+	len = ( sizeof ( *arrival ) + name->Length );
+	arrival = ExAllocatePoolWithTag ( NonPagedPool, len,
+					  SANBOOTCONF_POOL_TAG );
+	if ( ! arrival )
+		return;
+	RtlZeroMemory ( arrival, len );
+	arrival->name.Buffer = arrival->buf;
+	arrival->name.MaximumLength =
+		( ( USHORT ) ( name->Length + sizeof ( WCHAR ) ) );
+	RtlCopyUnicodeString ( &arrival->name, name );
+	arrival->item = IoAllocateWorkItem ( nic_driver->DeviceObject );
+	if ( ! arrival->item ) {
+		ExFreePool ( arrival );
+		return;
+	}
+	IoQueueWorkItem ( arrival->item, try_arrived_nic, DelayedWorkQueue,
+			  arrival );
+}
+
+/**
+ * Handle NIC interface arrival notification
+ *
+ * @v data		Notification data
+ * @v context		Context
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS nic_arrival ( PVOID data, PVOID context ) {
+	PDEVICE_INTERFACE_CHANGE_NOTIFICATION notification = data;
+
+	/* Ignore everything except arrivals */
+	if ( ! IsEqualGUID ( &notification->Event,
+			     &GUID_DEVICE_INTERFACE_ARRIVAL ) )
+		return STATUS_SUCCESS;
+
+	/* Opening the device from within a PnP notification callback
+	 * risks deadlock, so defer to a work item.
+	 */
+	queue_arrived_nic ( notification->SymbolicLinkName );
+
+	( VOID ) context;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Check whether NIC is in inventory
+ *
+ * @v name		NDIS device name
+ * @ret present		NIC is present in inventory
+ */
+static BOOLEAN nic_in_inventory ( PUNICODE_STRING name ) {
+	PLIST_ENTRY entry;
+	PNIC_ENTRY nic;
+
+	for ( entry = nic_inventory.nics.Flink ;
+	      entry != &nic_inventory.nics ; entry = entry->Flink ) {
+		nic = CONTAINING_RECORD ( entry, NIC_ENTRY, list );
+		if ( RtlEqualUnicodeString ( &nic->name, name, TRUE ) )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * Rescan NIC inventory for interfaces that have since arrived
+ *
+ * Interfaces not already in the inventory are added to it, so that
+ * later lookups will find them, and are tried against the pending
+ * requests.  Existing interfaces are not queried again.
+ */
+static VOID rescan_nic_inventory ( VOID ) {
+	PWSTR symlinks;
+	PWSTR symlink;
+	UNICODE_STRING u_symlink;
+	PFILE_OBJECT file;
+	PDEVICE_OBJECT device;
+	NTSTATUS status;
+
+	status = IoGetDeviceInterfaces ( &GUID_NDIS_LAN_CLASS, NULL,
+					 DEVICE_INTERFACE_INCLUDE_NONACTIVE,
+					 &symlinks );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not rescan NIC list: %x\n", status );
+		return;
+	}
+	for ( symlink = symlinks ;
+	      RtlInitUnicodeString ( &u_symlink, symlink ) , *symlink ;
+	      symlink += ( ( u_symlink.Length / sizeof ( *symlink ) ) + 1 ) ) {
+		if ( nic_in_inventory ( &u_symlink ) )
+			continue;
+		devintf_enable ( &u_symlink );
+		status = IoGetDeviceObjectPointer ( &u_symlink,
+						    FILE_ALL_ACCESS, &file,
+						    &device );
+		if ( ! NT_SUCCESS ( status ) )
+			continue;
+		DbgPrint ( "Found new NIC \"%wZ\"\n", &u_symlink );
+		if ( NT_SUCCESS ( create_nic ( &u_symlink, device, file ) ) )
+			queue_arrived_nic ( &u_symlink );
+	}
+	ExFreePool ( symlinks );
+}
+
+/**
+ * Defer NIC request until NIC arrives
+ *
+ * @v mac		MAC address
+ * @v process		Processing function
+ * @v opaque		Argument to processing function
+ * @v opaque_len	Length of argument to processing function
+ * @ret ntstatus	NT status
+ *
+ * A copy of the opaque argument is retained until the request is
+ * either processed or expires.
+ */
+static NTSTATUS pend_nic ( PUCHAR mac,
+			   NTSTATUS ( *process ) ( PDEVICE_OBJECT pdo,
+						   LPWSTR netcfginstanceid,
+						   PVOID opaque ),
+			   PVOID opaque, ULONG opaque_len ) {
+	PNIC_PENDING pending;
+	LARGE_INTEGER due;
+	BOOLEAN registered = FALSE;
+	NTSTATUS status;
+
+	/* Do nothing unless arrival notifications are enabled */
+	if ( ! ( nic_driver && nic_driver->DeviceObject &&
+		 nic_arrival_timeout ) )
+		return STATUS_NO_SUCH_FILE;
+
+	/* Allocate pending request */
+	pending = ExAllocatePoolWithTag ( NonPagedPool,
+					  ( sizeof ( *pending ) + opaque_len ),
+					  SANBOOTCONF_POOL_TAG );
+	if ( ! pending ) {
+		DbgPrint ( "Could not allocate pending NIC request\n" );
+		return STATUS_NO_MEMORY;
+	}
+	RtlZeroMemory ( pending, sizeof ( *pending ) );
+	RtlCopyMemory ( pending->mac, mac, sizeof ( pending->mac ) );
+	pending->process = process;
+	pending->opaque = ( pending + 1 );
+	RtlCopyMemory ( pending->opaque, opaque, opaque_len );
+
+	KeWaitForSingleObject ( &nic_lock, Executive, KernelMode,
+				FALSE, NULL );
+
+	/* Start listening for arrivals, if not already doing so */
+	if ( ! nic_pending.notification ) {
+		if ( ! nic_pending.expire ) {
+			nic_pending.expire =
+				IoAllocateWorkItem ( nic_driver->DeviceObject );
+			if ( ! nic_pending.expire ) {
+				status = STATUS_NO_MEMORY;
+				goto err_ioallocateworkitem;
+			}
+		}
+		status = IoRegisterPlugPlayNotification (
+			EventCategoryDeviceInterfaceChange, 0,
+			( PVOID ) &GUID_NDIS_LAN_CLASS, nic_driver,
+			nic_arrival, NULL, &nic_pending.notification );
+		if ( ! NT_SUCCESS ( status ) ) {
+			DbgPrint ( "Could not register for NIC arrivals: "
+				   "%x\n", status );
+			nic_pending.notification = NULL;
+			goto err_ioregisterplugplaynotification;
+		}
+		/* Let any deadline DPC from an earlier registration
+		 * tag its work item before starting a new generation.
+		 */
+		KeFlushQueuedDpcs();
+		nic_pending.generation++;
+		due.QuadPart = ( -10000LL * nic_arrival_timeout );
+		KeSetTimer ( &nic_pending.timer, due, &nic_pending.dpc );
+		registered = TRUE;
+	}
+
+	/* Record request */
+	InsertTailList ( &nic_pending.requests, &pending->list );
+	KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+	BootPrint ( "Waiting up to %ldms for %02x:%02x:%02x:%02x:%02x:%02x\n",
+		    nic_arrival_timeout, mac[0], mac[1], mac[2], mac[3],
+		    mac[4], mac[5] );
+
+	/* Catch any NIC that arrived after the inventory was built
+	 * but before we started listening for arrivals.
+	 */
+	if ( registered )
+		rescan_nic_inventory();
+
+	return STATUS_PENDING;
+
+ err_ioregisterplugplaynotification:
+ err_ioallocateworkitem:
+	KeSetEvent ( &nic_lock, IO_NO_INCREMENT, FALSE );
+	ExFreePool ( pending );
+	return status;
+}
+
+/**
+ * Try processing NIC
+ *
+ * @v mac		MAC address
+ * @v pci_bus_dev_func	Expected PCI bus:dev.fn, or NIC_PCI_NONE
+ * @v process		Processing function
+ * @v opaque		Argument to processing function
+ * @v opaque_len	Length of argument to processing function
+ * @ret ntstatus	NT status
+ *
+ * If the expected PCI location is known, then only the NIC at that
+ * location will be queried for its MAC address in the first instance.
+ * The MAC address must still match.
+ *
+ * If no matching NIC is present, the request will be deferred until
+ * the NIC arrives (or the arrival timeout expires) and STATUS_PENDING
+ * will be returned.  The deferred request is processed using a copy
+ * of the opaque argument, which therefore need not remain valid and
+ * must not contain pointers into caller-owned memory.
+ */
+NTSTATUS find_nic ( PUCHAR mac, ULONG pci_bus_dev_func,
+		    NTSTATUS ( *process ) ( PDEVICE_OBJECT pdo,
+					    LPWSTR netcfginstanceid,
+					    PVOID opaque ),
+		    PVOID opaque, ULONG opaque_len ) {
+	PNIC_ENTRY nic;
+	ULONGLONG started;
+	ULONG lookup_time;
+	ULONG saved;
+	NTSTATUS status;
+
+	started = history_now();
+	nic = NULL;
+
+	/* Try last known good binding first.  Once the inventory has
+	 * been built, looking up the NIC there is at least as quick.
+	 */
+	if ( ! nic_inventory.built ) {
+		nic = lookup_cached_nic ( mac );
+		if ( nic ) {
+			DbgPrint ( "Using cached binding for "
+				   "%02x:%02x:%02x:%02x:%02x:%02x\n", mac[0],
+				   mac[1], mac[2], mac[3], mac[4], mac[5] );
+			lookup_time = ( ( ULONG ) ( history_now() - started ) );
+			saved = nic_cache_saved ( lookup_time );
+			status = process_nic ( nic, process, opaque );
+			free_nic ( nic );
+			InterlockedIncrement ( ( PLONG )
+					       &boot_history.nic_cache_hits );
+			InterlockedExchangeAdd ( ( PLONG )
+						 &boot_history.nic_cache_saved,
+						 ( ( LONG ) saved ) );
+			InterlockedIncrement ( ( PLONG )
+					       &boot_history.nics_found );
+			if ( ! NT_SUCCESS ( status ) ) {
+				InterlockedOr ( ( PLONG )
+						&boot_history.failures,
+						HISTORY_FAIL_NIC_CONFIG );
+			}
+			InterlockedExchangeAdd ( ( PLONG )
+						 &boot_history.nic_time,
+						 ( ( LONG ) ( history_now() -
+							      started ) ) );
+			return status;
+		}
+		InterlockedIncrement ( ( PLONG )
+				       &boot_history.nic_cache_misses );
+	}
+
+	/* Build inventory, if not already done */
+	if ( ! nic_inventory.built ) {
+		status = build_nic_inventory();
+		if ( ! NT_SUCCESS ( status ) )
+			goto err_build_nic_inventory;
+	}
+
+	/* Look for a matching NIC, querying the NIC at the expected
+	 * PCI location first and all other NICs only if necessary.
+	 */
+	nic = lookup_nic ( mac );
+	if ( ( ! nic ) && ( pci_bus_dev_func != NIC_PCI_NONE ) ) {
+		resolve_nics ( pci_bus_dev_func );
+		nic = lookup_nic ( mac );
+	}
+	if ( ! nic ) {
+		resolve_nics ( NIC_PCI_NONE );
+		nic = lookup_nic ( mac );
+	}
+	if ( ! nic ) {
+		status = pend_nic ( mac, process, opaque, opaque_len );
+		if ( status == STATUS_PENDING )
+			goto pending;
+		status = STATUS_NO_SUCH_FILE;
+		BootPrint ( "ERROR: %02x:%02x:%02x:%02x:%02x:%02x not found\n",
+			    mac[0], mac[1], mac[2], mac[3], mac[4], mac[5] );
+		goto err_lookup_nic;
+	}
+
+	/* Process NIC */
+	lookup_time = ( ( ULONG ) ( history_now() - started ) );
+	status = process_nic ( nic, process, opaque );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_process;
+
+	/* Record binding for next boot */
+	store_cached_nic ( nic, lookup_time );
+
+ err_process:
+ err_lookup_nic:
+ err_build_nic_inventory:
+	/* Record boot history.  NIC counts and failures may also be
+	 * updated concurrently by arrival work items.
+	 */
+	if ( nic ) {
+		InterlockedIncrement ( ( PLONG ) &boot_history.nics_found );
+		if ( ! NT_SUCCESS ( status ) ) {
+			InterlockedOr ( ( PLONG ) &boot_history.failures,
+					HISTORY_FAIL_NIC_CONFIG );
+		}
+	} else {
+		InterlockedIncrement ( ( PLONG ) &boot_history.nics_missing );
+		InterlockedOr ( ( PLONG ) &boot_history.failures,
+				HISTORY_FAIL_NIC );
+	}
+ pending:
+	/* A pending NIC is counted as found or missing when it
+	 * arrives or when the arrival timeout expires.
+	 */
+	InterlockedExchangeAdd ( ( PLONG ) &boot_history.nic_time,
+				 ( ( LONG ) ( history_now() - started ) ) );
+
+	return status;
+}
+
+/**
+ * Initialise NIC handling
+ *
+ * @v driver		Driver object
+ */
+VOID nic_init ( PDRIVER_OBJECT driver ) {
+
+	nic_driver = driver;
+	KeInitializeEvent ( &nic_lock, SynchronizationEvent, TRUE );
+	KeInitializeTimer ( &nic_pending.timer );
+	KeInitializeDpc ( &nic_pending.dpc, pending_nics_deadline, NULL );
 }
@@ -19,10 +19,130 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-extern NTSTATUS find_nic ( PUCHAR mac,
+/** No PCI location */
+#define NIC_PCI_NONE 0xffffffffUL
+
+/** Default time to wait for a missing NIC to arrive, in milliseconds */
+#define NIC_ARRIVAL_TIMEOUT 60000
+
+/** Maximum configurable MTU */
+#define NIC_MTU_MAX 65535
+
+/** NIC capability snapshot format version */
+#define NIC_CAPS_VERSION 2
+
+/** Maximum number of NIC capability snapshots */
+#define NIC_MAX_CAPS 4
+
+/** NIC capability snapshot registry value name */
+#define NIC_CAPS_VALUE_NAME L"NicCapabilities"
+
+/** A NIC capability snapshot */
+#pragma pack(1)
+typedef struct _NIC_CAPS {
+	/** MAC address */
+	UCHAR mac[6];
+	/** Reserved */
+	USHORT reserved;
+	/** Capabilities successfully queried
+	 *
+	 * This is a bitmask of NIC_CAPS_XXX values.
+	 */
+	ULONG valid;
+	/** Link speed, in units of 100bps */
+	ULONG link_speed;
+	/** Media connect status (NDIS_MEDIA_STATE) */
+	ULONG media_connect;
+	/** Maximum frame size, excluding link-layer header
+	 *
+	 * This is the frame size in use when the snapshot was taken,
+	 * which precedes any *JumboPacket change made for the
+	 * configured MTU.  Such a change is reflected only once the
+	 * adapter has been restarted, typically on the next boot.
+	 */
+	ULONG max_frame_size;
+	/** Current packet filter */
+	ULONG packet_filter;
+	/** Current task offloads
+	 *
+	 * This is a bitmask of NIC_CAPS_OFFLOAD_XXX values.
+	 */
+	ULONG offload;
+	/** Maximum IPv4 large send offload size */
+	ULONG lso_max_size;
+	/** Receive side scaling capability flags */
+	ULONG rss_flags;
+	/** Number of receive side scaling queues */
+	ULONG rss_queues;
+	/** Configured MTU, or zero if not configured */
+	ULONG mtu;
+} NIC_CAPS, *PNIC_CAPS;
+#pragma pack()
+
+/** Link speed is valid */
+#define NIC_CAPS_LINK_SPEED 0x01
+
+/** Media connect status is valid */
+#define NIC_CAPS_MEDIA_CONNECT 0x02
+
+/** Maximum frame size is valid */
+#define NIC_CAPS_MAX_FRAME_SIZE 0x04
+
+/** Packet filter is valid */
+#define NIC_CAPS_PACKET_FILTER 0x08
+
+/** Task offloads are valid */
+#define NIC_CAPS_OFFLOAD 0x10
+
+/** Receive side scaling capabilities are valid */
+#define NIC_CAPS_RSS 0x20
+
+/** IPv4 TCP transmit checksum offload is enabled */
+#define NIC_CAPS_OFFLOAD_IPV4_TX_CSUM 0x01
+
+/** IPv4 TCP receive checksum offload is enabled */
+#define NIC_CAPS_OFFLOAD_IPV4_RX_CSUM 0x02
+
+/** IPv6 TCP transmit checksum offload is enabled */
+#define NIC_CAPS_OFFLOAD_IPV6_TX_CSUM 0x04
+
+/** IPv6 TCP receive checksum offload is enabled */
+#define NIC_CAPS_OFFLOAD_IPV6_RX_CSUM 0x08
+
+/** IPv4 large send offload is enabled */
+#define NIC_CAPS_OFFLOAD_IPV4_LSO 0x10
+
+/** IPv6 large send offload is enabled */
+#define NIC_CAPS_OFFLOAD_IPV6_LSO 0x20
+
+/** NIC capability snapshot table */
+#pragma pack(1)
+typedef struct _NIC_CAPS_TABLE {
+	/** Format version */
+	ULONG version;
+	/** Length of each snapshot */
+	USHORT caps_len;
+	/** Maximum number of snapshots */
+	USHORT max_caps;
+	/** Number of snapshots */
+	ULONG count;
+	/** Snapshots */
+	NIC_CAPS caps[NIC_MAX_CAPS];
+} NIC_CAPS_TABLE, *PNIC_CAPS_TABLE;
+#pragma pack()
+
+extern ULONG nic_arrival_timeout;
+extern ULONG nic_mtu;
+
+extern NTSTATUS find_nic ( PUCHAR mac, ULONG pci_bus_dev_func,
 			   NTSTATUS ( *process ) ( PDEVICE_OBJECT pdo,
 						   LPWSTR netcfginstanceid,
 						   PVOID opaque ),
-			   PVOID opaque );
+			   PVOID opaque, ULONG opaque_len );
+extern VOID free_nic_inventory ( VOID );
+extern VOID nic_init ( PDRIVER_OBJECT driver );
+extern NTSTATUS fetch_nic_caps ( PVOID buf, ULONG len, PULONG copied );
+extern ULONG fetch_nic_mtu ( PUCHAR mac );
+extern NTSTATUS store_nic_jumbo_packet ( PDEVICE_OBJECT pdo, ULONG mtu );
 
 #endif /* _NIC_H */
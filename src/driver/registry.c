@@ -16,80 +16,993 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+/** @file
+ *
+ * Registry access
+ *
+ * Defining REG_HOST allows this file to be built as part of the
+ * user-mode registry harness in src/regsim, where it runs against an
+ * in-memory registry backend.
+ */
+
+#ifdef REG_HOST
+#include "reghost.h"
+#else
 #include <ntddk.h>
 #define NTSTRSAFE_LIB
 #include <ntstrsafe.h>
+#endif
 #include "sanbootconf.h"
 #include "registry.h"
 
+/** Maximum length of a registry key name composed on the stack
+ *
+ * This is ample for all key names used by this driver; longer names
+ * fall back to a pool-allocated buffer.
+ */
+#define REG_STACK_KEY_NAME_LEN 256
+
+/** Length of registry value data that can be fetched on the stack */
+#define REG_STACK_DATA_LEN 256
+
+/** Stack buffer for registry value queries */
+typedef union _REG_KVI_BUF {
+	/** Key value information */
+	KEY_VALUE_PARTIAL_INFORMATION kvi;
+	/** Raw buffer */
+	UCHAR bytes[ FIELD_OFFSET ( KEY_VALUE_PARTIAL_INFORMATION, Data ) +
+		     REG_STACK_DATA_LEN ];
+} REG_KVI_BUF, *PREG_KVI_BUF;
+
+/** Maximum number of registry keys tracked for call site attribution */
+#define REG_MAX_TRACKED 16
+
+/** Placeholder for a tracked key slot that is being claimed */
+#define REG_TRACKED_BUSY ( ( HANDLE ) ( LONG_PTR ) -1 )
+
+/** A registry key tracked for call site attribution */
+typedef struct _REG_TRACKED_KEY {
+	/** Registry key, or NULL if slot is free */
+	HANDLE reg_key;
+	/** Registry call site */
+	ULONG site;
+	/** Counter of writes made via this key, or NULL */
+	PULONG writes;
+} REG_TRACKED_KEY, *PREG_TRACKED_KEY;
+
+/** Registry call site names, for debug messages */
+static const char *reg_site_names[REG_MAX_SITES] = {
+	"other",
+	"load_start_options",
+	"load_parameters",
+	"fetch_netcfginstanceid",
+	"store_tcpip_parameters",
+	"nic_cache",
+	"store_nic_caps",
+	"history_save",
+	"bootcfg_store",
+	"reg_stats_save",
+	"store_mpio_parameters",
+	"nic_mtu",
+	"store_iscsiprt_parameters",
+};
+
+/** Registry statistics */
+static REG_STATS reg_stats = {
+	REG_STATS_VERSION, sizeof ( REG_SITE_STATS ), REG_MAX_SITES,
+};
+
+/** Registry keys tracked for call site attribution */
+static REG_TRACKED_KEY reg_tracked[REG_MAX_TRACKED];
+
+/** Number of registry writes performed */
+ULONG reg_writes_performed;
+
+/** Number of registry writes skipped as identical to existing value */
+ULONG reg_writes_skipped;
+
+/** Driver Parameters key name */
+static UNICODE_STRING parameters_key_name;
+
+/** TCP/IP interfaces key name */
+static UNICODE_STRING tcpip_interfaces_key_name =
+	RTL_CONSTANT_STRING ( L"\\Registry\\Machine\\SYSTEM\\"
+			      L"CurrentControlSet\\Services\\Tcpip\\"
+			      L"Parameters\\Interfaces" );
+
+/** Cached TCP/IP interfaces key, if opened */
+static HANDLE tcpip_interfaces_key;
+
+#ifndef TRANSACTION_ALL_ACCESS
+#define TRANSACTION_ALL_ACCESS GENERIC_ALL
+#endif
+
+/** ZwCreateTransaction() */
+typedef NTSTATUS ( NTAPI * REG_CREATE_TRANSACTION ) ( PHANDLE transaction,
+						     ACCESS_MASK access,
+						     POBJECT_ATTRIBUTES attrs,
+						     LPGUID uow, HANDLE tm,
+						     ULONG create_options,
+						     ULONG isolation_level,
+						     ULONG isolation_flags,
+						     PLARGE_INTEGER timeout,
+						     PUNICODE_STRING desc );
+
+/** ZwCommitTransaction() and ZwRollbackTransaction() */
+typedef NTSTATUS ( NTAPI * REG_END_TRANSACTION ) ( HANDLE transaction,
+						  BOOLEAN wait );
+
+/** ZwOpenKeyTransacted() */
+typedef NTSTATUS ( NTAPI * REG_OPEN_KEY_TRANSACTED ) ( PHANDLE reg_key,
+						      ACCESS_MASK access,
+						      POBJECT_ATTRIBUTES attrs,
+						      HANDLE transaction );
+
+/** Kernel transaction routines
+ *
+ * These exist only on Vista and above, and so are resolved at
+ * runtime.
+ */
+static struct {
+	/** Routines have been looked up */
+	BOOLEAN resolved;
+	/** ZwCreateTransaction(), if available */
+	REG_CREATE_TRANSACTION create_transaction;
+	/** ZwCommitTransaction(), if available */
+	REG_END_TRANSACTION commit_transaction;
+	/** ZwRollbackTransaction(), if available */
+	REG_END_TRANSACTION rollback_transaction;
+	/** ZwOpenKeyTransacted(), if available */
+	REG_OPEN_KEY_TRANSACTED open_key_transacted;
+} reg_tm;
+
+/**
+ * Record driver Parameters key name
+ *
+ * @v driver_key	Driver-specific registry path
+ * @ret ntstatus	NT status
+ *
+ * The driver-specific registry path is valid only during
+ * DriverEntry(), so we take a copy for later use.
+ */
+NTSTATUS reg_init_parameters ( PUNICODE_STRING driver_key ) {
+	static const WCHAR suffix[] = L"\\Parameters";
+	PWCHAR buf;
+	USHORT len;
+
+	len = ( ( USHORT ) ( driver_key->Length + sizeof ( suffix ) ) );
+	buf = ExAllocatePoolWithTag ( NonPagedPool, len,
+				      SANBOOTCONF_REG_POOL_TAG );
+	if ( ! buf ) {
+		DbgPrint ( "Could not allocate Parameters key name\n" );
+		return STATUS_NO_MEMORY;
+	}
+	RtlZeroMemory ( buf, len );
+	RtlInitEmptyUnicodeString ( &parameters_key_name, buf, len );
+	RtlCopyUnicodeString ( &parameters_key_name, driver_key );
+	RtlUnicodeStringCatString ( &parameters_key_name, suffix );
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Track registry key for call site attribution
+ *
+ * @v reg_key		Registry key
+ * @v site		Registry call site
+ *
+ * Operations on an untracked key are attributed to REG_SITE_OTHER.
+ * This may be used for keys opened other than via reg_open(), such as
+ * by IoOpenDeviceRegistryKey(), in which case reg_untrack_key() must
+ * be called before the key is closed.
+ */
+VOID reg_track_key ( HANDLE reg_key, ULONG site ) {
+	PREG_TRACKED_KEY tracked;
+	ULONG i;
+
+	for ( i = 0 ; i < REG_MAX_TRACKED ; i++ ) {
+		tracked = &reg_tracked[i];
+		if ( InterlockedCompareExchangePointer ( &tracked->reg_key,
+							 REG_TRACKED_BUSY,
+							 NULL ) == NULL ) {
+			/* Publish key only once its site is valid */
+			tracked->site = site;
+			tracked->writes = NULL;
+			InterlockedExchangePointer ( &tracked->reg_key,
+						     reg_key );
+			return;
+		}
+	}
+	DbgPrint ( "Too many registry keys to track\n" );
+}
+
+/**
+ * Stop tracking registry key
+ *
+ * @v reg_key		Registry key
+ */
+VOID reg_untrack_key ( HANDLE reg_key ) {
+	PREG_TRACKED_KEY tracked;
+	ULONG i;
+
+	for ( i = 0 ; i < REG_MAX_TRACKED ; i++ ) {
+		tracked = &reg_tracked[i];
+		if ( tracked->reg_key == reg_key ) {
+			tracked->site = REG_SITE_OTHER;
+			tracked->writes = NULL;
+			InterlockedCompareExchangePointer ( &tracked->reg_key,
+							    NULL, reg_key );
+			return;
+		}
+	}
+}
+
+/**
+ * Find tracked registry key
+ *
+ * @v reg_key		Registry key
+ * @ret tracked		Tracked registry key, or NULL
+ */
+static PREG_TRACKED_KEY reg_find_tracked ( HANDLE reg_key ) {
+	PREG_TRACKED_KEY tracked;
+	ULONG i;
+
+	for ( i = 0 ; i < REG_MAX_TRACKED ; i++ ) {
+		tracked = &reg_tracked[i];
+		if ( tracked->reg_key == reg_key )
+			return tracked;
+	}
+	return NULL;
+}
+
+/**
+ * Get call site for registry key
+ *
+ * @v reg_key		Registry key
+ * @ret site		Registry call site
+ */
+static ULONG reg_key_site ( HANDLE reg_key ) {
+	PREG_TRACKED_KEY tracked;
+
+	tracked = reg_find_tracked ( reg_key );
+	return ( tracked ? tracked->site : REG_SITE_OTHER );
+}
+
+/**
+ * Count writes made via registry key
+ *
+ * @v reg_key		Registry key
+ * @v writes		Write counter
+ * @ret ntstatus	NT status
+ *
+ * The key must have been opened via reg_open() or tracked via
+ * reg_track_key().  Counting stops when the key is closed.
+ */
+static NTSTATUS reg_count_writes ( HANDLE reg_key, PULONG writes ) {
+	PREG_TRACKED_KEY tracked;
+
+	tracked = reg_find_tracked ( reg_key );
+	if ( ! tracked )
+		return STATUS_NOT_FOUND;
+	*writes = 0;
+	tracked->writes = writes;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Record write made via registry key
+ *
+ * @v reg_key		Registry key
+ */
+static VOID reg_key_written ( HANDLE reg_key ) {
+	PREG_TRACKED_KEY tracked;
+	PULONG writes;
+
+	tracked = reg_find_tracked ( reg_key );
+	if ( tracked ) {
+		writes = tracked->writes;
+		if ( writes )
+			InterlockedIncrement ( ( PLONG ) writes );
+	}
+}
+
+/**
+ * Get current time for registry statistics
+ *
+ * @ret now		Current time, in performance counter ticks
+ */
+static LONGLONG reg_stats_now ( VOID ) {
+	return KeQueryPerformanceCounter ( NULL ).QuadPart;
+}
+
+/**
+ * Account for registry operation
+ *
+ * @v stats		Call site statistics
+ * @v count		Operation counter within call site statistics
+ * @v status		Operation status
+ * @v start		Time at which operation started
+ * @ret elapsed		Time taken by operation, in microseconds
+ */
+static ULONG reg_account ( PREG_SITE_STATS stats, PULONG count,
+			   NTSTATUS status, LONGLONG start ) {
+	LARGE_INTEGER frequency;
+	LONGLONG ticks;
+	ULONG elapsed;
+
+	ticks = ( KeQueryPerformanceCounter ( &frequency ).QuadPart - start );
+	elapsed = ( ( ULONG ) ( ( ticks * 1000000 ) / frequency.QuadPart ) );
+	InterlockedIncrement ( ( PLONG ) count );
+	if ( ! NT_SUCCESS ( status ) )
+		InterlockedIncrement ( ( PLONG ) &stats->failures );
+	InterlockedExchangeAdd ( ( PLONG ) &stats->time, elapsed );
+	return elapsed;
+}
+
+/**
+ * Open registry key via native registry routines
+ *
+ * @v reg_key		Registry key to fill in
+ * @v parent		Parent key, or NULL for an absolute name
+ * @v key_name		Registry key name
+ * @v transaction	Kernel transaction, or NULL
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS reg_zw_open_key ( PHANDLE reg_key, HANDLE parent,
+				  PUNICODE_STRING key_name,
+				  HANDLE transaction ) {
+	OBJECT_ATTRIBUTES object_attrs;
+
+	InitializeObjectAttributes ( &object_attrs, key_name,
+				     OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+				     parent, NULL );
+	if ( transaction ) {
+		return reg_tm.open_key_transacted ( reg_key, KEY_ALL_ACCESS,
+						    &object_attrs,
+						    transaction );
+	} else {
+		return ZwOpenKey ( reg_key, KEY_ALL_ACCESS, &object_attrs );
+	}
+}
+
+/**
+ * Close registry key via native registry routines
+ *
+ * @v reg_key		Registry key
+ */
+static VOID reg_zw_close_key ( HANDLE reg_key ) {
+	ZwClose ( reg_key );
+}
+
+/**
+ * Query registry value via native registry routines
+ *
+ * @v reg_key		Registry key
+ * @v value_name	Registry value name
+ * @v kvi		Key value information block to fill in
+ * @v len		Length of key value information block
+ * @v result_len	Required length to fill in
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS reg_zw_query_value ( HANDLE reg_key,
+				     PUNICODE_STRING value_name,
+				     PKEY_VALUE_PARTIAL_INFORMATION kvi,
+				     ULONG len, PULONG result_len ) {
+	return ZwQueryValueKey ( reg_key, value_name,
+				 KeyValuePartialInformation, kvi, len,
+				 result_len );
+}
+
+/**
+ * Set registry value via native registry routines
+ *
+ * @v reg_key		Registry key
+ * @v value_name	Registry value name
+ * @v type		Registry value type
+ * @v data		Value data
+ * @v len		Length of value data
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS reg_zw_set_value ( HANDLE reg_key, PUNICODE_STRING value_name,
+				   ULONG type, PVOID data, ULONG len ) {
+	return ZwSetValueKey ( reg_key, value_name, 0, type, data, len );
+}
+
+/**
+ * Flush registry key via native registry routines
+ *
+ * @v reg_key		Registry key
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS reg_zw_flush_key ( HANDLE reg_key ) {
+	return ZwFlushKey ( reg_key );
+}
+
+/**
+ * Enumerate registry subkey via native registry routines
+ *
+ * @v reg_key		Registry key
+ * @v index		Subkey index
+ * @v kbi		Key basic information block to fill in
+ * @v len		Length of key basic information block
+ * @v result_len	Required length to fill in
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS reg_zw_enum_key ( HANDLE reg_key, ULONG index,
+				  PKEY_BASIC_INFORMATION kbi, ULONG len,
+				  PULONG result_len ) {
+	return ZwEnumerateKey ( reg_key, index, KeyBasicInformation, kbi,
+				len, result_len );
+}
+
+/**
+ * Query registry values via native registry routines
+ *
+ * @v key_name		Absolute registry key name
+ * @v table		Query table
+ * @v context		Context passed to query routines
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS reg_zw_query_table ( PWSTR key_name,
+				     PRTL_QUERY_REGISTRY_TABLE table,
+				     PVOID context ) {
+	return RtlQueryRegistryValues ( RTL_REGISTRY_ABSOLUTE, key_name,
+					table, context, NULL );
+}
+
+/** Native registry backend */
+static REG_BACKEND reg_zw_backend = {
+	"native",
+	reg_zw_open_key,
+	reg_zw_close_key,
+	reg_zw_query_value,
+	reg_zw_set_value,
+	reg_zw_flush_key,
+	reg_zw_enum_key,
+	reg_zw_query_table,
+};
+
+/** Active registry backend */
+static PREG_BACKEND reg_backend = &reg_zw_backend;
+
+/**
+ * Select registry backend
+ *
+ * @v backend		Registry backend, or NULL to use native registry
+ *
+ * This must be called before any registry key is opened, or after
+ * all registry keys have been closed.
+ */
+VOID reg_set_backend ( PREG_BACKEND backend ) {
+	HANDLE reg_key;
+
+	if ( ! backend )
+		backend = &reg_zw_backend;
+	if ( backend == reg_backend )
+		return;
+
+	/* Discard cached keys opened via the old backend */
+	reg_key = InterlockedExchangePointer ( &tcpip_interfaces_key, NULL );
+	if ( reg_key )
+		reg_close ( reg_key );
+
+	DbgPrint ( "Using %s registry backend\n", backend->name );
+	reg_backend = backend;
+}
+
+/**
+ * Open registry key by name
+ *
+ * @v reg_key		Registry key to fill in
+ * @v parent		Parent key, or NULL for an absolute name
+ * @v key_name		Registry key name
+ * @v transaction	Kernel transaction, or NULL
+ * @v site		Registry call site
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS reg_open_name ( PHANDLE reg_key, HANDLE parent,
+				PUNICODE_STRING key_name,
+				HANDLE transaction, ULONG site ) {
+	PREG_SITE_STATS stats = &reg_stats.sites[site];
+	LONGLONG start;
+	NTSTATUS status;
+
+	start = reg_stats_now();
+	status = reg_backend->open_key ( reg_key, parent, key_name,
+					 transaction );
+	reg_account ( stats, &stats->opens, status, start );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not open %wZ: %x\n", key_name, status );
+		return status;
+	}
+	reg_track_key ( *reg_key, site );
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Open driver Parameters key
+ *
+ * @v reg_key		Registry key to fill in
+ * @v site		Registry call site
+ * @ret ntstatus	NT status
+ */
+NTSTATUS reg_open_parameters ( PHANDLE reg_key, ULONG site ) {
+
+	if ( ! parameters_key_name.Buffer )
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	return reg_open_name ( reg_key, NULL, &parameters_key_name, NULL,
+			       site );
+}
+
+/**
+ * Query driver parameters
+ *
+ * @v table		Query table
+ * @v context		Context passed to query routines
+ * @v site		Registry call site
+ * @ret ntstatus	NT status
+ *
+ * All values in the query table are retrieved in a single pass, which
+ * is accounted as a single query.
+ */
+NTSTATUS reg_query_parameters ( PRTL_QUERY_REGISTRY_TABLE table,
+				PVOID context, ULONG site ) {
+	PREG_SITE_STATS stats = &reg_stats.sites[site];
+	LONGLONG start;
+	NTSTATUS status;
+
+	if ( ! parameters_key_name.Buffer )
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	start = reg_stats_now();
+	status = reg_backend->query_table ( parameters_key_name.Buffer, table,
+					    context );
+	reg_account ( stats, &stats->queries, status, start );
+	return status;
+}
+
+/**
+ * Compose registry key name
+ *
+ * @v key_name		Registry key name to fill in
+ * @v args		Registry key name components, terminated with a NULL
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS reg_compose ( PUNICODE_STRING key_name, va_list args ) {
+	LPCWSTR key_name_part;
+	NTSTATUS status;
+
+	key_name->Length = 0;
+	while ( ( key_name_part = va_arg ( args, LPCWSTR ) ) != NULL ) {
+		if ( key_name->Length ) {
+			status = RtlUnicodeStringCatString ( key_name, L"\\" );
+			if ( ! NT_SUCCESS ( status ) )
+				return status;
+		}
+		status = RtlUnicodeStringCatString ( key_name, key_name_part );
+		if ( ! NT_SUCCESS ( status ) )
+			return status;
+	}
+
+	return STATUS_SUCCESS;
+}
+
 /**
  * Open registry key
  *
  * @v reg_key		Registry key to fill in
+ * @v site		Registry call site
  * @v ...		Registry key name components, terminated with a NULL
  * @ret ntstatus	NT status
+ *
+ * The key name is composed in a stack buffer.  A pool buffer is used
+ * only for unusually long key names.
  */
-NTSTATUS reg_open ( PHANDLE reg_key, ... ) {
-	UNICODE_STRING unicode_string;
-	OBJECT_ATTRIBUTES object_attrs;
+NTSTATUS reg_open ( PHANDLE reg_key, ULONG site, ... ) {
+	WCHAR buf[REG_STACK_KEY_NAME_LEN];
+	UNICODE_STRING key_name;
 	va_list args;
 	LPCWSTR key_name_part;
-	LPWSTR key_name;
+	PWCHAR pool_buf = NULL;
 	SIZE_T key_name_len;
 	NTSTATUS status;
 
-	/* Calculate total buffer length */
-	key_name_len = 0;
-	va_start ( args, reg_key );
-	while ( ( key_name_part = va_arg ( args, LPCWSTR ) ) != NULL ) {
-		key_name_len += ( ( wcslen ( key_name_part ) + 1 ) *
-				  sizeof ( key_name_part[0] ) );
-	}
+	/* Compose key name on the stack, if possible */
+	RtlInitEmptyUnicodeString ( &key_name, buf, sizeof ( buf ) );
+	va_start ( args, site );
+	status = reg_compose ( &key_name, args );
 	va_end ( args );
 
-	/* Allocate buffer */
-	key_name = ExAllocatePoolWithTag ( NonPagedPool, key_name_len,
-					   SANBOOTCONF_POOL_TAG );
-	if ( ! key_name ) {
-		DbgPrint ( "Could not allocate key name buffer\n" );
-		status = STATUS_UNSUCCESSFUL;
-		goto err_exallocatepoolwithtag;
+	/* Fall back to a pool buffer for long key names */
+	if ( status == STATUS_BUFFER_OVERFLOW ) {
+		key_name_len = 0;
+		va_start ( args, site );
+		while ( ( key_name_part = va_arg ( args, LPCWSTR ) ) != NULL ) {
+			key_name_len += ( ( wcslen ( key_name_part ) + 1 ) *
+					  sizeof ( key_name_part[0] ) );
+		}
+		va_end ( args );
+		if ( key_name_len > UNICODE_STRING_MAX_BYTES ) {
+			status = STATUS_NAME_TOO_LONG;
+			goto err_too_long;
+		}
+		pool_buf = ExAllocatePoolWithTag ( NonPagedPool, key_name_len,
+						   SANBOOTCONF_REG_POOL_TAG );
+		if ( ! pool_buf ) {
+			DbgPrint ( "Could not allocate key name buffer\n" );
+			status = STATUS_UNSUCCESSFUL;
+			goto err_exallocatepoolwithtag;
+		}
+		RtlInitEmptyUnicodeString ( &key_name, pool_buf,
+					    ( ( USHORT ) key_name_len ) );
+		va_start ( args, site );
+		status = reg_compose ( &key_name, args );
+		va_end ( args );
 	}
-
-	/* Create key name */
-	va_start ( args, reg_key );
-	key_name[0] = 0;
-	while ( ( key_name_part = va_arg ( args, LPCWSTR ) ) != NULL ) {
-		if ( key_name[0] )
-			RtlStringCbCatW ( key_name, key_name_len, L"\\" );
-		RtlStringCbCatW ( key_name, key_name_len, key_name_part );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not compose key name: %x\n", status );
+		goto err_compose;
 	}
-	va_end ( args );
 
 	/* Open key */
-	RtlInitUnicodeString ( &unicode_string, key_name );
-	InitializeObjectAttributes ( &object_attrs, &unicode_string,
-				     OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
-				     NULL, NULL );
-	status = ZwOpenKey ( reg_key, KEY_ALL_ACCESS, &object_attrs );
-	if ( ! NT_SUCCESS ( status ) ) {
-		DbgPrint ( "Could not open %S: %x\n", key_name, status );
-		goto err_zwopenkey;
-	}
+	status = reg_open_name ( reg_key, NULL, &key_name, NULL, site );
 
- err_zwopenkey:
-	ExFreePool ( key_name );
+ err_compose:
+	if ( pool_buf )
+		ExFreePool ( pool_buf );
  err_exallocatepoolwithtag:
+ err_too_long:
+	return status;
+}
+
+/**
+ * Open registry subkey
+ *
+ * @v reg_key		Registry key to fill in
+ * @v parent		Parent registry key
+ * @v name		Subkey name
+ * @ret ntstatus	NT status
+ *
+ * The subkey is attributed to the same call site as its parent.
+ */
+NTSTATUS reg_open_relative ( PHANDLE reg_key, HANDLE parent, LPCWSTR name ) {
+	UNICODE_STRING key_name;
+
+	RtlInitUnicodeString ( &key_name, name );
+	return reg_open_name ( reg_key, parent, &key_name, NULL,
+			       reg_key_site ( parent ) );
+}
+
+/**
+ * Open and retain TCP/IP interfaces key
+ *
+ * @v site		Registry call site
+ * @ret ntstatus	NT status
+ *
+ * The TCP/IP interfaces key is opened once and retained, so that each
+ * interface key may be opened relative to it.
+ */
+static NTSTATUS reg_open_tcpip_interfaces ( ULONG site ) {
+	HANDLE parent;
+	NTSTATUS status;
+
+	if ( tcpip_interfaces_key )
+		return STATUS_SUCCESS;
+	status = reg_open_name ( &parent, NULL, &tcpip_interfaces_key_name,
+				 NULL, site );
+	if ( ! NT_SUCCESS ( status ) )
+		return status;
+	if ( InterlockedCompareExchangePointer ( &tcpip_interfaces_key,
+						 parent, NULL ) ) {
+		/* Lost a race with another opener */
+		reg_close ( parent );
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Look up kernel transaction routines
+ *
+ * @ret available	Kernel transactions are available
+ */
+static BOOLEAN reg_tm_available ( VOID ) {
+	UNICODE_STRING name;
+
+	if ( ! reg_tm.resolved ) {
+		RtlInitUnicodeString ( &name, L"ZwCreateTransaction" );
+		reg_tm.create_transaction = ( ( REG_CREATE_TRANSACTION )
+			MmGetSystemRoutineAddress ( &name ) );
+		RtlInitUnicodeString ( &name, L"ZwCommitTransaction" );
+		reg_tm.commit_transaction = ( ( REG_END_TRANSACTION )
+			MmGetSystemRoutineAddress ( &name ) );
+		RtlInitUnicodeString ( &name, L"ZwRollbackTransaction" );
+		reg_tm.rollback_transaction = ( ( REG_END_TRANSACTION )
+			MmGetSystemRoutineAddress ( &name ) );
+		RtlInitUnicodeString ( &name, L"ZwOpenKeyTransacted" );
+		reg_tm.open_key_transacted = ( ( REG_OPEN_KEY_TRANSACTED )
+			MmGetSystemRoutineAddress ( &name ) );
+		reg_tm.resolved = TRUE;
+	}
+	return ( reg_tm.create_transaction && reg_tm.commit_transaction &&
+		 reg_tm.rollback_transaction && reg_tm.open_key_transacted );
+}
+
+/**
+ * Begin batch of TCP/IP interface registry writes
+ *
+ * @v batch		Registry write batch
+ * @v netcfginstanceid	Interface name within registry
+ * @v site		Registry call site
+ * @ret ntstatus	NT status
+ *
+ * Values stored via batch->reg_key take effect together when the
+ * batch is committed.  If kernel transactions are unavailable, values
+ * are written directly and only the final flush is batched.
+ */
+NTSTATUS reg_batch_begin_tcpip_interface ( PREG_BATCH batch,
+					   LPCWSTR netcfginstanceid,
+					   ULONG site ) {
+	OBJECT_ATTRIBUTES object_attrs;
+	UNICODE_STRING key_name;
+	NTSTATUS status;
+
+	RtlZeroMemory ( batch, sizeof ( *batch ) );
+	batch->site = site;
+
+	/* Open parent key */
+	status = reg_open_tcpip_interfaces ( site );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_open_tcpip_interfaces;
+
+	/* Create transaction, if possible */
+	if ( reg_tm_available() ) {
+		InitializeObjectAttributes ( &object_attrs, NULL,
+					     OBJ_KERNEL_HANDLE, NULL, NULL );
+		status = reg_tm.create_transaction ( &batch->transaction,
+						     TRANSACTION_ALL_ACCESS,
+						     &object_attrs, NULL, NULL,
+						     0, 0, 0, NULL, NULL );
+		if ( ! NT_SUCCESS ( status ) ) {
+			DbgPrint ( "Could not create transaction: %x\n",
+				   status );
+			/* Treat as non-fatal error */
+			batch->transaction = NULL;
+		}
+	}
+
+	/* Open interface key */
+	RtlInitUnicodeString ( &key_name, netcfginstanceid );
+	status = reg_open_name ( &batch->reg_key, tcpip_interfaces_key,
+				 &key_name, batch->transaction, site );
+	if ( ( ! NT_SUCCESS ( status ) ) && batch->transaction ) {
+		DbgPrint ( "Could not open transacted key: %x\n", status );
+		/* Treat as non-fatal error; write values directly */
+		ZwClose ( batch->transaction );
+		batch->transaction = NULL;
+		status = reg_open_name ( &batch->reg_key,
+					 tcpip_interfaces_key, &key_name,
+					 NULL, site );
+	}
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_open_name;
+
+	/* Count writes made via interface key */
+	if ( ! NT_SUCCESS ( reg_count_writes ( batch->reg_key,
+					       &batch->writes ) ) ) {
+		/* Cannot count; assume that the key will be modified */
+		batch->writes = 1;
+	}
+
+	return STATUS_SUCCESS;
+
+ err_reg_open_name:
+	if ( batch->transaction )
+		ZwClose ( batch->transaction );
+ err_reg_open_tcpip_interfaces:
+	return status;
+}
+
+/**
+ * Commit batch of registry writes
+ *
+ * @v batch		Registry write batch
+ * @ret ntstatus	NT status
+ *
+ * The key is flushed once, and only if any value was changed.  A key
+ * opened within a transaction cannot be used once the transaction has
+ * been committed, so the flush is then issued via the (untransacted)
+ * TCP/IP interfaces key, which lies within the same hive.
+ */
+NTSTATUS reg_batch_commit ( PREG_BATCH batch ) {
+	PREG_SITE_STATS stats = &reg_stats.sites[batch->site];
+	HANDLE flush_key;
+	LONGLONG start;
+	ULONG elapsed;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	/* Commit transaction */
+	if ( batch->transaction ) {
+		start = reg_stats_now();
+		status = reg_tm.commit_transaction ( batch->transaction,
+						     TRUE );
+		elapsed = reg_account ( stats, &stats->flushes, status,
+					start );
+		InterlockedExchangeAdd ( ( PLONG ) &stats->flush_time,
+					 elapsed );
+		if ( ! NT_SUCCESS ( status ) ) {
+			DbgPrint ( "Could not commit transaction: %x\n",
+				   status );
+			goto err_commit;
+		}
+	}
+
+	/* Flush changes */
+	if ( batch->writes ) {
+		flush_key = ( batch->transaction ?
+			      tcpip_interfaces_key : batch->reg_key );
+		start = reg_stats_now();
+		status = reg_backend->flush_key ( flush_key );
+		elapsed = reg_account ( stats, &stats->flushes, status,
+					start );
+		InterlockedExchangeAdd ( ( PLONG ) &stats->flush_time,
+					 elapsed );
+		if ( ! NT_SUCCESS ( status ) ) {
+			DbgPrint ( "Could not flush key: %x\n", status );
+			goto err_flush;
+		}
+	}
+
+ err_flush:
+ err_commit:
+	reg_close ( batch->reg_key );
+	if ( batch->transaction )
+		ZwClose ( batch->transaction );
 	return status;
 }
 
+/**
+ * Abort batch of registry writes
+ *
+ * @v batch		Registry write batch
+ *
+ * If kernel transactions are unavailable, any values already stored
+ * remain in place.
+ */
+VOID reg_batch_abort ( PREG_BATCH batch ) {
+
+	if ( batch->transaction ) {
+		reg_tm.rollback_transaction ( batch->transaction, TRUE );
+		ZwClose ( batch->transaction );
+	}
+	reg_close ( batch->reg_key );
+}
+
 /**
  * Close registry key
  *
  * @v reg_key		Registry key
  */
 VOID reg_close ( HANDLE reg_key ) {
-	ZwClose ( reg_key );
+	reg_untrack_key ( reg_key );
+	reg_backend->close_key ( reg_key );
+}
+
+/**
+ * Enumerate registry subkey
+ *
+ * @v reg_key		Registry key
+ * @v index		Subkey index
+ * @v name		Buffer for subkey name
+ * @v len		Length of buffer
+ * @ret ntstatus	NT status
+ *
+ * STATUS_NO_MORE_ENTRIES is returned once all subkeys have been
+ * enumerated.  Subkeys with names too long for the buffer are
+ * reported as STATUS_BUFFER_OVERFLOW.
+ */
+NTSTATUS reg_enum_subkey ( HANDLE reg_key, ULONG index, LPWSTR name,
+			   SIZE_T len ) {
+	PREG_SITE_STATS stats = &reg_stats.sites[ reg_key_site ( reg_key ) ];
+	union {
+		KEY_BASIC_INFORMATION kbi;
+		UCHAR bytes[ FIELD_OFFSET ( KEY_BASIC_INFORMATION, Name ) +
+			     ( REG_STACK_KEY_NAME_LEN * sizeof ( WCHAR ) ) ];
+	} buf;
+	LONGLONG start;
+	ULONG kbi_len;
+	NTSTATUS status;
+
+	/* Fetch subkey name */
+	start = reg_stats_now();
+	status = reg_backend->enum_key ( reg_key, index, &buf.kbi,
+					 sizeof ( buf ), &kbi_len );
+	reg_account ( stats, &stats->queries, status, start );
+	if ( ! NT_SUCCESS ( status ) )
+		return status;
+
+	/* Copy out subkey name */
+	if ( ( buf.kbi.NameLength + sizeof ( name[0] ) ) > len )
+		return STATUS_BUFFER_OVERFLOW;
+	RtlCopyMemory ( name, buf.kbi.Name, buf.kbi.NameLength );
+	name[ buf.kbi.NameLength / sizeof ( name[0] ) ] = L'\0';
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Free registry key value information
+ *
+ * @v buf		Stack buffer
+ * @v kvi		Key value information block
+ */
+static VOID reg_free_kvi ( PREG_KVI_BUF buf,
+			   PKEY_VALUE_PARTIAL_INFORMATION kvi ) {
+
+	if ( kvi != &buf->kvi )
+		ExFreePool ( kvi );
+}
+
+/**
+ * Query registry key value information
+ *
+ * @v reg_key		Registry key
+ * @v value_name	Registry value name
+ * @v buf		Stack buffer
+ * @v kvi		Key value information block to fill in
+ * @ret ntstatus	NT status
+ *
+ * The value is first queried into the stack buffer, which is large
+ * enough for typical dword and short string values.  A buffer is
+ * allocated only if the value does not fit.  The caller must
+ * eventually call reg_free_kvi().
+ */
+static NTSTATUS reg_query_kvi ( HANDLE reg_key, LPCWSTR value_name,
+				PREG_KVI_BUF buf,
+				PKEY_VALUE_PARTIAL_INFORMATION *kvi ) {
+	PREG_SITE_STATS stats = &reg_stats.sites[ reg_key_site ( reg_key ) ];
+	UNICODE_STRING u_value_name;
+	LONGLONG start;
+	ULONG kvi_len;
+	NTSTATUS status;
+
+	/* Try fetching value into stack buffer */
+	start = reg_stats_now();
+	RtlInitUnicodeString ( &u_value_name, value_name );
+	*kvi = &buf->kvi;
+	kvi_len = sizeof ( *buf );
+	status = reg_backend->query_value ( reg_key, &u_value_name, *kvi,
+					    kvi_len, &kvi_len );
+
+	/* Retry with an allocated buffer if value did not fit.  The
+	 * value may change size between attempts, so keep trying
+	 * until it fits.
+	 */
+	while ( ( status == STATUS_BUFFER_OVERFLOW ) ||
+		( status == STATUS_BUFFER_TOO_SMALL ) ) {
+		reg_free_kvi ( buf, *kvi );
+		*kvi = ExAllocatePoolWithTag ( NonPagedPool, kvi_len,
+					       SANBOOTCONF_REG_POOL_TAG );
+		if ( ! *kvi ) {
+			DbgPrint ( "Could not allocate KVI for \"%S\"\n",
+				   value_name );
+			status = STATUS_NO_MEMORY;
+			reg_account ( stats, &stats->queries, status, start );
+			return status;
+		}
+		status = reg_backend->query_value ( reg_key, &u_value_name,
+						    *kvi, kvi_len,
+						    &kvi_len );
+	}
+	reg_account ( stats, &stats->queries, status, start );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not get KVI for \"%S\": %x\n",
+			   value_name, status );
+		reg_free_kvi ( buf, *kvi );
+		return status;
+	}
+
+	return STATUS_SUCCESS;
 }
 
 /**
@@ -105,49 +1018,35 @@ VOID reg_close ( HANDLE reg_key ) {
  */
 NTSTATUS reg_fetch_kvi ( HANDLE reg_key, LPCWSTR value_name,
 			 PKEY_VALUE_PARTIAL_INFORMATION *kvi ) {
-	UNICODE_STRING u_value_name;
+	REG_KVI_BUF buf;
+	PKEY_VALUE_PARTIAL_INFORMATION tmp;
 	ULONG kvi_len;
 	NTSTATUS status;
 
-	/* Get value length */
-	RtlInitUnicodeString ( &u_value_name, value_name );
-	status = ZwQueryValueKey ( reg_key, &u_value_name,
-				   KeyValuePartialInformation, NULL, 0,
-				   &kvi_len );
-	if ( ! ( ( status == STATUS_SUCCESS ) ||
-		 ( status == STATUS_BUFFER_OVERFLOW ) ||
-		 ( status == STATUS_BUFFER_TOO_SMALL ) ) ) {
-		DbgPrint ( "Could not get KVI length for \"%S\": %x\n",
-			   value_name, status );
-		goto err_zwqueryvaluekey_len;
+	/* Fetch value */
+	status = reg_query_kvi ( reg_key, value_name, &buf, &tmp );
+	if ( ! NT_SUCCESS ( status ) )
+		return status;
+
+	/* Return allocated buffer directly, if one was used */
+	if ( tmp != &buf.kvi ) {
+		*kvi = tmp;
+		return STATUS_SUCCESS;
 	}
 
-	/* Allocate value buffer */
+	/* Otherwise, copy from stack buffer */
+	kvi_len = ( FIELD_OFFSET ( KEY_VALUE_PARTIAL_INFORMATION, Data ) +
+		    tmp->DataLength );
 	*kvi = ExAllocatePoolWithTag ( NonPagedPool, kvi_len,
-				       SANBOOTCONF_POOL_TAG );
+				       SANBOOTCONF_REG_POOL_TAG );
 	if ( ! *kvi ) {
-		DbgPrint ( "Could not allocate KVI for \"%S\": %x\n",
-			   value_name, status );
-		goto err_exallocatepoolwithtag_kvi;
-	}
-
-	/* Fetch value */
-	status = ZwQueryValueKey ( reg_key, &u_value_name,
-				   KeyValuePartialInformation, *kvi,
-				   kvi_len, &kvi_len );
-	if ( ! NT_SUCCESS ( status ) ) {
-		DbgPrint ( "Could not get KVI for \"%S\": %x\n",
-			   value_name, status );
-		goto err_zwqueryvaluekey;
+		DbgPrint ( "Could not allocate KVI for \"%S\"\n",
+			   value_name );
+		return STATUS_NO_MEMORY;
 	}
+	RtlCopyMemory ( *kvi, tmp, kvi_len );
 
 	return STATUS_SUCCESS;
-
- err_zwqueryvaluekey:
-	ExFreePool ( *kvi );
- err_exallocatepoolwithtag_kvi:
- err_zwqueryvaluekey_len:
-	return status;
 }
 
 /**
@@ -161,19 +1060,20 @@ NTSTATUS reg_fetch_kvi ( HANDLE reg_key, LPCWSTR value_name,
  * The caller must eventually free the allocated value.
  */
 NTSTATUS reg_fetch_sz ( HANDLE reg_key, LPCWSTR value_name, LPWSTR *value ) {
+	REG_KVI_BUF buf;
 	PKEY_VALUE_PARTIAL_INFORMATION kvi;
 	ULONG value_len;
 	NTSTATUS status;
 
 	/* Fetch key value information */
-	status = reg_fetch_kvi ( reg_key, value_name, &kvi );
+	status = reg_query_kvi ( reg_key, value_name, &buf, &kvi );
 	if ( ! NT_SUCCESS ( status ) )
-		goto err_reg_fetch_kvi;
+		goto err_reg_query_kvi;
 
 	/* Allocate and populate string */
 	value_len = ( kvi->DataLength + sizeof ( value[0] ) );
 	*value = ExAllocatePoolWithTag ( NonPagedPool, value_len,
-					 SANBOOTCONF_POOL_TAG );
+					 SANBOOTCONF_REG_POOL_TAG );
 	if ( ! *value ) {
 		DbgPrint ( "Could not allocate value for \"%S\"\n",
 			   value_name );
@@ -184,8 +1084,8 @@ NTSTATUS reg_fetch_sz ( HANDLE reg_key, LPCWSTR value_name, LPWSTR *value ) {
 	RtlCopyMemory ( *value, kvi->Data, kvi->DataLength );
 
  err_exallocatepoolwithtag_value:
-	ExFreePool ( kvi );
- err_reg_fetch_kvi:
+	reg_free_kvi ( &buf, kvi );
+ err_reg_query_kvi:
 	return status;
 }
 
@@ -201,20 +1101,23 @@ NTSTATUS reg_fetch_sz ( HANDLE reg_key, LPCWSTR value_name, LPWSTR *value ) {
  */
 NTSTATUS reg_fetch_multi_sz ( HANDLE reg_key, LPCWSTR value_name,
 			      LPWSTR **values ) {
+	REG_KVI_BUF buf;
 	PKEY_VALUE_PARTIAL_INFORMATION kvi;
 	LPWSTR string;
+	LPWSTR end;
 	ULONG num_strings;
 	ULONG values_len;
 	ULONG i;
 	NTSTATUS status;
 
 	/* Fetch key value information */
-	status = reg_fetch_kvi ( reg_key, value_name, &kvi );
+	status = reg_query_kvi ( reg_key, value_name, &buf, &kvi );
 	if ( ! NT_SUCCESS ( status ) )
-		goto err_reg_fetch_kvi;
+		goto err_reg_query_kvi;
 
 	/* Count number of strings in the array.  This is a
-	 * potential(ly harmless) overestimate.
+	 * potential(ly harmless) overestimate; unused entries are left
+	 * as NULL.
 	 */
 	num_strings = 0;
 	for ( string = ( ( LPWSTR ) kvi->Data ) ;
@@ -228,7 +1131,7 @@ NTSTATUS reg_fetch_multi_sz ( HANDLE reg_key, LPCWSTR value_name,
 	values_len = ( ( ( num_strings + 1 ) * sizeof ( values[0] ) ) +
 		       kvi->DataLength + sizeof ( values[0][0] ) );
 	*values = ExAllocatePoolWithTag ( NonPagedPool, values_len,
-					  SANBOOTCONF_POOL_TAG );
+					  SANBOOTCONF_REG_POOL_TAG );
 	if ( ! *values ) {
 		DbgPrint ( "Could not allocate value array for \"%S\"\n",
 			   value_name );
@@ -238,17 +1141,18 @@ NTSTATUS reg_fetch_multi_sz ( HANDLE reg_key, LPCWSTR value_name,
 	RtlZeroMemory ( *values, values_len );
 	string = ( ( LPWSTR ) ( *values + num_strings + 1 ) );
 	RtlCopyMemory ( string, kvi->Data, kvi->DataLength );
-	for ( i = 0 ; i < num_strings ; i++ ) {
+	end = ( string + ( kvi->DataLength / sizeof ( string[0] ) ) );
+	for ( i = 0 ; ( i < num_strings ) && ( string < end ) ; i++ ) {
 		(*values)[i] = string;
 		while ( *string )
 			string++;
-		while ( ! *string )
+		while ( ( string < end ) && ! *string )
 			string++;
 	}
 
  err_exallocatepoolwithtag_value:
-	ExFreePool ( kvi );
- err_reg_fetch_kvi:
+	reg_free_kvi ( &buf, kvi );
+ err_reg_query_kvi:
 	return status;
 }
 
@@ -261,13 +1165,14 @@ NTSTATUS reg_fetch_multi_sz ( HANDLE reg_key, LPCWSTR value_name,
  * @ret ntstatus	NT status
  */
 NTSTATUS reg_fetch_dword ( HANDLE reg_key, LPCWSTR value_name, ULONG *value ) {
+	REG_KVI_BUF buf;
 	PKEY_VALUE_PARTIAL_INFORMATION kvi;
 	NTSTATUS status;
 
 	/* Fetch key value information */
-	status = reg_fetch_kvi ( reg_key, value_name, &kvi );
+	status = reg_query_kvi ( reg_key, value_name, &buf, &kvi );
 	if ( ! NT_SUCCESS ( status ) )
-		goto err_reg_fetch_kvi;
+		goto err_reg_query_kvi;
 
 	/* Sanity check */
 	if ( kvi->DataLength != sizeof ( *value ) ) {
@@ -281,37 +1186,82 @@ NTSTATUS reg_fetch_dword ( HANDLE reg_key, LPCWSTR value_name, ULONG *value ) {
 	RtlCopyMemory ( value, kvi->Data, sizeof ( *value ) );
 
  err_datalength:
-	ExFreePool ( kvi );
- err_reg_fetch_kvi:
+	reg_free_kvi ( &buf, kvi );
+ err_reg_query_kvi:
 	return status;
 }
 
 /**
- * Store registry string value
+ * Store registry value
  *
  * @v reg_key		Registry key
  * @v value_name	Registry value name
- * @v value		String value to store
+ * @v type		Registry value type
+ * @v data		Value data
+ * @v len		Length of value data
  * @ret ntstatus	NT status
+ *
+ * The write is skipped if the existing value is identical, to avoid
+ * dirtying the hive unnecessarily.
  */
-NTSTATUS reg_store_sz ( HANDLE reg_key, LPCWSTR value_name, LPWSTR value ) {
+static NTSTATUS reg_store_value ( HANDLE reg_key, LPCWSTR value_name,
+				  ULONG type, PVOID data, ULONG len ) {
+	PREG_SITE_STATS stats = &reg_stats.sites[ reg_key_site ( reg_key ) ];
+	REG_KVI_BUF buf;
+	PKEY_VALUE_PARTIAL_INFORMATION kvi;
 	UNICODE_STRING u_value_name;
-	SIZE_T value_len;
+	LONGLONG start;
+	BOOLEAN identical;
 	NTSTATUS status;
 
+	/* Skip write if existing value is identical */
+	status = reg_query_kvi ( reg_key, value_name, &buf, &kvi );
+	if ( NT_SUCCESS ( status ) ) {
+		identical = ( ( kvi->Type == type ) &&
+			      ( kvi->DataLength == len ) &&
+			      ( RtlCompareMemory ( kvi->Data, data,
+						   len ) == len ) );
+		reg_free_kvi ( &buf, kvi );
+		if ( identical ) {
+			InterlockedIncrement ( ( PLONG ) &reg_writes_skipped );
+			return STATUS_SUCCESS;
+		}
+	}
+
+	/* Store value */
 	RtlInitUnicodeString ( &u_value_name, value_name );
-	value_len = ( ( wcslen ( value ) + 1 ) * sizeof ( value[0] ) );
-	status = ZwSetValueKey ( reg_key, &u_value_name, 0, REG_SZ,
-				 value, ( ( ULONG ) value_len ) );
+	start = reg_stats_now();
+	status = reg_backend->set_value ( reg_key, &u_value_name, type,
+					  data, len );
+	reg_account ( stats, &stats->sets, status, start );
 	if ( ! NT_SUCCESS ( status ) ) {
 		DbgPrint ( "Could not store value \"%S\": %x\n",
 			   value_name, status );
 		return status;
 	}
+	InterlockedIncrement ( ( PLONG ) &reg_writes_performed );
+	reg_key_written ( reg_key );
+	InterlockedExchangeAdd ( ( PLONG ) &stats->bytes_written, len );
 
 	return STATUS_SUCCESS;
 }
 
+/**
+ * Store registry string value
+ *
+ * @v reg_key		Registry key
+ * @v value_name	Registry value name
+ * @v value		String value to store
+ * @ret ntstatus	NT status
+ */
+NTSTATUS reg_store_sz ( HANDLE reg_key, LPCWSTR value_name, LPWSTR value ) {
+	SIZE_T value_len;
+
+	value_len = ( ( wcslen ( value ) + 1 ) * sizeof ( value[0] ) );
+	return reg_store_value ( reg_key, value_name, REG_SZ, value,
+				 ( ( ULONG ) value_len ) );
+}
+
 /**
  * Store registry multiple-string value
  *
@@ -321,7 +1271,6 @@ NTSTATUS reg_store_sz ( HANDLE reg_key, LPCWSTR value_name, LPWSTR value ) {
  * @ret ntstatus	NT status
  */
 NTSTATUS reg_store_multi_sz ( HANDLE reg_key, LPCWSTR value_name, ... ) {
-	UNICODE_STRING u_value_name;
 	va_list args;
 	LPCWSTR string;
 	SIZE_T values_len;
@@ -342,9 +1291,10 @@ NTSTATUS reg_store_multi_sz ( HANDLE reg_key, LPCWSTR value_name, ... ) {
 
 	/* Allocate buffer */
 	values = ExAllocatePoolWithTag ( NonPagedPool, values_len,
-					 SANBOOTCONF_POOL_TAG );
+					 SANBOOTCONF_REG_POOL_TAG );
 	if ( ! values ) {
-		DbgPrint ( "Could not allocate value buffer for \"%S\"\n" );
+		DbgPrint ( "Could not allocate value buffer for \"%S\"\n",
+			   value_name );
 		status = STATUS_UNSUCCESSFUL;
 		goto err_exallocatepoolwithtag;
 	}
@@ -363,21 +1313,115 @@ NTSTATUS reg_store_multi_sz ( HANDLE reg_key, LPCWSTR value_name, ... ) {
 	va_end ( args );
 
 	/* Store value */
-	RtlInitUnicodeString ( &u_value_name, value_name );
-	status = ZwSetValueKey ( reg_key, &u_value_name, 0, REG_MULTI_SZ,
-				 values, ( ( ULONG ) values_len ) );
-	if ( ! NT_SUCCESS ( status ) ) {
-		DbgPrint ( "Could not store value \"%S\": %x\n",
-			   value_name, status );
-		goto err_zwsetvaluekey;
-	}
+	status = reg_store_value ( reg_key, value_name, REG_MULTI_SZ, values,
+				   ( ( ULONG ) values_len ) );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store_value;
 
- err_zwsetvaluekey:
+ err_reg_store_value:
 	ExFreePool ( values );
  err_exallocatepoolwithtag:
 	return STATUS_SUCCESS;
 }
 
+/**
+ * Add string to registry multiple-string value
+ *
+ * @v reg_key		Registry key
+ * @v value_name	Registry value name
+ * @v value		String value to add
+ * @ret ntstatus	NT status
+ *
+ * The string is appended to any existing strings, unless already
+ * present (ignoring case).  The value is created if it does not exist.
+ */
+NTSTATUS reg_add_multi_sz ( HANDLE reg_key, LPCWSTR value_name,
+			    LPCWSTR value ) {
+	REG_KVI_BUF buf;
+	PKEY_VALUE_PARTIAL_INFORMATION kvi;
+	LPWSTR start = NULL;
+	LPWSTR end = NULL;
+	LPWSTR string;
+	LPWSTR next;
+	SIZE_T value_len = wcslen ( value );
+	SIZE_T existing_len = 0;
+	SIZE_T copy_len = 0;
+	SIZE_T values_len;
+	LPWSTR values;
+	NTSTATUS status;
+
+	/* Fetch existing strings, if any */
+	status = reg_query_kvi ( reg_key, value_name, &buf, &kvi );
+	if ( ! NT_SUCCESS ( status ) )
+		kvi = NULL;
+	if ( kvi && ( kvi->Type == REG_MULTI_SZ ) ) {
+		start = ( ( LPWSTR ) kvi->Data );
+		end = ( start + ( kvi->DataLength / sizeof ( start[0] ) ) );
+		for ( string = start ; ( string < end ) && *string ;
+		      string = ( next + 1 ) ) {
+			for ( next = string ; ( next < end ) && *next ; next++ )
+				;
+			if ( ( ( ( SIZE_T ) ( next - string ) ) ==
+			       value_len ) &&
+			     ( _wcsnicmp ( string, value, value_len ) == 0 ) ) {
+				DbgPrint ( "\"%S\" already includes \"%S\"\n",
+					   value_name, value );
+				status = STATUS_SUCCESS;
+				goto done;
+			}
+		}
+		/* An unterminated final string will be terminated */
+		existing_len = ( string - start );
+		copy_len = ( ( string > end ) ?
+			     ( ( SIZE_T ) ( end - start ) ) : existing_len );
+	}
+
+	/* Construct new value */
+	values_len = ( ( existing_len + value_len + 2 ) *
+		       sizeof ( values[0] ) );
+	values = ExAllocatePoolWithTag ( NonPagedPool, values_len,
+					 SANBOOTCONF_REG_POOL_TAG );
+	if ( ! values ) {
+		DbgPrint ( "Could not allocate value buffer for \"%S\"\n",
+			   value_name );
+		status = STATUS_UNSUCCESSFUL;
+		goto err_exallocatepoolwithtag;
+	}
+	RtlZeroMemory ( values, values_len );
+	if ( copy_len ) {
+		RtlCopyMemory ( values, start,
+				( copy_len * sizeof ( values[0] ) ) );
+	}
+	RtlCopyMemory ( &values[existing_len], value,
+			( value_len * sizeof ( values[0] ) ) );
+
+	/* Store value */
+	status = reg_store_value ( reg_key, value_name, REG_MULTI_SZ, values,
+				   ( ( ULONG ) values_len ) );
+
+	ExFreePool ( values );
+ err_exallocatepoolwithtag:
+ done:
+	if ( kvi )
+		reg_free_kvi ( &buf, kvi );
+	return status;
+}
+
+/**
+ * Store registry binary value
+ *
+ * @v reg_key		Registry key
+ * @v value_name	Registry value name
+ * @v data		Binary value to store
+ * @v len		Length of binary value
+ * @ret ntstatus	NT status
+ */
+NTSTATUS reg_store_binary ( HANDLE reg_key, LPCWSTR value_name, PVOID data,
+			    ULONG len ) {
+
+	return reg_store_value ( reg_key, value_name, REG_BINARY, data, len );
+}
+
 /**
  * Store registry dword value
  *
@@ -387,17 +1431,73 @@ NTSTATUS reg_store_multi_sz ( HANDLE reg_key, LPCWSTR value_name, ... ) {
  * @ret ntstatus	NT status
  */
 NTSTATUS reg_store_dword ( HANDLE reg_key, LPCWSTR value_name, ULONG value ) {
-	UNICODE_STRING u_value_name;
+
+	return reg_store_value ( reg_key, value_name, REG_DWORD, &value,
+				 sizeof ( value ) );
+}
+
+/**
+ * Fetch registry statistics
+ *
+ * @v buf		Buffer to fill in
+ * @v len		Length of buffer
+ * @v copied		Length of data copied to fill in
+ * @ret ntstatus	NT status
+ */
+NTSTATUS reg_stats_fetch ( PVOID buf, ULONG len, PULONG copied ) {
+
+	DbgPrint ( "Registry statistics requested\n" );
+
+	if ( len > sizeof ( reg_stats ) )
+		len = sizeof ( reg_stats );
+	RtlCopyMemory ( buf, &reg_stats, len );
+	*copied = len;
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Save registry statistics
+ *
+ * The statistics are stored as the REG_BINARY value
+ * "RegistryStatistics" under the driver's Parameters key.  Operations
+ * made while storing the statistics are not themselves included.
+ */
+VOID reg_stats_save ( VOID ) {
+	REG_STATS stats;
+	PREG_SITE_STATS site;
+	HANDLE reg_key;
+	ULONG i;
 	NTSTATUS status;
 
-	RtlInitUnicodeString ( &u_value_name, value_name );
-	status = ZwSetValueKey ( reg_key, &u_value_name, 0, REG_DWORD,
-				 &value, sizeof ( value ) );
+	/* Take snapshot */
+	RtlCopyMemory ( &stats, &reg_stats, sizeof ( stats ) );
+	for ( i = 0 ; i < REG_MAX_SITES ; i++ ) {
+		site = &stats.sites[i];
+		if ( ! ( site->opens || site->queries || site->sets ||
+			 site->flushes ) )
+			continue;
+		DbgPrint ( "Registry %s: opens %ld queries %ld sets %ld "
+			   "(%ld bytes) flushes %ld failures %ld time %ldus "
+			   "(%ldus flushing)\n", reg_site_names[i],
+			   site->opens, site->queries, site->sets,
+			   site->bytes_written, site->flushes, site->failures,
+			   site->time, site->flush_time );
+	}
+
+	/* Store snapshot */
+	status = reg_open_parameters ( &reg_key, REG_SITE_SAVE_STATS );
 	if ( ! NT_SUCCESS ( status ) ) {
-		DbgPrint ( "Could not store value \"%S\": %x\n",
-			   value_name, status );
-		return status;
+		DbgPrint ( "Could not open Parameters key: %x\n", status );
+		goto err_reg_open;
 	}
+	status = reg_store_binary ( reg_key, REG_STATS_VALUE_NAME, &stats,
+				    sizeof ( stats ) );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store_binary;
 
-	return STATUS_SUCCESS;
+ err_reg_store_binary:
+	reg_close ( reg_key );
+ err_reg_open:
+	return;
 }
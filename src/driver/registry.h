@@ -19,8 +19,212 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-extern NTSTATUS reg_open ( PHANDLE reg_key, ... );
+/** Registry statistics registry value name */
+#define REG_STATS_VALUE_NAME L"RegistryStatistics"
+
+/** Registry statistics format version */
+#define REG_STATS_VERSION 1
+
+/** Registry call site: unattributed */
+#define REG_SITE_OTHER 0
+
+/** Registry call site: load_start_options() */
+#define REG_SITE_LOAD_START_OPTIONS 1
+
+/** Registry call site: load_parameters() */
+#define REG_SITE_LOAD_PARAMETERS 2
+
+/** Registry call site: fetch_netcfginstanceid() */
+#define REG_SITE_FETCH_NETCFGINSTANCEID 3
+
+/** Registry call site: store_tcpip_parameters() */
+#define REG_SITE_TCPIP_PARAMETERS 4
+
+/** Registry call site: NIC binding cache */
+#define REG_SITE_NIC_CACHE 5
+
+/** Registry call site: store_nic_caps() */
+#define REG_SITE_NIC_CAPS 6
+
+/** Registry call site: history_save() */
+#define REG_SITE_HISTORY 7
+
+/** Registry call site: bootcfg_store() */
+#define REG_SITE_BOOTCFG 8
+
+/** Registry call site: reg_stats_save() */
+#define REG_SITE_SAVE_STATS 9
+
+/** Registry call site: store_mpio_parameters() */
+#define REG_SITE_MPIO_PARAMETERS 10
+
+/** Registry call site: NIC MTU configuration */
+#define REG_SITE_NIC_MTU 11
+
+/** Registry call site: store_iscsiprt_parameters() */
+#define REG_SITE_ISCSIPRT_PARAMETERS 12
+
+/** Number of registry call sites */
+#define REG_MAX_SITES 13
+
+/** Registry statistics for a single call site */
+#pragma pack(1)
+typedef struct _REG_SITE_STATS {
+	/** Number of keys opened */
+	ULONG opens;
+	/** Number of value queries */
+	ULONG queries;
+	/** Number of values written */
+	ULONG sets;
+	/** Number of flushes and transaction commits */
+	ULONG flushes;
+	/** Number of bytes written */
+	ULONG bytes_written;
+	/** Number of failed operations */
+	ULONG failures;
+	/** Cumulative time spent in all operations, in microseconds */
+	ULONG time;
+	/** Time spent in flushes and transaction commits, in microseconds */
+	ULONG flush_time;
+} REG_SITE_STATS, *PREG_SITE_STATS;
+#pragma pack()
+
+/** Registry statistics */
+#pragma pack(1)
+typedef struct _REG_STATS {
+	/** Format version */
+	ULONG version;
+	/** Length of each call site entry */
+	USHORT site_len;
+	/** Number of call site entries */
+	USHORT max_sites;
+	/** Call site entries, indexed by REG_SITE_XXX */
+	REG_SITE_STATS sites[REG_MAX_SITES];
+} REG_STATS, *PREG_STATS;
+#pragma pack()
+
+/** A registry backend
+ *
+ * Registry key and value accesses made via the reg_xxx() functions
+ * are routed through the active backend.  The driver uses the native
+ * Zw registry routines; the in-memory backend in src/regsim allows
+ * the reg_xxx() functions to be exercised off Windows.  Kernel
+ * transactions, and keys opened other than via reg_open() (such as by
+ * IoOpenDeviceRegistryKey()), are not abstracted by the backend.
+ */
+typedef struct _REG_BACKEND {
+	/** Backend name */
+	const char *name;
+	/**
+	 * Open key
+	 *
+	 * @v reg_key		Registry key to fill in
+	 * @v parent		Parent key, or NULL for an absolute name
+	 * @v key_name		Registry key name
+	 * @v transaction	Kernel transaction, or NULL
+	 * @ret ntstatus	NT status
+	 */
+	NTSTATUS ( * open_key ) ( PHANDLE reg_key, HANDLE parent,
+				  PUNICODE_STRING key_name,
+				  HANDLE transaction );
+	/**
+	 * Close key
+	 *
+	 * @v reg_key		Registry key
+	 */
+	VOID ( * close_key ) ( HANDLE reg_key );
+	/**
+	 * Query value
+	 *
+	 * @v reg_key		Registry key
+	 * @v value_name	Registry value name
+	 * @v kvi		Key value information block to fill in
+	 * @v len		Length of key value information block
+	 * @v result_len	Required length to fill in
+	 * @ret ntstatus	NT status
+	 */
+	NTSTATUS ( * query_value ) ( HANDLE reg_key,
+				     PUNICODE_STRING value_name,
+				     PKEY_VALUE_PARTIAL_INFORMATION kvi,
+				     ULONG len, PULONG result_len );
+	/**
+	 * Set value
+	 *
+	 * @v reg_key		Registry key
+	 * @v value_name	Registry value name
+	 * @v type		Registry value type
+	 * @v data		Value data
+	 * @v len		Length of value data
+	 * @ret ntstatus	NT status
+	 */
+	NTSTATUS ( * set_value ) ( HANDLE reg_key, PUNICODE_STRING value_name,
+				   ULONG type, PVOID data, ULONG len );
+	/**
+	 * Flush key
+	 *
+	 * @v reg_key		Registry key
+	 * @ret ntstatus	NT status
+	 */
+	NTSTATUS ( * flush_key ) ( HANDLE reg_key );
+	/**
+	 * Enumerate subkey
+	 *
+	 * @v reg_key		Registry key
+	 * @v index		Subkey index
+	 * @v kbi		Key basic information block to fill in
+	 * @v len		Length of key basic information block
+	 * @v result_len	Required length to fill in
+	 * @ret ntstatus	NT status
+	 */
+	NTSTATUS ( * enum_key ) ( HANDLE reg_key, ULONG index,
+				  PKEY_BASIC_INFORMATION kbi, ULONG len,
+				  PULONG result_len );
+	/**
+	 * Query values via query table
+	 *
+	 * @v key_name		Absolute registry key name
+	 * @v table		Query table
+	 * @v context		Context passed to query routines
+	 * @ret ntstatus	NT status
+	 */
+	NTSTATUS ( * query_table ) ( PWSTR key_name,
+				     PRTL_QUERY_REGISTRY_TABLE table,
+				     PVOID context );
+} REG_BACKEND, *PREG_BACKEND;
+
+/** A batch of registry writes to a single key */
+typedef struct _REG_BATCH {
+	/** Registry key */
+	HANDLE reg_key;
+	/** Kernel transaction, if any */
+	HANDLE transaction;
+	/** Number of registry writes made via reg_key */
+	ULONG writes;
+	/** Registry call site */
+	ULONG site;
+} REG_BATCH, *PREG_BATCH;
+
+extern ULONG reg_writes_performed;
+extern ULONG reg_writes_skipped;
+
+extern VOID reg_set_backend ( PREG_BACKEND backend );
+extern NTSTATUS reg_init_parameters ( PUNICODE_STRING driver_key );
+extern NTSTATUS reg_open_parameters ( PHANDLE reg_key, ULONG site );
+extern NTSTATUS reg_query_parameters ( PRTL_QUERY_REGISTRY_TABLE table,
+				       PVOID context, ULONG site );
+extern NTSTATUS reg_open ( PHANDLE reg_key, ULONG site, ... );
+extern NTSTATUS reg_open_relative ( PHANDLE reg_key, HANDLE parent,
+				    LPCWSTR name );
+extern NTSTATUS reg_batch_begin_tcpip_interface ( PREG_BATCH batch,
+						  LPCWSTR netcfginstanceid,
+						  ULONG site );
+extern NTSTATUS reg_batch_commit ( PREG_BATCH batch );
+extern VOID reg_batch_abort ( PREG_BATCH batch );
 extern VOID reg_close ( HANDLE reg_key );
+extern NTSTATUS reg_enum_subkey ( HANDLE reg_key, ULONG index,
+				  LPWSTR name, SIZE_T len );
+extern VOID reg_track_key ( HANDLE reg_key, ULONG site );
+extern VOID reg_untrack_key ( HANDLE reg_key );
 extern NTSTATUS reg_fetch_kvi ( HANDLE reg_key, LPCWSTR value_name,
 				PKEY_VALUE_PARTIAL_INFORMATION *kvi );
 extern NTSTATUS reg_fetch_sz ( HANDLE reg_key, LPCWSTR value_name,
@@ -32,7 +236,13 @@ extern NTSTATUS reg_fetch_dword ( HANDLE reg_key, LPCWSTR value_name,
 extern NTSTATUS reg_store_sz ( HANDLE reg_key, LPCWSTR value_name,
 			       LPWSTR value );
 extern NTSTATUS reg_store_multi_sz ( HANDLE reg_key, LPCWSTR value_name, ... );
+extern NTSTATUS reg_add_multi_sz ( HANDLE reg_key, LPCWSTR value_name,
+				   LPCWSTR value );
+extern NTSTATUS reg_store_binary ( HANDLE reg_key, LPCWSTR value_name,
+				   PVOID data, ULONG len );
 extern NTSTATUS reg_store_dword ( HANDLE reg_key, LPCWSTR value_name,
 				  ULONG value );
+extern NTSTATUS reg_stats_fetch ( PVOID buf, ULONG len, PULONG copied );
+extern VOID reg_stats_save ( VOID );
 
 #endif /* _REGISTRY_H */
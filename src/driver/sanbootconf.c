@@ -18,6 +18,8 @@
 
 #include <ntddk.h>
 #include <initguid.h>
+#define NTSTRSAFE_LIB
+#include <ntstrsafe.h>
 #include <wdmsec.h>
 #include <ntdddisk.h>
 #include <coguid.h>
@@ -28,9 +30,90 @@
 #include "abft.h"
 #include "registry.h"
 #include "boottext.h"
+#include "nic.h"
+#include "devintf.h"
+#include "wait.h"
+#include "history.h"
+#include "bootcfg.h"
+
+/** System disk wait schedule */
+static WAIT_SCHEDULE wait_schedule = {
+	WAIT_INITIAL_DELAY,
+	WAIT_GROWTH,
+	WAIT_MAX_DELAY,
+	WAIT_DEADLINE,
+};
+
+/** A driver parameter */
+typedef struct _SANBOOTCONF_PARAM {
+	/** Registry value name */
+	LPCWSTR name;
+	/** Parameter type */
+	ULONG type;
+	/** Parameter value */
+	PVOID value;
+	/** Minimum allowed value */
+	ULONG min;
+	/** Maximum allowed value */
+	ULONG max;
+} SANBOOTCONF_PARAM, *PSANBOOTCONF_PARAM;
+
+/** Boolean parameter */
+#define SANBOOTCONF_PARAM_BOOLEAN 0
+
+/** Dword parameter */
+#define SANBOOTCONF_PARAM_DWORD 1
+
+/** Driver parameters
+ *
+ * Each parameter is an optional REG_DWORD value under the driver's
+ * Parameters key.  The default is whatever the parameter variable
+ * holds before parameters are loaded.
+ */
+static const SANBOOTCONF_PARAM sanbootconf_params[] = {
+	{ L"BootText", SANBOOTCONF_PARAM_BOOLEAN, &boottext_enabled,
+	  0, MAXULONG },
+	{ L"WaitInitialDelay", SANBOOTCONF_PARAM_DWORD,
+	  &wait_schedule.initial_delay, 1, MAXLONG },
+	{ L"WaitGrowth", SANBOOTCONF_PARAM_DWORD, &wait_schedule.growth,
+	  WAIT_GROWTH_MIN, WAIT_GROWTH_MAX },
+	{ L"WaitMaxDelay", SANBOOTCONF_PARAM_DWORD,
+	  &wait_schedule.max_delay, 1, MAXLONG },
+	{ L"WaitDeadline", SANBOOTCONF_PARAM_DWORD,
+	  &wait_schedule.deadline, 0, MAXLONG },
+	{ L"NicArrivalTimeout", SANBOOTCONF_PARAM_DWORD,
+	  &nic_arrival_timeout, 0, MAXLONG },
+	{ L"Multipath", SANBOOTCONF_PARAM_BOOLEAN, &ibft_multipath_enabled,
+	  0, MAXULONG },
+	{ L"Mtu", SANBOOTCONF_PARAM_DWORD, &nic_mtu, 0, NIC_MTU_MAX },
+	{ L"TcpAckFrequency", SANBOOTCONF_PARAM_DWORD,
+	  &ibft_tcp_ack_frequency, 1, 255 },
+	{ L"IscsiMaxTransferLength", SANBOOTCONF_PARAM_DWORD,
+	  &ibft_iscsi_max_transfer_length, 512, MAXLONG },
+	{ L"IscsiFirstBurstLength", SANBOOTCONF_PARAM_DWORD,
+	  &ibft_iscsi_first_burst_length, 512, 0xffffff },
+	{ L"IscsiMaxBurstLength", SANBOOTCONF_PARAM_DWORD,
+	  &ibft_iscsi_max_burst_length, 512, 0xffffff },
+	{ L"IscsiMaxRecvDataSegmentLength", SANBOOTCONF_PARAM_DWORD,
+	  &ibft_iscsi_max_recv_data_segment_length, 512, 0xffffff },
+	{ L"IscsiLinkDownTime", SANBOOTCONF_PARAM_DWORD,
+	  &ibft_iscsi_link_down_time, 1, 3600 },
+	{ L"IscsiMaxRequestHoldTime", SANBOOTCONF_PARAM_DWORD,
+	  &ibft_iscsi_max_request_hold_time, 1, 3600 },
+	{ L"DiskTimeOutValue", SANBOOTCONF_PARAM_DWORD, &ibft_disk_timeout,
+	  1, 3600 },
+};
+
+/** Maximum number of deferred table configurations */
+#define SANBOOTCONF_MAX_DEFERRED 3
 
-/** Maximum time to wait for system disk, in seconds */
-#define SANBOOTCONF_MAX_WAIT 120
+/** Deferred table configuration */
+typedef struct _SANBOOTCONF_DEFERRED {
+	/** Configuration method */
+	VOID ( *configure ) ( PACPI_DESCRIPTION_HEADER acpi );
+	/** Unmodified copy of table, freed once configured */
+	PACPI_DESCRIPTION_HEADER table;
+} SANBOOTCONF_DEFERRED, *PSANBOOTCONF_DEFERRED;
 
 /** Device private data */
 typedef struct _SANBOOTCONF_PRIV {
@@ -40,8 +123,15 @@ typedef struct _SANBOOTCONF_PRIV {
 	PACPI_DESCRIPTION_HEADER abft;
 	/* Copy of sBFT, if any */
 	PACPI_DESCRIPTION_HEADER sbft;
+	/* Deferred table configurations */
+	SANBOOTCONF_DEFERRED deferred[SANBOOTCONF_MAX_DEFERRED];
+	/* Number of deferred table configurations */
+	ULONG num_deferred;
 } SANBOOTCONF_PRIV, *PSANBOOTCONF_PRIV;
 
+/** Deferred configuration thread, if any */
+static PVOID sanbootconf_configure_thread;
+
 /** Unique GUID for IoCreateDeviceSecure() */
 DEFINE_GUID ( GUID_SANBOOTCONF_CLASS, 0x8a2f8602, 0x8f0b, 0x4138,
 	      0x8e, 0x16, 0x51, 0x9a, 0x59, 0xf3, 0x07, 0xca );
@@ -61,6 +151,16 @@ DEFINE_GUID ( GUID_SANBOOTCONF_CLASS, 0x8a2f8602, 0x8f0b, 0x4138,
 	CTL_CODE ( FILE_DEVICE_UNKNOWN, 0x0873, METHOD_BUFFERED, \
 		   FILE_READ_ACCESS )
 
+/** IoControl code to retrieve NIC capability snapshots */
+#define IOCTL_SANBOOTCONF_NIC_CAPS \
+	CTL_CODE ( FILE_DEVICE_UNKNOWN, 0x086e, METHOD_BUFFERED, \
+		   FILE_READ_ACCESS )
+
+/** IoControl code to retrieve registry statistics */
+#define IOCTL_SANBOOTCONF_REG_STATS \
+	CTL_CODE ( FILE_DEVICE_UNKNOWN, 0x0872, METHOD_BUFFERED, \
+		   FILE_READ_ACCESS )
+
 /** Device name */
 static const WCHAR sanbootconf_device_name[] = L"\\Device\\sanbootconf";
 
@@ -77,6 +177,8 @@ static __drv_dispatchType ( IRP_MJ_CREATE )
        DRIVER_DISPATCH sanbootconf_dummy_irp;
 static __drv_dispatchType ( IRP_MJ_DEVICE_CONTROL )
        DRIVER_DISPATCH sanbootconf_iocontrol_irp;
+static KSTART_ROUTINE sanbootconf_configure_thread_main;
+static RTL_QUERY_REGISTRY_ROUTINE load_parameter;
 DRIVER_INITIALIZE DriverEntry;
 
 /**
@@ -93,7 +195,8 @@ static NTSTATUS load_start_options ( VOID ) {
 	NTSTATUS status;
 	
 	/* Open Control key */
-	status = reg_open ( &reg_key, key_name, NULL );
+	status = reg_open ( &reg_key, REG_SITE_LOAD_START_OPTIONS, key_name,
+			    NULL );
 	if ( ! NT_SUCCESS ( status ) ) {
 		DbgPrint ( "Could not open Control key: %x\n", status );
 		goto err_reg_open;
@@ -123,38 +226,92 @@ static NTSTATUS load_start_options ( VOID ) {
 	return status;
 }
 
+/**
+ * Load driver parameter
+ *
+ * @v value_name	Registry value name
+ * @v value_type	Registry value type
+ * @v value_data	Registry value data
+ * @v value_len		Length of registry value data
+ * @v context		Context
+ * @v entry_context	Parameter descriptor
+ * @ret ntstatus	NT status
+ *
+ * Invalid values are ignored, leaving the default in place.
+ */
+static NTSTATUS load_parameter ( PWSTR value_name, ULONG value_type,
+				 PVOID value_data, ULONG value_len,
+				 PVOID context, PVOID entry_context ) {
+	const SANBOOTCONF_PARAM *param = entry_context;
+	ULONG value;
+
+	/* Sanity check */
+	if ( ( value_type != REG_DWORD ) ||
+	     ( value_len != sizeof ( value ) ) ) {
+		DbgPrint ( "Ignoring %S parameter with type %ld length %ld\n",
+			   value_name, value_type, value_len );
+		return STATUS_SUCCESS;
+	}
+	RtlCopyMemory ( &value, value_data, sizeof ( value ) );
+	if ( ( value < param->min ) || ( value > param->max ) ) {
+		DbgPrint ( "Ignoring out-of-range %S parameter %ld\n",
+			   value_name, value );
+		return STATUS_SUCCESS;
+	}
+
+	/* Store value */
+	switch ( param->type ) {
+	case SANBOOTCONF_PARAM_BOOLEAN:
+		*( ( PBOOLEAN ) param->value ) = ( ( value != 0 ) ?
+						  TRUE : FALSE );
+		break;
+	case SANBOOTCONF_PARAM_DWORD:
+		*( ( PULONG ) param->value ) = value;
+		break;
+	}
+	DbgPrint ( "Parameter %S is %ld\n", value_name, value );
+
+	( VOID ) context;
+	return STATUS_SUCCESS;
+}
+
 /**
  * Load driver parameters
  *
- * @v key_name		Driver key name
  * @ret ntstatus	NT status
+ *
+ * All parameters are retrieved in a single pass over the Parameters
+ * key.  Missing parameters retain their default values.
  */
-static NTSTATUS load_parameters ( LPCWSTR key_name ) {
-	HANDLE reg_key;
-	ULONG boottext;
+static NTSTATUS load_parameters ( VOID ) {
+	RTL_QUERY_REGISTRY_TABLE table[ ARRAYSIZE ( sanbootconf_params ) + 1 ];
+	PWAIT_SCHEDULE wait = &wait_schedule;
+	ULONG i;
 	NTSTATUS status;
 
-	/* Open Parameters key */
-	status = reg_open ( &reg_key, key_name, L"Parameters", NULL );
-	if ( ! NT_SUCCESS ( status ) ) {
-		DbgPrint ( "Could not open Parameters key: %x\n", status );
-		goto err_reg_open;
+	/* Construct query table */
+	RtlZeroMemory ( table, sizeof ( table ) );
+	for ( i = 0 ; i < ARRAYSIZE ( sanbootconf_params ) ; i++ ) {
+		table[i].QueryRoutine = load_parameter;
+		table[i].Name = ( ( PWSTR ) sanbootconf_params[i].name );
+		table[i].EntryContext = ( ( PVOID ) &sanbootconf_params[i] );
 	}
 
-	/* Retrieve BootText parameter */
-	status = reg_fetch_dword ( reg_key, L"BootText", &boottext );
-	if ( NT_SUCCESS ( status ) ) {
-		boottext_enabled = ( ( boottext != 0 ) ? TRUE : FALSE );
-		DbgPrint ( "Boot screen text is %s\n",
-			   ( boottext_enabled ? "enabled" : "disabled" ) );
-	} else {
-		DbgPrint ( "Could not read BootText parameter: %x\n", status );
+	/* Retrieve parameters */
+	status = reg_query_parameters ( table, NULL,
+					REG_SITE_LOAD_PARAMETERS );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not read parameters: %x\n", status );
 		/* Treat as non-fatal error */
 		status = STATUS_SUCCESS;
 	}
 
-	reg_close ( reg_key );
- err_reg_open:
+	/* Fix up dependent parameters */
+	if ( wait->max_delay < wait->initial_delay )
+		wait->max_delay = wait->initial_delay;
+	DbgPrint ( "Boot screen text is %s\n",
+		   ( boottext_enabled ? "enabled" : "disabled" ) );
+
 	return status;
 }
 
@@ -182,11 +339,13 @@ static NTSTATUS sanbootconf_dummy_irp ( PDEVICE_OBJECT device, PIRP irp ) {
  * @v acpi		ACPI header
  * @v buf		Buffer
  * @v len		Length of buffer
+ * @v copied		Length of data copied to fill in
  * @ret ntstatus	NT status
  */
 static NTSTATUS fetch_acpi_table_copy ( PCHAR signature,
 					PACPI_DESCRIPTION_HEADER acpi,
-					PCHAR buf, ULONG len ) {
+					PCHAR buf, ULONG len,
+					PULONG copied ) {
 
 	DbgPrint ( "%s requested\n", signature );
 
@@ -198,6 +357,7 @@ static NTSTATUS fetch_acpi_table_copy ( PCHAR signature,
 	if ( len > acpi->length )
 		len = acpi->length;
 	RtlCopyMemory ( buf, acpi, len );
+	*copied = len;
 
 	return STATUS_SUCCESS;
 }
@@ -214,20 +374,27 @@ static NTSTATUS sanbootconf_iocontrol_irp ( PDEVICE_OBJECT device, PIRP irp ) {
 	PSANBOOTCONF_PRIV priv = device->DeviceExtension;
 	PCHAR buf = irp->AssociatedIrp.SystemBuffer;
 	ULONG len = irpsp->Parameters.DeviceIoControl.OutputBufferLength;
+	ULONG copied = 0;
 	NTSTATUS status;
 
 	switch ( irpsp->Parameters.DeviceIoControl.IoControlCode ) {
 	case IOCTL_SANBOOTCONF_IBFT:
 		status = fetch_acpi_table_copy ( IBFT_SIG, priv->ibft,
-						 buf, len );
+						 buf, len, &copied );
 		break;
 	case IOCTL_SANBOOTCONF_ABFT:
 		status = fetch_acpi_table_copy ( ABFT_SIG, priv->abft,
-						 buf, len );
+						 buf, len, &copied );
 		break;
 	case IOCTL_SANBOOTCONF_SBFT:
 		status = fetch_acpi_table_copy ( SBFT_SIG, priv->sbft,
-						 buf, len );
+						 buf, len, &copied );
+		break;
+	case IOCTL_SANBOOTCONF_NIC_CAPS:
+		status = fetch_nic_caps ( buf, len, &copied );
+		break;
+	case IOCTL_SANBOOTCONF_REG_STATS:
+		status = reg_stats_fetch ( buf, len, &copied );
 		break;
 	default:
 		DbgPrint ( "Unrecognised IoControl %x\n",
@@ -237,7 +404,7 @@ static NTSTATUS sanbootconf_iocontrol_irp ( PDEVICE_OBJECT device, PIRP irp ) {
 	}
 
 	irp->IoStatus.Status = status;
-	irp->IoStatus.Information = 0;
+	irp->IoStatus.Information = copied;
 	IoCompleteRequest ( irp, IO_NO_INCREMENT );
 	return status;
 }
@@ -359,21 +526,13 @@ static NTSTATUS fetch_partition_info ( PUNICODE_STRING name,
  */
 static NTSTATUS check_system_disk ( PUNICODE_STRING name,
 				    PBOOTDISK_INFORMATION_EX boot_info ) {
-	BOOLEAN must_disable;
 	PFILE_OBJECT file;
 	PDEVICE_OBJECT device;
 	DISK_PARTITION_INFO info;
 	NTSTATUS status;
 
 	/* Enable interface if not already done */
-	status = IoSetDeviceInterfaceState ( name, TRUE );
-	/* If interface is already enabled, IoSetDeviceInterfaceState
-	 * will return STATUS_OBJECT_NAME_EXISTS, which counts as a
-	 * success status.
-	 */
-	must_disable = ( ( NT_SUCCESS ( status ) &&
-			   ( status != STATUS_OBJECT_NAME_EXISTS ) )
-			 ? TRUE : FALSE );
+	devintf_enable ( name );
 
 	/* Get device and file object pointers */
 	status = IoGetDeviceObjectPointer ( name, FILE_ALL_ACCESS, &file,
@@ -427,24 +586,34 @@ static NTSTATUS check_system_disk ( PUNICODE_STRING name,
 	DbgPrint ( "Found system disk at \"%wZ\"\n", name );
 	status = STATUS_SUCCESS;
 
+	/* Record system disk identity */
+	boot_config.disk.found = TRUE;
+	boot_config.disk.partition_style = info.PartitionStyle;
+	if ( info.PartitionStyle == PARTITION_STYLE_MBR ) {
+		boot_config.disk.mbr_signature = info.Mbr.Signature;
+	} else {
+		boot_config.disk.gpt_disk_id = info.Gpt.DiskId;
+	}
+	RtlStringCbCopyNW ( boot_config.disk.name,
+			    sizeof ( boot_config.disk.name ),
+			    name->Buffer, name->Length );
+
  err_not_system_disk:
  err_unknown_type:
  err_fetch_partition_info:
 	/* Drop object reference */
 	ObDereferenceObject ( file );
  err_iogetdeviceobjectpointer:
-	/* Disable interface if we had to enable it */
-	if ( must_disable )
-		IoSetDeviceInterfaceState ( name, FALSE );
 	return status;
 }
 
 /**
  * Find system disk
  *
+ * @v probes		Number of disks probed
  * @ret status		NT status
  */
-static NTSTATUS find_system_disk ( VOID ) {
+static NTSTATUS find_system_disk ( PULONG probes ) {
 	union {
 		BOOTDISK_INFORMATION basic;
 		BOOTDISK_INFORMATION_EX extended;
@@ -497,6 +666,7 @@ static NTSTATUS find_system_disk ( VOID ) {
 	      RtlInitUnicodeString ( &u_symlink, symlink ) , *symlink ;
 	      symlink += ( ( u_symlink.Length / sizeof ( *symlink ) ) + 1 ) ) {
 		status = check_system_disk ( &u_symlink, &boot_info.extended );
+		(*probes)++;
 		if ( NT_SUCCESS ( status ) )
 			break;
 	}
@@ -508,35 +678,196 @@ static NTSTATUS find_system_disk ( VOID ) {
 	return status;
 }
 
+/**
+ * Carry out deferred table configuration
+ *
+ * @v context		Device private data
+ *
+ * This runs concurrently with the wait for the system disk, and
+ * handles everything that the system disk does not depend upon:
+ * detailed table dumps and the configuration of secondary NICs.
+ */
+static VOID sanbootconf_configure ( PVOID context ) {
+	PSANBOOTCONF_PRIV priv = context;
+	PSANBOOTCONF_DEFERRED deferred;
+	ULONGLONG started;
+	ULONG i;
+
+	started = history_now();
+	for ( i = 0 ; i < priv->num_deferred ; i++ ) {
+		deferred = &priv->deferred[i];
+		deferred->configure ( deferred->table );
+		/* Deferred NIC requests hold their own copies of any
+		 * table data, so the table copy may now be freed.
+		 */
+		ExFreePool ( deferred->table );
+		deferred->table = NULL;
+	}
+	free_nic_inventory();
+	boot_history.configure_time = ( ( ULONG ) ( history_now() -
+						    started ) );
+}
+
+/**
+ * Carry out deferred table configuration in a system thread
+ *
+ * @v context		Device private data
+ */
+static VOID sanbootconf_configure_thread_main ( PVOID context ) {
+	sanbootconf_configure ( context );
+	PsTerminateSystemThread ( STATUS_SUCCESS );
+}
+
+/**
+ * Start deferred table configuration
+ *
+ * @v priv		Device private data
+ */
+static VOID sanbootconf_start_configure ( PSANBOOTCONF_PRIV priv ) {
+	HANDLE thread;
+	NTSTATUS status;
+
+	/* Do nothing if there is nothing to configure */
+	if ( ! priv->num_deferred ) {
+		free_nic_inventory();
+		return;
+	}
+
+	/* Create configuration thread */
+	status = PsCreateSystemThread ( &thread, THREAD_ALL_ACCESS, NULL,
+					NULL, NULL,
+					sanbootconf_configure_thread_main,
+					priv );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not create configuration thread: %x\n",
+			   status );
+		goto err_pscreatesystemthread;
+	}
+
+	/* Get thread object for use when joining */
+	status = ObReferenceObjectByHandle ( thread, SYNCHRONIZE, NULL,
+					     KernelMode,
+					     &sanbootconf_configure_thread,
+					     NULL );
+	if ( ! NT_SUCCESS ( status ) ) {
+		DbgPrint ( "Could not reference configuration thread: %x\n",
+			   status );
+		goto err_obreferenceobjectbyhandle;
+	}
+
+	ZwClose ( thread );
+	return;
+
+ err_obreferenceobjectbyhandle:
+	/* The thread is already running, and cannot be joined later
+	 * on.  Join it now, using the thread handle.
+	 */
+	sanbootconf_configure_thread = NULL;
+	ZwWaitForSingleObject ( thread, FALSE, NULL );
+	ZwClose ( thread );
+	return;
+
+ err_pscreatesystemthread:
+	/* Fall back to carrying out configuration synchronously */
+	sanbootconf_configure ( priv );
+}
+
+/**
+ * Wait for deferred table configuration to complete
+ *
+ */
+static VOID sanbootconf_join_configure ( VOID ) {
+
+	if ( ! sanbootconf_configure_thread )
+		return;
+	KeWaitForSingleObject ( sanbootconf_configure_thread, Executive,
+				KernelMode, FALSE, NULL );
+	ObDereferenceObject ( sanbootconf_configure_thread );
+	sanbootconf_configure_thread = NULL;
+}
+
+/**
+ * Finish waiting for SAN system disk
+ *
+ * @v wait		Wait schedule
+ * @v found		System disk was found
+ */
+static VOID sanbootconf_wait_done ( PWAIT_SCHEDULE wait, BOOLEAN found ) {
+
+	/* Wait for deferred configuration to complete */
+	sanbootconf_join_configure();
+
+	/* Restore state of device interfaces used while probing */
+	devintf_restore();
+
+	/* Record boot history */
+	boot_history.disk_time = ( ( ULONG ) wait->elapsed );
+	boot_history.disk_attempts = wait->attempts;
+	boot_history.disk_probes = wait->probes;
+	if ( ! found ) {
+		InterlockedOr ( ( PLONG ) &boot_history.failures,
+				HISTORY_FAIL_DISK );
+	}
+	boot_history.reg_writes = reg_writes_performed;
+	boot_history.reg_writes_skipped = reg_writes_skipped;
+	history_save();
+
+	/* Record boot configuration */
+	boot_config.tables = boot_history.tables;
+	bootcfg_save();
+
+	/* Record registry statistics */
+	reg_stats_save();
+}
+
 /**
  * Wait for SAN system disk to appear
  *
  * @v driver		Driver object
- * @v context		Context
+ * @v context		Wait schedule
  * @v count		Number of times this routine has been called
  */
 static VOID sanbootconf_wait ( PDRIVER_OBJECT driver, PVOID context,
 			       ULONG count ) {
+	PWAIT_SCHEDULE wait = context;
 	LARGE_INTEGER delay;
+	ULONG delay_ms;
 	NTSTATUS status;
 
-	DbgPrint ( "Waiting for SAN system disk (attempt %ld)\n", count );
+	/* Start the clock on the first attempt */
+	if ( count == 1 ) {
+		DbgPrint ( "Waiting for SAN system disk with delay %ldms "
+			   "growing by %ld%% to %ldms, deadline %ldms\n",
+			   wait->initial_delay, wait->growth,
+			   wait->max_delay, wait->deadline );
+		wait_start ( wait, history_now() );
+	}
+	wait_check ( wait, history_now() );
+
+	DbgPrint ( "Waiting for SAN system disk (attempt %ld, %I64dms)\n",
+		   count, wait->elapsed );
 
 	/* Check for existence of system disk */
-	status = find_system_disk();
+	status = find_system_disk ( &wait->probes );
 	if ( NT_SUCCESS ( status ) ) {
-		DbgPrint ( "Found SAN system disk; proceeding with boot\n" );
+		DbgPrint ( "Found SAN system disk after %ld attempt(s) and "
+			   "%ld probe(s) in %I64dms; proceeding with boot\n",
+			   wait->attempts, wait->probes, wait->elapsed );
+		sanbootconf_wait_done ( wait, TRUE );
 		return;
 	}
 
-	/* Give up after too many attempts */
-	if ( count >= SANBOOTCONF_MAX_WAIT ) {
-		DbgPrint ( "Giving up waiting for SAN system disk\n" );
+	/* Give up once the deadline has passed */
+	if ( ! wait_next ( wait, &delay_ms ) ) {
+		DbgPrint ( "Giving up waiting for SAN system disk after %ld "
+			   "attempt(s) and %ld probe(s) in %I64dms\n",
+			   wait->attempts, wait->probes, wait->elapsed );
+		sanbootconf_wait_done ( wait, FALSE );
 		return;
 	}
 
-	/* Sleep for a second, reschedule self */
-	delay.QuadPart = -10000000L /* 1 second, relative to current time */;
+	/* Sleep, reschedule self */
+	delay.QuadPart = ( -10000LL * delay_ms ) /* relative time */;
 	KeDelayExecutionThread ( KernelMode, FALSE, &delay );
 	IoRegisterBootDriverReinitialization ( driver, sanbootconf_wait,
 					       context );
@@ -545,17 +876,35 @@ static VOID sanbootconf_wait ( PDRIVER_OBJECT driver, PVOID context,
 /**
  * Try to find ACPI table
  *
+ * @v priv		Device private data
  * @v signature		Table signature
  * @v label		Label for boot message
- * @v parse		Table parser
+ * @v parse		Table parser, or NULL
+ * @v configure_boot	Boot-critical table configuration, or NULL
+ * @v configure		Deferred table configuration, or NULL
  * @ret table_copy	Copy of table, or NULL
  * @ret found		Table was found
+ *
+ * The boot-critical configuration method (which configures the NICs
+ * used to reach the system disk) is run immediately, followed by the
+ * parser.  The parser may modify the table copy that will be exposed
+ * via IoControl.  The deferred configuration method is run later,
+ * concurrently with the wait for the system disk, and is given a
+ * separate unmodified copy of the table.  If no such copy can be
+ * made, it is instead run immediately.
  */
-static BOOLEAN try_find_acpi_table ( PCHAR signature, PCHAR label,
+static BOOLEAN try_find_acpi_table ( PSANBOOTCONF_PRIV priv,
+				     PCHAR signature, PCHAR label,
 				     VOID ( *parse )
 					  ( PACPI_DESCRIPTION_HEADER acpi ),
+				     VOID ( *configure_boot )
+					  ( PACPI_DESCRIPTION_HEADER acpi ),
+				     VOID ( *configure )
+					  ( PACPI_DESCRIPTION_HEADER acpi ),
 				     PACPI_DESCRIPTION_HEADER *table_copy ) {
 	PACPI_DESCRIPTION_HEADER table;
+	PSANBOOTCONF_DEFERRED deferred;
+	ULONG len;
 	NTSTATUS status;
 
 	/* Try to find table */
@@ -574,8 +923,38 @@ static BOOLEAN try_find_acpi_table ( PCHAR signature, PCHAR label,
 			    "please upgrade to iPXE (http://ipxe.org)\n" );
 	}
 
+	/* Configure boot NICs, if applicable */
+	if ( configure_boot )
+		configure_boot ( table );
+
+	/* Record deferred configuration, if applicable */
+	if ( configure &&
+	     ( priv->num_deferred < SANBOOTCONF_MAX_DEFERRED ) ) {
+		deferred = &priv->deferred[priv->num_deferred];
+		len = table->length;
+		deferred->table =
+			ExAllocatePoolWithTag ( NonPagedPool, len,
+						SANBOOTCONF_POOL_TAG );
+		if ( deferred->table ) {
+			RtlCopyMemory ( deferred->table, table, len );
+			deferred->configure = configure;
+			priv->num_deferred++;
+			configure = NULL;
+		} else {
+			DbgPrint ( "Could not allocate %s configuration "
+				   "copy\n", signature );
+		}
+	}
+
+	/* Fall back to configuring synchronously, before the table
+	 * is modified by the parser.
+	 */
+	if ( configure )
+		configure ( table );
+
 	/* Parse table */
-	parse ( table );
+	if ( parse )
+		parse ( table );
 
 	return TRUE;
 }
@@ -595,6 +974,20 @@ NTSTATUS DriverEntry ( IN PDRIVER_OBJECT DriverObject,
 	BOOLEAN found_san;
 
 	DbgPrint ( "SAN Boot Configuration Driver initialising\n" );
+	KeQuerySystemTime ( &boot_history.boot_time );
+	devintf_init();
+	history_init();
+	bootcfg_init();
+	nic_init ( DriverObject );
+
+	/* Record location of driver parameters */
+	status = reg_init_parameters ( RegistryPath );
+	if ( ! NT_SUCCESS ( status ) ) {
+		/* Treat as non-fatal error */
+		DbgPrint ( "Could not record parameters location: %x\n",
+			   status );
+		status = STATUS_SUCCESS;
+	}
 
 	/* Load start options */
 	status = load_start_options();
@@ -606,7 +999,7 @@ NTSTATUS DriverEntry ( IN PDRIVER_OBJECT DriverObject,
 	}
 
 	/* Load driver parameters */
-	status = load_parameters ( RegistryPath->Buffer );
+	status = load_parameters();
 	if ( ! NT_SUCCESS ( status ) ) {
 		/* Treat as non-fatal error */
 		DbgPrint ( "Could not load parameters: %x\n", status );
@@ -628,24 +1021,34 @@ NTSTATUS DriverEntry ( IN PDRIVER_OBJECT DriverObject,
 
 	/* Look for boot firmware tables*/
 	found_san =
-		( try_find_acpi_table ( IBFT_SIG, "iSCSI",
-					parse_ibft, &priv->ibft ) |
-		  try_find_acpi_table ( ABFT_SIG, "AoE",
-					parse_abft, &priv->abft ) |
-		  try_find_acpi_table ( SBFT_SIG, "SRP",
-					parse_sbft, &priv->sbft ) );
+		( try_find_acpi_table ( priv, IBFT_SIG, "iSCSI", parse_ibft,
+					configure_ibft_boot, configure_ibft,
+					&priv->ibft ) |
+		  try_find_acpi_table ( priv, ABFT_SIG, "AoE", parse_abft,
+					configure_abft, NULL, &priv->abft ) |
+		  try_find_acpi_table ( priv, SBFT_SIG, "SRP", NULL,
+					NULL, parse_sbft, &priv->sbft ) );
+
+	/* Record boot firmware tables found */
+	if ( priv->ibft )
+		boot_history.tables |= HISTORY_TABLE_IBFT;
+	if ( priv->abft )
+		boot_history.tables |= HISTORY_TABLE_ABFT;
+	if ( priv->sbft )
+		boot_history.tables |= HISTORY_TABLE_SBFT;
 
 	/* Wait for system disk, if booting from SAN */
 	if ( found_san ) {
 		DbgPrint ( "Attempting SAN boot; will wait for system disk\n");
+		sanbootconf_start_configure ( priv );
 		IoRegisterBootDriverReinitialization ( DriverObject,
 						       sanbootconf_wait,
-						       NULL );
+						       &wait_schedule );
 	} else {
 		DbgPrint ( "No SAN boot method detected\n" );
+		devintf_restore();
 	}
 
  err_create_sanbootconf_device:
-	( VOID ) RegistryPath;
 	return status;
 }
@@ -34,6 +34,9 @@
 /** Tag to use for memory allocation */
 #define SANBOOTCONF_POOL_TAG 'fcbs'
 
+/** Tag to use for registry memory allocation */
+#define SANBOOTCONF_REG_POOL_TAG 'rcbs'
+
 /** GUID printf() format specifier */
 #define GUID_FMT "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x"
 
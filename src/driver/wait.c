@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * System disk wait schedule
+ *
+ * The schedule is driven entirely by the caller-supplied clock and
+ * makes no calls into the kernel, so that the wait policy can be
+ * replayed against a virtual clock.  Defining WAIT_HOST allows this
+ * file to be built as part of the user-mode simulator in src/waitsim.
+ */
+
+#ifdef WAIT_HOST
+#include "waithost.h"
+#else
+#include <ntddk.h>
+#endif
+#include "wait.h"
+
+/**
+ * Start waiting
+ *
+ * @v wait		Wait schedule
+ * @v now		Current time, in milliseconds
+ */
+VOID wait_start ( PWAIT_SCHEDULE wait, ULONGLONG now ) {
+
+	wait->started = now;
+	wait->elapsed = 0;
+	wait->delay = wait->initial_delay;
+	wait->attempts = 0;
+	wait->probes = 0;
+}
+
+/**
+ * Record a check
+ *
+ * @v wait		Wait schedule
+ * @v now		Current time, in milliseconds
+ */
+VOID wait_check ( PWAIT_SCHEDULE wait, ULONGLONG now ) {
+
+	wait->elapsed = ( now - wait->started );
+	wait->attempts++;
+}
+
+/**
+ * Calculate delay before next check
+ *
+ * @v wait		Wait schedule
+ * @v delay		Delay to fill in, in milliseconds
+ * @ret more		Another check should be made
+ */
+BOOLEAN wait_next ( PWAIT_SCHEDULE wait, PULONG delay ) {
+	ULONGLONG next_delay;
+
+	/* Give up once the deadline has passed */
+	if ( ( wait->elapsed + wait->delay ) > wait->deadline )
+		return FALSE;
+
+	/* Use current delay, increase delay for next time */
+	*delay = wait->delay;
+	next_delay = ( ( ( ULONGLONG ) wait->delay ) * wait->growth / 100 );
+	wait->delay = ( ( next_delay < wait->max_delay ) ?
+			( ( ULONG ) next_delay ) : wait->max_delay );
+	return TRUE;
+}
@@ -0,0 +1,72 @@
+#ifndef _WAIT_H
+#define _WAIT_H
+
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * System disk wait schedule
+ *
+ */
+
+/** Default initial delay between system disk checks, in milliseconds */
+#define WAIT_INITIAL_DELAY 10
+
+/** Default growth of delay between system disk checks, in percent */
+#define WAIT_GROWTH 200
+
+/** Default maximum delay between system disk checks, in milliseconds */
+#define WAIT_MAX_DELAY 1000
+
+/** Default maximum time to wait for system disk, in milliseconds */
+#define WAIT_DEADLINE 120000
+
+/** Minimum growth of delay between system disk checks, in percent */
+#define WAIT_GROWTH_MIN 100
+
+/** Maximum growth of delay between system disk checks, in percent */
+#define WAIT_GROWTH_MAX 1000
+
+/** System disk wait schedule */
+typedef struct _WAIT_SCHEDULE {
+	/** Initial delay between checks, in milliseconds */
+	ULONG initial_delay;
+	/** Growth of delay between checks, in percent */
+	ULONG growth;
+	/** Maximum delay between checks, in milliseconds */
+	ULONG max_delay;
+	/** Maximum total time to wait, in milliseconds */
+	ULONG deadline;
+	/** Delay before next check, in milliseconds */
+	ULONG delay;
+	/** Time at which waiting started, in milliseconds */
+	ULONGLONG started;
+	/** Time elapsed since waiting started, in milliseconds */
+	ULONGLONG elapsed;
+	/** Number of checks made */
+	ULONG attempts;
+	/** Number of disks probed */
+	ULONG probes;
+} WAIT_SCHEDULE, *PWAIT_SCHEDULE;
+
+extern VOID wait_start ( PWAIT_SCHEDULE wait, ULONGLONG now );
+extern VOID wait_check ( PWAIT_SCHEDULE wait, ULONGLONG now );
+extern BOOLEAN wait_next ( PWAIT_SCHEDULE wait, PULONG delay );
+
+#endif /* _WAIT_H */
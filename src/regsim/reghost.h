@@ -0,0 +1,385 @@
+#ifndef _REGHOST_H
+#define _REGHOST_H
+
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * Host definitions for building the registry access layer
+ *
+ * These stand in for the <ntddk.h> and <ntstrsafe.h> definitions used
+ * by registry.c and registry.h, so that the registry access layer can
+ * be built as a user-mode program.  Wide strings must be 16-bit, as
+ * on Windows, so the program must be built with -fshort-wchar.
+ *
+ * The native registry routines are stubs that always fail; the
+ * in-memory backend must be selected via reg_set_backend().  Kernel
+ * transactions are reported as unavailable.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** Wide characters must match the Windows definition */
+typedef char reghost_wchar_check[ ( sizeof ( wchar_t ) == 2 ) ? 1 : -1 ];
+
+#define VOID void
+#define NTAPI
+typedef uint8_t BOOLEAN, *PBOOLEAN;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef size_t SIZE_T;
+typedef void *PVOID, *HANDLE, **PHANDLE;
+typedef wchar_t WCHAR, *PWCHAR, *PWSTR, *LPWSTR;
+typedef const wchar_t *LPCWSTR;
+typedef int32_t NTSTATUS;
+typedef uint32_t ACCESS_MASK;
+
+typedef struct _GUID {
+	uint32_t Data1;
+	uint16_t Data2;
+	uint16_t Data3;
+	uint8_t Data4[8];
+} GUID, *LPGUID;
+
+typedef union _LARGE_INTEGER {
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _UNICODE_STRING {
+	USHORT Length;
+	USHORT MaximumLength;
+	PWSTR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef struct _OBJECT_ATTRIBUTES {
+	ULONG Length;
+	HANDLE RootDirectory;
+	PUNICODE_STRING ObjectName;
+	ULONG Attributes;
+	PVOID SecurityDescriptor;
+	PVOID SecurityQualityOfService;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+typedef struct _KEY_VALUE_PARTIAL_INFORMATION {
+	ULONG TitleIndex;
+	ULONG Type;
+	ULONG DataLength;
+	UCHAR Data[1];
+} KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
+
+typedef struct _KEY_BASIC_INFORMATION {
+	LARGE_INTEGER LastWriteTime;
+	ULONG TitleIndex;
+	ULONG NameLength;
+	WCHAR Name[1];
+} KEY_BASIC_INFORMATION, *PKEY_BASIC_INFORMATION;
+
+typedef NTSTATUS ( RTL_QUERY_REGISTRY_ROUTINE ) ( PWSTR value_name,
+						  ULONG value_type,
+						  PVOID value_data,
+						  ULONG value_len,
+						  PVOID context,
+						  PVOID entry_context );
+typedef RTL_QUERY_REGISTRY_ROUTINE *PRTL_QUERY_REGISTRY_ROUTINE;
+
+typedef struct _RTL_QUERY_REGISTRY_TABLE {
+	PRTL_QUERY_REGISTRY_ROUTINE QueryRoutine;
+	ULONG Flags;
+	PWSTR Name;
+	PVOID EntryContext;
+	ULONG DefaultType;
+	PVOID DefaultData;
+	ULONG DefaultLength;
+} RTL_QUERY_REGISTRY_TABLE, *PRTL_QUERY_REGISTRY_TABLE;
+
+#define TRUE 1
+#define FALSE 0
+
+#define NT_SUCCESS( status ) ( ( ( NTSTATUS ) (status) ) >= 0 )
+#define STATUS_SUCCESS ( ( NTSTATUS ) 0x00000000L )
+#define STATUS_BUFFER_OVERFLOW ( ( NTSTATUS ) 0x80000005L )
+#define STATUS_NO_MORE_ENTRIES ( ( NTSTATUS ) 0x8000001aL )
+#define STATUS_UNSUCCESSFUL ( ( NTSTATUS ) 0xc0000001L )
+#define STATUS_NOT_IMPLEMENTED ( ( NTSTATUS ) 0xc0000002L )
+#define STATUS_INVALID_PARAMETER ( ( NTSTATUS ) 0xc000000dL )
+#define STATUS_NO_MEMORY ( ( NTSTATUS ) 0xc0000017L )
+#define STATUS_BUFFER_TOO_SMALL ( ( NTSTATUS ) 0xc0000023L )
+#define STATUS_OBJECT_NAME_NOT_FOUND ( ( NTSTATUS ) 0xc0000034L )
+#define STATUS_NAME_TOO_LONG ( ( NTSTATUS ) 0xc0000106L )
+#define STATUS_NOT_FOUND ( ( NTSTATUS ) 0xc0000225L )
+
+#define REG_NONE 0
+#define REG_SZ 1
+#define REG_BINARY 3
+#define REG_DWORD 4
+#define REG_MULTI_SZ 7
+
+#define RTL_QUERY_REGISTRY_REQUIRED 0x00000004
+#define RTL_REGISTRY_ABSOLUTE 0
+
+#define GENERIC_ALL 0x10000000L
+#define KEY_ALL_ACCESS 0x000f003fL
+#define OBJ_CASE_INSENSITIVE 0x00000040L
+#define OBJ_KERNEL_HANDLE 0x00000200L
+#define UNICODE_STRING_MAX_BYTES ( ( USHORT ) 65534 )
+
+#define NonPagedPool 0
+#define KeyBasicInformation 0
+#define KeyValuePartialInformation 2
+#define DPFLTR_IHVDRIVER_ID 77
+#define DPFLTR_ERROR_LEVEL 0
+
+#define FIELD_OFFSET( type, field ) ( ( LONG ) offsetof ( type, field ) )
+#define RTL_CONSTANT_STRING( s ) \
+	{ ( sizeof ( s ) - sizeof ( (s)[0] ) ), sizeof ( s ), (s) }
+
+#define RtlZeroMemory( dest, len ) memset ( (dest), 0, (len) )
+#define RtlCopyMemory( dest, src, len ) memcpy ( (dest), (src), (len) )
+#define ExAllocatePoolWithTag( type, len, tag ) malloc ( len )
+#define ExFreePool( ptr ) free ( ptr )
+
+#define InitializeObjectAttributes( attrs, name, attributes, root, sd ) do { \
+	(attrs)->Length = sizeof ( *(attrs) );				     \
+	(attrs)->RootDirectory = (root);				     \
+	(attrs)->ObjectName = (name);					     \
+	(attrs)->Attributes = (attributes);				     \
+	(attrs)->SecurityDescriptor = (sd);				     \
+	(attrs)->SecurityQualityOfService = NULL;			     \
+	} while ( 0 )
+
+
+/** Debug messages are discarded */
+static inline ULONG DbgPrintEx ( ULONG component, ULONG level,
+				 const char *fmt, ... ) {
+	( VOID ) component;
+	( VOID ) level;
+	( VOID ) fmt;
+	return 0;
+}
+
+static inline LONG InterlockedIncrement ( PLONG ptr ) {
+	return __sync_add_and_fetch ( ptr, 1 );
+}
+
+static inline LONG InterlockedExchangeAdd ( PLONG ptr, LONG value ) {
+	return __sync_fetch_and_add ( ptr, value );
+}
+
+static inline PVOID InterlockedCompareExchangePointer ( PVOID *ptr,
+							PVOID value,
+							PVOID compare ) {
+	return __sync_val_compare_and_swap ( ptr, compare, value );
+}
+
+static inline PVOID InterlockedExchangePointer ( PVOID *ptr, PVOID value ) {
+	return __sync_lock_test_and_set ( ptr, value );
+}
+
+static inline LARGE_INTEGER KeQueryPerformanceCounter ( PLARGE_INTEGER freq ) {
+	LARGE_INTEGER now;
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	now.QuadPart = ( ( ( ( LONGLONG ) ts.tv_sec ) * 1000000000LL ) +
+			 ts.tv_nsec );
+	if ( freq )
+		freq->QuadPart = 1000000000LL;
+	return now;
+}
+
+static inline PVOID MmGetSystemRoutineAddress ( PUNICODE_STRING name ) {
+	( VOID ) name;
+	return NULL;
+}
+
+static inline SIZE_T reghost_wcslen ( LPCWSTR string ) {
+	SIZE_T len = 0;
+
+	while ( string[len] )
+		len++;
+	return len;
+}
+#define wcslen reghost_wcslen
+
+static inline WCHAR reghost_towlower ( WCHAR c ) {
+	return ( ( ( c >= L'A' ) && ( c <= L'Z' ) ) ? ( c - L'A' + L'a' ) : c );
+}
+
+static inline int reghost_wcsnicmp ( LPCWSTR a, LPCWSTR b, SIZE_T len ) {
+	WCHAR ca;
+	WCHAR cb;
+
+	for ( ; len-- ; a++, b++ ) {
+		ca = reghost_towlower ( *a );
+		cb = reghost_towlower ( *b );
+		if ( ca != cb )
+			return ( ( ca < cb ) ? -1 : 1 );
+		if ( ! ca )
+			break;
+	}
+	return 0;
+}
+#define _wcsnicmp reghost_wcsnicmp
+
+static inline SIZE_T RtlCompareMemory ( const VOID *a, const VOID *b,
+					SIZE_T len ) {
+	const UCHAR *bytes_a = a;
+	const UCHAR *bytes_b = b;
+	SIZE_T i;
+
+	for ( i = 0 ; ( i < len ) && ( bytes_a[i] == bytes_b[i] ) ; i++ )
+		;
+	return i;
+}
+
+static inline VOID RtlInitUnicodeString ( PUNICODE_STRING string,
+					  LPCWSTR source ) {
+	SIZE_T len = ( source ? ( wcslen ( source ) * sizeof ( WCHAR ) ) : 0 );
+
+	string->Length = ( ( USHORT ) len );
+	string->MaximumLength =
+		( ( USHORT ) ( source ? ( len + sizeof ( WCHAR ) ) : 0 ) );
+	string->Buffer = ( ( PWSTR ) source );
+}
+
+static inline VOID RtlInitEmptyUnicodeString ( PUNICODE_STRING string,
+					       PWCHAR buf, USHORT len ) {
+	string->Length = 0;
+	string->MaximumLength = len;
+	string->Buffer = buf;
+}
+
+static inline VOID RtlCopyUnicodeString ( PUNICODE_STRING dest,
+					  PUNICODE_STRING src ) {
+	USHORT len = src->Length;
+
+	if ( len > dest->MaximumLength )
+		len = dest->MaximumLength;
+	memcpy ( dest->Buffer, src->Buffer, len );
+	dest->Length = len;
+	if ( dest->Length < dest->MaximumLength )
+		dest->Buffer[ len / sizeof ( WCHAR ) ] = 0;
+}
+
+static inline NTSTATUS RtlUnicodeStringCatString ( PUNICODE_STRING dest,
+						   LPCWSTR src ) {
+	SIZE_T len = ( wcslen ( src ) * sizeof ( WCHAR ) );
+
+	if ( ( dest->Length + len ) > dest->MaximumLength )
+		return STATUS_BUFFER_OVERFLOW;
+	memcpy ( ( ( PUCHAR ) dest->Buffer ) + dest->Length, src, len );
+	dest->Length = ( ( USHORT ) ( dest->Length + len ) );
+	if ( dest->Length < dest->MaximumLength )
+		dest->Buffer[ dest->Length / sizeof ( WCHAR ) ] = 0;
+	return STATUS_SUCCESS;
+}
+
+static inline NTSTATUS RtlStringCbCatW ( LPWSTR dest, SIZE_T len,
+					 LPCWSTR src ) {
+	SIZE_T dest_len = wcslen ( dest );
+	SIZE_T src_len = wcslen ( src );
+
+	if ( ( ( dest_len + src_len + 1 ) * sizeof ( WCHAR ) ) > len )
+		return STATUS_BUFFER_OVERFLOW;
+	memcpy ( &dest[dest_len], src, ( ( src_len + 1 ) * sizeof ( WCHAR ) ) );
+	return STATUS_SUCCESS;
+}
+
+/* Native registry routines are unavailable on the host */
+
+static inline NTSTATUS ZwOpenKey ( PHANDLE reg_key, ACCESS_MASK access,
+				   POBJECT_ATTRIBUTES attrs ) {
+	( VOID ) reg_key;
+	( VOID ) access;
+	( VOID ) attrs;
+	return STATUS_NOT_IMPLEMENTED;
+}
+
+static inline NTSTATUS ZwClose ( HANDLE handle ) {
+	( VOID ) handle;
+	return STATUS_NOT_IMPLEMENTED;
+}
+
+static inline NTSTATUS ZwQueryValueKey ( HANDLE reg_key,
+					 PUNICODE_STRING value_name,
+					 ULONG class, PVOID info, ULONG len,
+					 PULONG result_len ) {
+	( VOID ) reg_key;
+	( VOID ) value_name;
+	( VOID ) class;
+	( VOID ) info;
+	( VOID ) len;
+	( VOID ) result_len;
+	return STATUS_NOT_IMPLEMENTED;
+}
+
+static inline NTSTATUS ZwSetValueKey ( HANDLE reg_key,
+				       PUNICODE_STRING value_name,
+				       ULONG title_index, ULONG type,
+				       PVOID data, ULONG len ) {
+	( VOID ) reg_key;
+	( VOID ) value_name;
+	( VOID ) title_index;
+	( VOID ) type;
+	( VOID ) data;
+	( VOID ) len;
+	return STATUS_NOT_IMPLEMENTED;
+}
+
+static inline NTSTATUS ZwFlushKey ( HANDLE reg_key ) {
+	( VOID ) reg_key;
+	return STATUS_NOT_IMPLEMENTED;
+}
+
+static inline NTSTATUS ZwEnumerateKey ( HANDLE reg_key, ULONG index,
+					ULONG class, PVOID info, ULONG len,
+					PULONG result_len ) {
+	( VOID ) reg_key;
+	( VOID ) index;
+	( VOID ) class;
+	( VOID ) info;
+	( VOID ) len;
+	( VOID ) result_len;
+	return STATUS_NOT_IMPLEMENTED;
+}
+
+static inline NTSTATUS RtlQueryRegistryValues ( ULONG relative_to,
+						PWSTR path,
+						PRTL_QUERY_REGISTRY_TABLE table,
+						PVOID context,
+						PVOID environment ) {
+	( VOID ) relative_to;
+	( VOID ) path;
+	( VOID ) table;
+	( VOID ) context;
+	( VOID ) environment;
+	return STATUS_NOT_IMPLEMENTED;
+}
+
+#endif /* _REGHOST_H */
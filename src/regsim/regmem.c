@@ -0,0 +1,635 @@
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * In-memory registry backend
+ *
+ * The hive is held as a tree of keys, each with a list of values, and
+ * is preloaded from a text fixture of the form
+ *
+ *   # Comment
+ *   [\Registry\Machine\SYSTEM\CurrentControlSet\Control]
+ *   SystemStartOptions = sz:" NOEXECUTE=OPTIN"
+ *   [\Registry\Machine\...\Interfaces\{guid}]
+ *   EnableDHCP = dword:1
+ *   IPAddress = multi_sz:"0.0.0.0","10.0.0.1"
+ *   Signature = binary:de,ad,be,ef
+ *
+ * Keys are created along with any missing parent keys.  A key handle
+ * is simply a pointer to the key.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include "reghost.h"
+#include "registry.h"
+#include "regmem.h"
+
+/** Maximum length of a fixture line */
+#define REGMEM_LINE_LEN 1024
+
+/** An in-memory registry value */
+typedef struct _REGMEM_VALUE {
+	/** Next value within key */
+	struct _REGMEM_VALUE *next;
+	/** Name */
+	PWSTR name;
+	/** Type */
+	ULONG type;
+	/** Length of data */
+	ULONG len;
+	/** Data */
+	PUCHAR data;
+} REGMEM_VALUE, *PREGMEM_VALUE;
+
+/** An in-memory registry key */
+typedef struct _REGMEM_KEY {
+	/** Next sibling key */
+	struct _REGMEM_KEY *next;
+	/** First subkey */
+	struct _REGMEM_KEY *children;
+	/** First value */
+	PREGMEM_VALUE values;
+	/** Name */
+	PWSTR name;
+} REGMEM_KEY, *PREGMEM_KEY;
+
+/** Root of in-memory hive */
+static REGMEM_KEY regmem_root;
+
+/** In-memory registry operation counters */
+REGMEM_STATS regmem_stats;
+
+/**
+ * Duplicate counted wide string
+ *
+ * @v string		String
+ * @v len		Length of string, in characters
+ * @ret copy		NUL-terminated copy, or NULL
+ */
+static PWSTR regmem_wstrndup ( const WCHAR *string, SIZE_T len ) {
+	PWSTR copy;
+
+	copy = malloc ( ( len + 1 ) * sizeof ( copy[0] ) );
+	if ( ! copy )
+		return NULL;
+	memcpy ( copy, string, ( len * sizeof ( copy[0] ) ) );
+	copy[len] = 0;
+	return copy;
+}
+
+/**
+ * Find subkey
+ *
+ * @v key		Parent key
+ * @v name		Subkey name
+ * @v len		Length of subkey name, in characters
+ * @v create		Create subkey if it does not exist
+ * @ret subkey		Subkey, or NULL
+ */
+static PREGMEM_KEY regmem_find_subkey ( PREGMEM_KEY key, const WCHAR *name,
+					SIZE_T len, BOOLEAN create ) {
+	PREGMEM_KEY subkey;
+	PREGMEM_KEY *link;
+
+	for ( link = &key->children ; ( subkey = *link ) != NULL ;
+	      link = &subkey->next ) {
+		if ( ( wcslen ( subkey->name ) == len ) &&
+		     ( _wcsnicmp ( subkey->name, name, len ) == 0 ) )
+			return subkey;
+	}
+	if ( ! create )
+		return NULL;
+	subkey = calloc ( 1, sizeof ( *subkey ) );
+	if ( ! subkey )
+		return NULL;
+	subkey->name = regmem_wstrndup ( name, len );
+	if ( ! subkey->name ) {
+		free ( subkey );
+		return NULL;
+	}
+	*link = subkey;
+	return subkey;
+}
+
+/**
+ * Find key by name
+ *
+ * @v key		Key from which to start, or NULL for the root
+ * @v name		Key name
+ * @v len		Length of key name, in characters
+ * @v create		Create missing keys
+ * @ret key		Key, or NULL
+ */
+static PREGMEM_KEY regmem_find_key ( PREGMEM_KEY key, const WCHAR *name,
+				     SIZE_T len, BOOLEAN create ) {
+	const WCHAR *end = ( name + len );
+	const WCHAR *part;
+
+	if ( ! key )
+		key = &regmem_root;
+	while ( key && ( name < end ) ) {
+		if ( *name == L'\\' ) {
+			name++;
+			continue;
+		}
+		for ( part = name ; ( name < end ) && ( *name != L'\\' ) ;
+		      name++ )
+			;
+		key = regmem_find_subkey ( key, part,
+					   ( ( SIZE_T ) ( name - part ) ),
+					   create );
+	}
+	return key;
+}
+
+/**
+ * Find value
+ *
+ * @v key		Key
+ * @v name		Value name
+ * @v len		Length of value name, in characters
+ * @ret value		Value, or NULL
+ */
+static PREGMEM_VALUE regmem_find_value ( PREGMEM_KEY key, const WCHAR *name,
+					 SIZE_T len ) {
+	PREGMEM_VALUE value;
+
+	for ( value = key->values ; value ; value = value->next ) {
+		if ( ( wcslen ( value->name ) == len ) &&
+		     ( _wcsnicmp ( value->name, name, len ) == 0 ) )
+			return value;
+	}
+	return NULL;
+}
+
+/**
+ * Set value
+ *
+ * @v key		Key
+ * @v name		Value name
+ * @v len		Length of value name, in characters
+ * @v type		Value type
+ * @v data		Value data
+ * @v data_len		Length of value data
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regmem_set ( PREGMEM_KEY key, const WCHAR *name, SIZE_T len,
+			     ULONG type, const VOID *data, ULONG data_len ) {
+	PREGMEM_VALUE value;
+	PUCHAR copy;
+
+	copy = malloc ( data_len ? data_len : 1 );
+	if ( ! copy )
+		return STATUS_NO_MEMORY;
+	memcpy ( copy, data, data_len );
+
+	value = regmem_find_value ( key, name, len );
+	if ( ! value ) {
+		value = calloc ( 1, sizeof ( *value ) );
+		if ( ! value )
+			goto err_alloc_value;
+		value->name = regmem_wstrndup ( name, len );
+		if ( ! value->name )
+			goto err_alloc_name;
+		value->next = key->values;
+		key->values = value;
+	}
+	free ( value->data );
+	value->type = type;
+	value->len = data_len;
+	value->data = copy;
+	return STATUS_SUCCESS;
+
+ err_alloc_name:
+	free ( value );
+ err_alloc_value:
+	free ( copy );
+	return STATUS_NO_MEMORY;
+}
+
+/**
+ * Open key
+ *
+ * @v reg_key		Registry key to fill in
+ * @v parent		Parent key, or NULL for an absolute name
+ * @v key_name		Registry key name
+ * @v transaction	Kernel transaction, or NULL
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regmem_open_key ( PHANDLE reg_key, HANDLE parent,
+				  PUNICODE_STRING key_name,
+				  HANDLE transaction ) {
+	PREGMEM_KEY key;
+
+	if ( transaction )
+		return STATUS_NOT_IMPLEMENTED;
+	key = regmem_find_key ( parent, key_name->Buffer,
+				( key_name->Length / sizeof ( WCHAR ) ),
+				FALSE );
+	if ( ! key )
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	regmem_stats.open_keys++;
+	*reg_key = key;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Close key
+ *
+ * @v reg_key		Registry key
+ */
+static VOID regmem_close_key ( HANDLE reg_key ) {
+
+	( VOID ) reg_key;
+	regmem_stats.open_keys--;
+}
+
+/**
+ * Query value
+ *
+ * @v reg_key		Registry key
+ * @v value_name	Registry value name
+ * @v kvi		Key value information block to fill in
+ * @v len		Length of key value information block
+ * @v result_len	Required length to fill in
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regmem_query_value ( HANDLE reg_key,
+				     PUNICODE_STRING value_name,
+				     PKEY_VALUE_PARTIAL_INFORMATION kvi,
+				     ULONG len, PULONG result_len ) {
+	ULONG header_len = FIELD_OFFSET ( KEY_VALUE_PARTIAL_INFORMATION, Data );
+	PREGMEM_VALUE value;
+	ULONG copy_len;
+
+	value = regmem_find_value ( reg_key, value_name->Buffer,
+				    ( value_name->Length / sizeof ( WCHAR ) ) );
+	if ( ! value )
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	*result_len = ( header_len + value->len );
+	if ( len < header_len )
+		return STATUS_BUFFER_TOO_SMALL;
+	kvi->TitleIndex = 0;
+	kvi->Type = value->type;
+	kvi->DataLength = value->len;
+	copy_len = ( len - header_len );
+	if ( copy_len > value->len )
+		copy_len = value->len;
+	memcpy ( kvi->Data, value->data, copy_len );
+	return ( ( copy_len < value->len ) ?
+		 STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS );
+}
+
+/**
+ * Set value
+ *
+ * @v reg_key		Registry key
+ * @v value_name	Registry value name
+ * @v type		Registry value type
+ * @v data		Value data
+ * @v len		Length of value data
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regmem_set_value ( HANDLE reg_key, PUNICODE_STRING value_name,
+				   ULONG type, PVOID data, ULONG len ) {
+	NTSTATUS status;
+
+	status = regmem_set ( reg_key, value_name->Buffer,
+			      ( value_name->Length / sizeof ( WCHAR ) ),
+			      type, data, len );
+	if ( NT_SUCCESS ( status ) )
+		regmem_stats.sets++;
+	return status;
+}
+
+/**
+ * Flush key
+ *
+ * @v reg_key		Registry key
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regmem_flush_key ( HANDLE reg_key ) {
+
+	( VOID ) reg_key;
+	regmem_stats.flushes++;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Enumerate subkey
+ *
+ * @v reg_key		Registry key
+ * @v index		Subkey index
+ * @v kbi		Key basic information block to fill in
+ * @v len		Length of key basic information block
+ * @v result_len	Required length to fill in
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regmem_enum_key ( HANDLE reg_key, ULONG index,
+				  PKEY_BASIC_INFORMATION kbi, ULONG len,
+				  PULONG result_len ) {
+	ULONG header_len = FIELD_OFFSET ( KEY_BASIC_INFORMATION, Name );
+	PREGMEM_KEY key = reg_key;
+	PREGMEM_KEY subkey;
+	ULONG name_len;
+	ULONG copy_len;
+
+	for ( subkey = key->children ; subkey && index ; index-- )
+		subkey = subkey->next;
+	if ( ! subkey )
+		return STATUS_NO_MORE_ENTRIES;
+	name_len = ( ( ULONG ) ( wcslen ( subkey->name ) * sizeof ( WCHAR ) ) );
+	*result_len = ( header_len + name_len );
+	if ( len < header_len )
+		return STATUS_BUFFER_TOO_SMALL;
+	kbi->LastWriteTime.QuadPart = 0;
+	kbi->TitleIndex = 0;
+	kbi->NameLength = name_len;
+	copy_len = ( len - header_len );
+	if ( copy_len > name_len )
+		copy_len = name_len;
+	memcpy ( kbi->Name, subkey->name, copy_len );
+	return ( ( copy_len < name_len ) ?
+		 STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS );
+}
+
+/**
+ * Query values via query table
+ *
+ * @v key_name		Absolute registry key name
+ * @v table		Query table
+ * @v context		Context passed to query routines
+ * @ret ntstatus	NT status
+ *
+ * Only query routines are supported; direct queries are not.
+ */
+static NTSTATUS regmem_query_table ( PWSTR key_name,
+				     PRTL_QUERY_REGISTRY_TABLE table,
+				     PVOID context ) {
+	PRTL_QUERY_REGISTRY_TABLE entry;
+	PREGMEM_KEY key;
+	PREGMEM_VALUE value;
+	NTSTATUS status;
+
+	key = regmem_find_key ( NULL, key_name, wcslen ( key_name ), FALSE );
+	if ( ! key )
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	for ( entry = table ; entry->QueryRoutine || entry->Name ; entry++ ) {
+		if ( ! ( entry->QueryRoutine && entry->Name ) )
+			return STATUS_INVALID_PARAMETER;
+		value = regmem_find_value ( key, entry->Name,
+					    wcslen ( entry->Name ) );
+		if ( value ) {
+			status = entry->QueryRoutine ( entry->Name, value->type,
+						       value->data, value->len,
+						       context,
+						       entry->EntryContext );
+		} else if ( entry->Flags & RTL_QUERY_REGISTRY_REQUIRED ) {
+			status = STATUS_OBJECT_NAME_NOT_FOUND;
+		} else if ( entry->DefaultType != REG_NONE ) {
+			status = entry->QueryRoutine ( entry->Name,
+						       entry->DefaultType,
+						       entry->DefaultData,
+						       entry->DefaultLength,
+						       context,
+						       entry->EntryContext );
+		} else {
+			status = STATUS_SUCCESS;
+		}
+		if ( ! NT_SUCCESS ( status ) )
+			return status;
+	}
+	return STATUS_SUCCESS;
+}
+
+/** In-memory registry backend */
+REG_BACKEND regmem_backend = {
+	"in-memory",
+	regmem_open_key,
+	regmem_close_key,
+	regmem_query_value,
+	regmem_set_value,
+	regmem_flush_key,
+	regmem_enum_key,
+	regmem_query_table,
+};
+
+/**
+ * Widen fixture text
+ *
+ * @v text		Text
+ * @v len		Length of text
+ * @v wide		Buffer for wide text (at least len characters)
+ */
+static VOID regmem_widen ( const char *text, SIZE_T len, PWCHAR wide ) {
+
+	while ( len-- )
+		*(wide++) = ( ( UCHAR ) *(text++) );
+}
+
+/**
+ * Parse fixture value data
+ *
+ * @v text		Value data text (type:data)
+ * @v type		Value type to fill in
+ * @v data		Buffer for value data
+ * @v len		Length of value data buffer; filled in on return
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regmem_parse_data ( const char *text, PULONG type,
+				    PUCHAR data, PULONG len ) {
+	PWCHAR wide = ( ( PWCHAR ) data );
+	ULONG max_len = *len;
+	ULONG dword;
+	SIZE_T used = 0;
+	const char *end;
+	char *next;
+
+	if ( strncmp ( text, "dword:", 6 ) == 0 ) {
+		*type = REG_DWORD;
+		dword = strtoul ( ( text + 6 ), &next, 0 );
+		if ( *next || ( max_len < sizeof ( dword ) ) )
+			return STATUS_INVALID_PARAMETER;
+		memcpy ( data, &dword, sizeof ( dword ) );
+		*len = sizeof ( dword );
+	} else if ( strncmp ( text, "binary:", 7 ) == 0 ) {
+		*type = REG_BINARY;
+		for ( text += 7 ; *text ; text = ( next + ( *next == ',' ) ) ) {
+			if ( used == max_len )
+				return STATUS_INVALID_PARAMETER;
+			data[used++] = ( ( UCHAR ) strtoul ( text, &next,
+							     16 ) );
+			if ( ( next == text ) || ( *next && ( *next != ',' ) ) )
+				return STATUS_INVALID_PARAMETER;
+		}
+		*len = ( ( ULONG ) used );
+	} else if ( ( strncmp ( text, "sz:", 3 ) == 0 ) ||
+		    ( strncmp ( text, "multi_sz:", 9 ) == 0 ) ) {
+		*type = ( ( text[0] == 's' ) ? REG_SZ : REG_MULTI_SZ );
+		text = ( strchr ( text, ':' ) + 1 );
+		while ( *text ) {
+			if ( *(text++) != '"' )
+				return STATUS_INVALID_PARAMETER;
+			end = strchr ( text, '"' );
+			if ( ! end )
+				return STATUS_INVALID_PARAMETER;
+			if ( ( ( used + ( end - text ) + 2 ) *
+			       sizeof ( wide[0] ) ) > max_len )
+				return STATUS_INVALID_PARAMETER;
+			regmem_widen ( text, ( end - text ), &wide[used] );
+			used += ( end - text );
+			wide[used++] = 0;
+			text = ( end + 1 );
+			if ( *text == ',' && ( *type == REG_MULTI_SZ ) )
+				text++;
+			else if ( *text )
+				return STATUS_INVALID_PARAMETER;
+		}
+		if ( *type == REG_MULTI_SZ )
+			wide[used++] = 0;
+		*len = ( ( ULONG ) ( used * sizeof ( wide[0] ) ) );
+	} else {
+		return STATUS_INVALID_PARAMETER;
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Trim whitespace from fixture text
+ *
+ * @v text		Text
+ * @ret text		Trimmed text
+ */
+static char * regmem_trim ( char *text ) {
+	char *end;
+
+	while ( isspace ( ( unsigned char ) *text ) )
+		text++;
+	end = ( text + strlen ( text ) );
+	while ( ( end > text ) && isspace ( ( unsigned char ) end[-1] ) )
+		*(--end) = '\0';
+	return text;
+}
+
+/**
+ * Load in-memory hive from text fixture
+ *
+ * @v filename		Fixture filename
+ * @ret ntstatus	NT status
+ */
+NTSTATUS regmem_load ( const char *filename ) {
+	char buf[REGMEM_LINE_LEN];
+	WCHAR name[REGMEM_LINE_LEN];
+	UCHAR data[ REGMEM_LINE_LEN * sizeof ( WCHAR ) ];
+	PREGMEM_KEY key = NULL;
+	FILE *file;
+	char *line;
+	char *sep;
+	ULONG type;
+	ULONG len;
+	unsigned int line_num = 0;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	file = fopen ( filename, "r" );
+	if ( ! file ) {
+		fprintf ( stderr, "Could not open %s\n", filename );
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+
+	while ( fgets ( buf, sizeof ( buf ), file ) ) {
+		line_num++;
+		line = regmem_trim ( buf );
+		if ( ( ! *line ) || ( *line == '#' ) )
+			continue;
+		if ( *line == '[' ) {
+			/* Key */
+			sep = strchr ( line, ']' );
+			if ( ! sep )
+				goto err_syntax;
+			line++;
+			regmem_widen ( line, ( sep - line ), name );
+			key = regmem_find_key ( NULL, name, ( sep - line ),
+						TRUE );
+			if ( ! key ) {
+				status = STATUS_NO_MEMORY;
+				goto err_key;
+			}
+		} else {
+			/* Value */
+			sep = strchr ( line, '=' );
+			if ( ! ( key && sep ) )
+				goto err_syntax;
+			*sep = '\0';
+			line = regmem_trim ( line );
+			len = sizeof ( data );
+			status = regmem_parse_data ( regmem_trim ( sep + 1 ),
+						     &type, data, &len );
+			if ( ! NT_SUCCESS ( status ) )
+				goto err_syntax;
+			regmem_widen ( line, strlen ( line ), name );
+			status = regmem_set ( key, name, strlen ( line ),
+					      type, data, len );
+			if ( ! NT_SUCCESS ( status ) )
+				goto err_set;
+		}
+	}
+
+	fclose ( file );
+	return STATUS_SUCCESS;
+
+ err_syntax:
+	fprintf ( stderr, "%s:%d: syntax error\n", filename, line_num );
+	status = STATUS_INVALID_PARAMETER;
+ err_set:
+ err_key:
+	fclose ( file );
+	return status;
+}
+
+/**
+ * Free in-memory key contents
+ *
+ * @v key		Key
+ */
+static VOID regmem_free_key ( PREGMEM_KEY key ) {
+	PREGMEM_KEY subkey;
+	PREGMEM_VALUE value;
+
+	while ( ( subkey = key->children ) != NULL ) {
+		key->children = subkey->next;
+		regmem_free_key ( subkey );
+		free ( subkey->name );
+		free ( subkey );
+	}
+	while ( ( value = key->values ) != NULL ) {
+		key->values = value->next;
+		free ( value->data );
+		free ( value->name );
+		free ( value );
+	}
+}
+
+/**
+ * Free in-memory hive
+ *
+ */
+VOID regmem_free ( VOID ) {
+	regmem_free_key ( &regmem_root );
+}
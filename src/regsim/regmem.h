@@ -0,0 +1,44 @@
+#ifndef _REGMEM_H
+#define _REGMEM_H
+
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * In-memory registry backend
+ *
+ */
+
+/** In-memory registry operation counters */
+typedef struct _REGMEM_STATS {
+	/** Number of keys currently open */
+	ULONG open_keys;
+	/** Number of values written */
+	ULONG sets;
+	/** Number of flushes */
+	ULONG flushes;
+} REGMEM_STATS, *PREGMEM_STATS;
+
+extern REG_BACKEND regmem_backend;
+extern REGMEM_STATS regmem_stats;
+
+extern NTSTATUS regmem_load ( const char *filename );
+extern VOID regmem_free ( VOID );
+
+#endif /* _REGMEM_H */
@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * Registry access harness
+ *
+ * This runs the driver's own registry access layer (registry.c)
+ * against the in-memory registry backend, preloaded from a text
+ * fixture.  It first checks the results of the reg_xxx() functions
+ * against the fixture, then measures the rate at which the registry
+ * accesses made by load_start_options(), load_parameters() and
+ * store_tcpip_parameters() can be repeated.  Those callers depend on
+ * many other kernel services and are not themselves built here; each
+ * is represented by the same sequence of reg_xxx() calls.
+ *
+ * This is a user-mode program, and is built on the host using e.g.
+ *
+ *   cc -fshort-wchar -DREG_HOST -I. -I../driver -o regsim \
+ *	regsim.c regmem.c ../driver/registry.c
+ *
+ * (The driver relies on zero-filled static initialisers, so
+ * -Wextra must be accompanied by -Wno-missing-field-initializers.)
+ *
+ * and run as
+ *
+ *   ./regsim regsim.reg [iterations]
+ */
+
+#include <stdio.h>
+#include "reghost.h"
+#include "registry.h"
+#include "regmem.h"
+
+/** Default number of benchmark iterations */
+#define REGSIM_ITERATIONS 100000
+
+/** Driver registry path */
+#define REGSIM_DRIVER_KEY \
+	L"\\Registry\\Machine\\SYSTEM\\CurrentControlSet\\Services\\" \
+	L"sanbootconf"
+
+/** TCP/IP interface within fixture */
+#define REGSIM_INTERFACE L"{0d8ab7f7-0e8c-4a3c-9a0e-4c1f6b3d8a01}"
+
+/** Number of TCP/IP interfaces within fixture */
+#define REGSIM_NUM_INTERFACES 2
+
+/** A driver parameter loaded by regsim_load_parameters() */
+typedef struct _REGSIM_PARAM {
+	/** Value */
+	ULONG value;
+	/** Number of times the value was loaded */
+	ULONG loaded;
+} REGSIM_PARAM, *PREGSIM_PARAM;
+
+/** Number of failed checks */
+static unsigned int regsim_failures;
+
+/**
+ * Check condition
+ *
+ * @v ok		Condition holds
+ * @v desc		Description of condition
+ */
+static VOID regsim_check ( int ok, const char *desc ) {
+
+	printf ( "%s: %s\n", ( ok ? "ok" : "FAIL" ), desc );
+	if ( ! ok )
+		regsim_failures++;
+}
+
+/**
+ * Check wide string
+ *
+ * @v string		String
+ * @v expected		Expected string
+ * @ret ok		String is as expected
+ */
+static int regsim_wcseq ( LPCWSTR string, LPCWSTR expected ) {
+
+	SIZE_T len = wcslen ( string );
+
+	return ( ( len == wcslen ( expected ) ) &&
+		 ( memcmp ( string, expected,
+			    ( len * sizeof ( string[0] ) ) ) == 0 ) );
+}
+
+/**
+ * Load system start options, as per load_start_options()
+ *
+ * @v options		System start options to fill in, or NULL
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regsim_load_start_options ( LPWSTR *options ) {
+	LPWSTR value;
+	HANDLE reg_key;
+	NTSTATUS status;
+
+	status = reg_open ( &reg_key, REG_SITE_LOAD_START_OPTIONS,
+			    L"\\Registry\\Machine\\SYSTEM\\"
+			    L"CurrentControlSet\\Control", NULL );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_open;
+	status = reg_fetch_sz ( reg_key, L"SystemStartOptions", &value );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_fetch_sz;
+	if ( options ) {
+		*options = value;
+	} else {
+		ExFreePool ( value );
+	}
+
+ err_reg_fetch_sz:
+	reg_close ( reg_key );
+ err_reg_open:
+	return status;
+}
+
+/**
+ * Load driver parameter, as per load_parameter()
+ *
+ * @v value_name	Registry value name
+ * @v value_type	Registry value type
+ * @v value_data	Registry value data
+ * @v value_len		Length of registry value data
+ * @v context		Context
+ * @v entry_context	Parameter
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regsim_load_parameter ( PWSTR value_name, ULONG value_type,
+					PVOID value_data, ULONG value_len,
+					PVOID context, PVOID entry_context ) {
+	PREGSIM_PARAM param = entry_context;
+
+	( VOID ) value_name;
+	( VOID ) context;
+	if ( ( value_type != REG_DWORD ) ||
+	     ( value_len != sizeof ( param->value ) ) )
+		return STATUS_SUCCESS;
+	memcpy ( &param->value, value_data, sizeof ( param->value ) );
+	param->loaded++;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * Load driver parameters, as per load_parameters()
+ *
+ * @v params		Parameters to fill in (BootText, WaitInitialDelay,
+ *			WaitGrowth, WaitDeadline)
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regsim_load_parameters ( PREGSIM_PARAM params ) {
+	static PWSTR names[] = {
+		L"BootText", L"WaitInitialDelay", L"WaitGrowth",
+		L"WaitDeadline",
+	};
+	RTL_QUERY_REGISTRY_TABLE table[ ( sizeof ( names ) /
+					  sizeof ( names[0] ) ) + 1 ];
+	ULONG i;
+
+	memset ( table, 0, sizeof ( table ) );
+	for ( i = 0 ; i < ( sizeof ( names ) / sizeof ( names[0] ) ) ; i++ ) {
+		table[i].QueryRoutine = regsim_load_parameter;
+		table[i].Name = names[i];
+		table[i].EntryContext = &params[i];
+	}
+	return reg_query_parameters ( table, NULL, REG_SITE_LOAD_PARAMETERS );
+}
+
+/**
+ * Store TCP/IP parameters, as per store_tcpip_parameters()
+ *
+ * @v ip_address	IP address
+ * @v writes		Number of values written to fill in, or NULL
+ * @ret ntstatus	NT status
+ */
+static NTSTATUS regsim_store_tcpip_parameters ( LPWSTR ip_address,
+						PULONG writes ) {
+	REG_BATCH batch;
+	HANDLE reg_key;
+	NTSTATUS status;
+
+	status = reg_batch_begin_tcpip_interface ( &batch, REGSIM_INTERFACE,
+						  REG_SITE_TCPIP_PARAMETERS );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_batch_begin;
+	reg_key = batch.reg_key;
+	status = reg_store_multi_sz ( reg_key, L"IPAddress", ip_address,
+				      NULL );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store;
+	status = reg_store_multi_sz ( reg_key, L"SubnetMask",
+				      L"255.255.255.0", NULL );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store;
+	status = reg_store_multi_sz ( reg_key, L"DefaultGateway", NULL );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store;
+	status = reg_store_sz ( reg_key, L"NameServer", L"10.0.0.2" );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store;
+	status = reg_store_dword ( reg_key, L"EnableDHCP", 0 );
+	if ( ! NT_SUCCESS ( status ) )
+		goto err_reg_store;
+	if ( writes )
+		*writes = batch.writes;
+	return reg_batch_commit ( &batch );
+
+ err_reg_store:
+	reg_batch_abort ( &batch );
+ err_reg_batch_begin:
+	return status;
+}
+
+/**
+ * Check registry access results against fixture
+ *
+ */
+static VOID regsim_check_fixture ( VOID ) {
+	REGSIM_PARAM params[4];
+	WCHAR long_value[300];
+	WCHAR name[64];
+	LPWSTR value;
+	LPWSTR *values;
+	HANDLE reg_key;
+	ULONG writes;
+	ULONG flushes;
+	ULONG sets;
+	ULONG dword;
+	ULONG i;
+	NTSTATUS status;
+
+	/* System start options */
+	status = regsim_load_start_options ( &value );
+	regsim_check ( NT_SUCCESS ( status ), "load start options" );
+	if ( NT_SUCCESS ( status ) ) {
+		regsim_check ( regsim_wcseq ( value, L" NOEXECUTE=OPTIN "
+					      L"NOGUIBOOT" ),
+			       "start options match fixture" );
+		ExFreePool ( value );
+	}
+
+	/* Driver parameters */
+	memset ( params, 0, sizeof ( params ) );
+	status = regsim_load_parameters ( params );
+	regsim_check ( NT_SUCCESS ( status ), "load parameters" );
+	regsim_check ( ( params[0].loaded == 1 ) && ( params[0].value == 0 ),
+		       "BootText is 0" );
+	regsim_check ( ( params[1].loaded == 1 ) && ( params[1].value == 50 ),
+		       "WaitInitialDelay is 50" );
+	regsim_check ( params[2].loaded == 0, "non-dword WaitGrowth ignored" );
+	regsim_check ( params[3].loaded == 0, "missing WaitDeadline ignored" );
+
+	/* TCP/IP parameters: first store changes values and flushes */
+	flushes = regmem_stats.flushes;
+	status = regsim_store_tcpip_parameters ( L"10.0.0.1", &writes );
+	regsim_check ( NT_SUCCESS ( status ), "store TCP/IP parameters" );
+	regsim_check ( writes == 5, "all TCP/IP values written" );
+	regsim_check ( regmem_stats.flushes == ( flushes + 1 ),
+		       "changed batch flushed once" );
+
+	/* TCP/IP parameters: identical store writes and flushes nothing */
+	flushes = regmem_stats.flushes;
+	sets = regmem_stats.sets;
+	status = regsim_store_tcpip_parameters ( L"10.0.0.1", &writes );
+	regsim_check ( NT_SUCCESS ( status ), "restore TCP/IP parameters" );
+	regsim_check ( ( writes == 0 ) && ( regmem_stats.sets == sets ),
+		       "identical TCP/IP values skipped" );
+	regsim_check ( regmem_stats.flushes == flushes,
+		       "unchanged batch not flushed" );
+
+	/* Stored values read back */
+	status = reg_open ( &reg_key, REG_SITE_OTHER,
+			    L"\\Registry\\Machine\\SYSTEM\\CurrentControlSet\\"
+			    L"Services\\Tcpip\\Parameters\\Interfaces",
+			    REGSIM_INTERFACE, NULL );
+	regsim_check ( NT_SUCCESS ( status ), "open TCP/IP interface" );
+	if ( NT_SUCCESS ( status ) ) {
+		status = reg_fetch_dword ( reg_key, L"EnableDHCP", &dword );
+		regsim_check ( ( NT_SUCCESS ( status ) && ( dword == 0 ) ),
+			       "EnableDHCP is 0" );
+		status = reg_fetch_multi_sz ( reg_key, L"IPAddress", &values );
+		regsim_check ( ( NT_SUCCESS ( status ) &&
+				 regsim_wcseq ( values[0], L"10.0.0.1" ) &&
+				 ( values[1] == NULL ) ),
+			       "IPAddress is 10.0.0.1" );
+		if ( NT_SUCCESS ( status ) )
+			ExFreePool ( values );
+
+		/* Values too long for the stack buffer */
+		for ( i = 0 ; i < ( ( sizeof ( long_value ) /
+				      sizeof ( long_value[0] ) ) - 1 ) ; i++ )
+			long_value[i] = ( L'a' + ( i % 26 ) );
+		long_value[i] = 0;
+		status = reg_store_sz ( reg_key, L"Long", long_value );
+		regsim_check ( NT_SUCCESS ( status ), "store long value" );
+		status = reg_fetch_sz ( reg_key, L"Long", &value );
+		regsim_check ( ( NT_SUCCESS ( status ) &&
+				 regsim_wcseq ( value, long_value ) ),
+			       "long value reads back" );
+		if ( NT_SUCCESS ( status ) )
+			ExFreePool ( value );
+		reg_close ( reg_key );
+	}
+
+	/* Subkey enumeration */
+	status = reg_open ( &reg_key, REG_SITE_OTHER,
+			    L"\\Registry\\Machine\\SYSTEM\\CurrentControlSet\\"
+			    L"Services\\Tcpip\\Parameters\\Interfaces", NULL );
+	regsim_check ( NT_SUCCESS ( status ), "open TCP/IP interfaces" );
+	if ( NT_SUCCESS ( status ) ) {
+		for ( i = 0 ; NT_SUCCESS ( reg_enum_subkey (
+				reg_key, i, name,
+				sizeof ( name ) ) ) ; i++ )
+			;
+		regsim_check ( i == REGSIM_NUM_INTERFACES,
+			       "all TCP/IP interfaces enumerated" );
+		regsim_check ( regsim_wcseq ( name, L"{5b1e7c2a-93f4-4d61-"
+					      L"8b2e-7a0c9e4f1d02}" ),
+			       "TCP/IP interfaces enumerated in order" );
+		reg_close ( reg_key );
+	}
+
+	/* Multiple-string additions */
+	status = reg_open ( &reg_key, REG_SITE_MPIO_PARAMETERS,
+			    L"\\Registry\\Machine\\SYSTEM\\CurrentControlSet\\"
+			    L"Services\\msdsm\\Parameters", NULL );
+	regsim_check ( NT_SUCCESS ( status ), "open msdsm parameters" );
+	if ( NT_SUCCESS ( status ) ) {
+		sets = regmem_stats.sets;
+		status = reg_add_multi_sz ( reg_key, L"DsmSupportedDeviceList",
+					    L"VENDOR8PRODUCT16" );
+		regsim_check ( ( NT_SUCCESS ( status ) &&
+				 ( regmem_stats.sets == sets ) ),
+			       "existing device not added again" );
+		status = reg_add_multi_sz ( reg_key, L"DsmSupportedDeviceList",
+					    L"MSFT2005iSCSIBusType_0x9" );
+		regsim_check ( NT_SUCCESS ( status ), "add device" );
+		status = reg_fetch_multi_sz ( reg_key,
+					      L"DsmSupportedDeviceList",
+					      &values );
+		regsim_check ( ( NT_SUCCESS ( status ) &&
+				 regsim_wcseq ( values[0],
+						L"Vendor8Product16" ) &&
+				 regsim_wcseq ( values[1],
+						L"MSFT2005iSCSIBusType_0x9" ) &&
+				 ( values[2] == NULL ) ),
+			       "device appended to list" );
+		if ( NT_SUCCESS ( status ) )
+			ExFreePool ( values );
+		reg_close ( reg_key );
+	}
+
+	/* Missing keys and values */
+	status = reg_open ( &reg_key, REG_SITE_OTHER,
+			    L"\\Registry\\Machine\\SYSTEM\\Missing", NULL );
+	regsim_check ( status == STATUS_OBJECT_NAME_NOT_FOUND,
+		       "missing key not found" );
+	status = reg_open_parameters ( &reg_key, REG_SITE_OTHER );
+	regsim_check ( NT_SUCCESS ( status ), "open parameters" );
+	if ( NT_SUCCESS ( status ) ) {
+		status = reg_fetch_dword ( reg_key, L"Missing", &dword );
+		regsim_check ( status == STATUS_OBJECT_NAME_NOT_FOUND,
+			       "missing value not found" );
+		reg_close ( reg_key );
+	}
+
+	/* Only the retained TCP/IP interfaces key remains open */
+	regsim_check ( regmem_stats.open_keys == 1, "no keys leaked" );
+}
+
+/**
+ * Get current time
+ *
+ * @ret now		Current time, in seconds
+ */
+static double regsim_now ( VOID ) {
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ( ts.tv_sec + ( ts.tv_nsec / 1e9 ) );
+}
+
+/**
+ * Report benchmark result
+ *
+ * @v name		Benchmark name
+ * @v iterations	Number of iterations
+ * @v started		Time at which benchmark started
+ */
+static VOID regsim_report ( const char *name, unsigned long iterations,
+			    double started ) {
+	double elapsed = ( regsim_now() - started );
+
+	printf ( "%-24s %10lu %12.0f/s %8.2fus\n", name, iterations,
+		 ( iterations / elapsed ), ( ( elapsed * 1e6 ) / iterations ) );
+}
+
+/**
+ * Measure registry access rates
+ *
+ * @v iterations	Number of iterations
+ */
+static VOID regsim_benchmark ( unsigned long iterations ) {
+	static PWSTR ip_addresses[] = { L"10.0.0.1", L"10.0.0.3" };
+	REGSIM_PARAM params[4];
+	unsigned long i;
+	double started;
+
+	printf ( "%-24s %10s %14s %10s\n", "benchmark", "iterations",
+		 "rate", "each" );
+
+	started = regsim_now();
+	for ( i = 0 ; i < iterations ; i++ )
+		regsim_load_start_options ( NULL );
+	regsim_report ( "load_start_options", iterations, started );
+
+	started = regsim_now();
+	for ( i = 0 ; i < iterations ; i++ )
+		regsim_load_parameters ( params );
+	regsim_report ( "load_parameters", iterations, started );
+
+	started = regsim_now();
+	for ( i = 0 ; i < iterations ; i++ )
+		regsim_store_tcpip_parameters ( ip_addresses[0], NULL );
+	regsim_report ( "store_tcpip (unchanged)", iterations, started );
+
+	started = regsim_now();
+	for ( i = 0 ; i < iterations ; i++ )
+		regsim_store_tcpip_parameters ( ip_addresses[ i & 1 ], NULL );
+	regsim_report ( "store_tcpip (changed)", iterations, started );
+}
+
+/**
+ * Main entry point
+ *
+ * @v argc		Number of arguments
+ * @v argv		Arguments
+ * @ret exit		Exit status
+ */
+int main ( int argc, char **argv ) {
+	UNICODE_STRING driver_key;
+	unsigned long iterations = REGSIM_ITERATIONS;
+	NTSTATUS status;
+
+	if ( ( argc < 2 ) || ( argc > 3 ) ) {
+		fprintf ( stderr, "Usage: %s <fixture> [iterations]\n",
+			  argv[0] );
+		return 2;
+	}
+	if ( argc > 2 )
+		iterations = strtoul ( argv[2], NULL, 0 );
+
+	/* Load fixture and select in-memory backend */
+	status = regmem_load ( argv[1] );
+	if ( ! NT_SUCCESS ( status ) )
+		return 1;
+	reg_set_backend ( &regmem_backend );
+	RtlInitUnicodeString ( &driver_key, REGSIM_DRIVER_KEY );
+	status = reg_init_parameters ( &driver_key );
+	if ( ! NT_SUCCESS ( status ) )
+		return 1;
+
+	/* Check results, then measure */
+	regsim_check_fixture();
+	if ( iterations )
+		regsim_benchmark ( iterations );
+
+	regmem_free();
+	if ( regsim_failures ) {
+		printf ( "%d check(s) failed\n", regsim_failures );
+		return 1;
+	}
+	return 0;
+}
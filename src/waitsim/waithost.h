@@ -0,0 +1,41 @@
+#ifndef _WAITHOST_H
+#define _WAITHOST_H
+
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * Host definitions for building the system disk wait schedule
+ *
+ * These stand in for the few <ntddk.h> types used by wait.c and
+ * wait.h, so that the wait schedule can be built as a user-mode
+ * program.
+ */
+
+#include <stdint.h>
+
+#define VOID void
+typedef uint8_t BOOLEAN;
+typedef uint32_t ULONG, *PULONG;
+typedef uint64_t ULONGLONG;
+
+#define TRUE 1
+#define FALSE 0
+
+#endif /* _WAITHOST_H */
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2008 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ *
+ * System disk wait simulator
+ *
+ * This replays the driver's system disk wait loop against scripted
+ * disk arrival timelines using a virtual clock, and reports the time
+ * to detection and the number of checks and probes made by each wait
+ * policy.  Only the wait schedule is shared with the driver, by
+ * building its own wait.c.  The loops in sanbootconf_wait() and
+ * find_system_disk() are not shared: sim_wait() and
+ * sim_find_system_disk() are separate copies operating on the virtual
+ * clock, and must be kept in step with the driver by hand.
+ *
+ * This is a user-mode program, and is built on the host using e.g.
+ *
+ *   cc -DWAIT_HOST -I. -I../driver -o waitsim waitsim.c ../driver/wait.c
+ */
+
+#include <stdio.h>
+#include "waithost.h"
+#include "wait.h"
+
+/** System disk never appears */
+#define SIM_NEVER 0xffffffffUL
+
+/** Virtual time taken to probe a disk, in milliseconds */
+#define SIM_PROBE_COST 1
+
+/** A scripted disk arrival timeline */
+typedef struct _SIM_SCENARIO {
+	/** Name */
+	const char *name;
+	/** Number of other disks, present throughout */
+	ULONG other_disks;
+	/** Time at which system disk appears, in milliseconds */
+	ULONG arrival;
+} SIM_SCENARIO, *PSIM_SCENARIO;
+
+/** A wait policy */
+typedef struct _SIM_POLICY {
+	/** Name */
+	const char *name;
+	/** Initial delay between checks, in milliseconds */
+	ULONG initial_delay;
+	/** Growth of delay between checks, in percent */
+	ULONG growth;
+	/** Maximum delay between checks, in milliseconds */
+	ULONG max_delay;
+	/** Waiting is ended early by disk arrival notification */
+	BOOLEAN notify;
+} SIM_POLICY, *PSIM_POLICY;
+
+/** Scripted disk arrival timelines */
+static SIM_SCENARIO sim_scenarios[] = {
+	{ "present at start", 2, 0 },
+	{ "arrives at 50ms", 2, 50 },
+	{ "arrives at 750ms", 2, 750 },
+	{ "arrives at 5s", 2, 5000 },
+	{ "arrives at 5s, 16 disks", 16, 5000 },
+	{ "arrives at 30s", 2, 30000 },
+	{ "never arrives", 2, SIM_NEVER },
+};
+
+/** Wait policies */
+static SIM_POLICY sim_policies[] = {
+	{ "poll 100ms", 100, 100, 100, FALSE },
+	{ "poll 1s", 1000, 100, 1000, FALSE },
+	{ "backoff", WAIT_INITIAL_DELAY, WAIT_GROWTH, WAIT_MAX_DELAY, FALSE },
+	{ "notify", WAIT_DEADLINE, 100, WAIT_DEADLINE, TRUE },
+};
+
+/** Virtual clock, in milliseconds */
+static ULONGLONG sim_now;
+
+/** Current scenario */
+static PSIM_SCENARIO sim_scenario;
+
+/** Current policy */
+static PSIM_POLICY sim_policy;
+
+/**
+ * Enumerate disks (stands in for IoGetDeviceInterfaces())
+ *
+ * @ret count		Number of disk interfaces present
+ *
+ * The system disk, if present, is enumerated after all other disks.
+ */
+static ULONG sim_get_device_interfaces ( VOID ) {
+	ULONG count = sim_scenario->other_disks;
+
+	if ( sim_now >= sim_scenario->arrival )
+		count++;
+	return count;
+}
+
+/**
+ * Probe disk (stands in for IoGetDeviceObjectPointer() and
+ * IoCallDriver())
+ *
+ * @v index		Disk index
+ * @ret is_system	Disk is the system disk
+ */
+static BOOLEAN sim_check_system_disk ( ULONG index ) {
+
+	sim_now += SIM_PROBE_COST;
+	return ( ( BOOLEAN ) ( index == sim_scenario->other_disks ) );
+}
+
+/**
+ * Sleep (stands in for KeDelayExecutionThread())
+ *
+ * @v delay		Delay, in milliseconds
+ *
+ * A notification-driven policy is woken early if the system disk
+ * arrives during the delay.
+ */
+static VOID sim_delay_execution_thread ( ULONG delay ) {
+	ULONGLONG wake = ( sim_now + delay );
+
+	if ( sim_policy->notify && ( sim_now < sim_scenario->arrival ) &&
+	     ( wake > sim_scenario->arrival ) )
+		wake = sim_scenario->arrival;
+	sim_now = wake;
+}
+
+/**
+ * Find system disk, as per find_system_disk()
+ *
+ * @v probes		Number of disks probed
+ * @ret found		System disk was found
+ */
+static BOOLEAN sim_find_system_disk ( PULONG probes ) {
+	ULONG count;
+	ULONG i;
+
+	count = sim_get_device_interfaces();
+	for ( i = 0 ; i < count ; i++ ) {
+		(*probes)++;
+		if ( sim_check_system_disk ( i ) )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * Wait for system disk, as per sanbootconf_wait()
+ *
+ * @v wait		Wait schedule
+ * @ret found		System disk was found
+ */
+static BOOLEAN sim_wait ( PWAIT_SCHEDULE wait ) {
+	ULONG delay;
+	BOOLEAN found;
+
+	wait_start ( wait, sim_now );
+	while ( 1 ) {
+		wait_check ( wait, sim_now );
+		found = sim_find_system_disk ( &wait->probes );
+		if ( found || ! wait_next ( wait, &delay ) )
+			break;
+		sim_delay_execution_thread ( delay );
+	}
+	/* Include time spent probing in the total */
+	wait->elapsed = ( sim_now - wait->started );
+	return found;
+}
+
+/**
+ * Main entry point
+ *
+ * @ret exit		Exit status
+ */
+int main ( void ) {
+	WAIT_SCHEDULE wait;
+	BOOLEAN found;
+	unsigned int i;
+	unsigned int j;
+
+	printf ( "%-24s %-12s %10s %8s %8s\n", "scenario", "policy",
+		 "detect ms", "checks", "probes" );
+	for ( i = 0 ; i < ( sizeof ( sim_scenarios ) /
+			    sizeof ( sim_scenarios[0] ) ) ; i++ ) {
+		sim_scenario = &sim_scenarios[i];
+		for ( j = 0 ; j < ( sizeof ( sim_policies ) /
+				    sizeof ( sim_policies[0] ) ) ; j++ ) {
+			sim_policy = &sim_policies[j];
+			wait.initial_delay = sim_policy->initial_delay;
+			wait.growth = sim_policy->growth;
+			wait.max_delay = sim_policy->max_delay;
+			wait.deadline = WAIT_DEADLINE;
+			sim_now = 0;
+			found = sim_wait ( &wait );
+			printf ( "%-24s %-12s ", sim_scenario->name,
+				 sim_policy->name );
+			if ( found ) {
+				printf ( "%10lu", ( ( unsigned long )
+						    wait.elapsed ) );
+			} else {
+				printf ( "%10s", "timeout" );
+			}
+			printf ( " %8lu %8lu\n",
+				 ( ( unsigned long ) wait.attempts ),
+				 ( ( unsigned long ) wait.probes ) );
+		}
+	}
+
+	return 0;
+}